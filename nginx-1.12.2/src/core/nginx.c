@@ -25,6 +25,8 @@ static char *ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_set_cache_manager_processes(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 static char *ngx_load_module(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 #if (NGX_HAVE_DLOPEN)
 static void ngx_unload_module(void *data);
@@ -83,6 +85,13 @@ static ngx_command_t  ngx_core_commands[] = {
       0,
       NULL },
 
+    { ngx_string("cache_manager_processes"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_set_cache_manager_processes,
+      0,
+      0,
+      NULL },
+
     { ngx_string("debug_points"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_enum_slot,
@@ -1132,6 +1141,7 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->shutdown_timeout = NGX_CONF_UNSET_MSEC;
 
     ccf->worker_processes = NGX_CONF_UNSET;
+    ccf->cache_manager_processes = NGX_CONF_UNSET;
     ccf->debug_points = NGX_CONF_UNSET;
 
     ccf->rlimit_nofile = NGX_CONF_UNSET;
@@ -1170,6 +1180,7 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
 
     // 默认 1 个 worker 进程
     ngx_conf_init_value(ccf->worker_processes, 1);
+    ngx_conf_init_value(ccf->cache_manager_processes, 1);
     // 默认关闭 debug_points
     ngx_conf_init_value(ccf->debug_points, 0);
 
@@ -1672,6 +1683,40 @@ ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static char *
+ngx_set_cache_manager_processes(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_str_t        *value;
+    ngx_core_conf_t  *ccf;
+
+    ccf = (ngx_core_conf_t *) conf;
+
+    if (ccf->cache_manager_processes != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    /* "auto" is resolved to one process per cache path on start */
+
+    if (ngx_strcmp(value[1].data, "auto") == 0) {
+        ccf->cache_manager_processes = 0;
+        return NGX_CONF_OK;
+    }
+
+    ccf->cache_manager_processes = ngx_atoi(value[1].data, value[1].len);
+
+    if (ccf->cache_manager_processes == NGX_ERROR
+        || ccf->cache_manager_processes == 0)
+    {
+        return "invalid value";
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 /*
  * brief  : 加载动态模块.
  * return : "is specified too late"
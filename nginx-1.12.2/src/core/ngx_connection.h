@@ -177,6 +177,7 @@ struct ngx_connection_s {
 
     unsigned            sendfile:1;
     unsigned            sndlowat:1;
+    unsigned            notsent_lowat:1;
     unsigned            tcp_nodelay:2;   /* ngx_connection_tcp_nodelay_e */
     unsigned            tcp_nopush:2;    /* ngx_connection_tcp_nopush_e */
 
@@ -123,6 +123,7 @@ typedef struct {
     ngx_msec_t                shutdown_timeout;
 
     ngx_int_t                 worker_processes;
+    ngx_int_t                 cache_manager_processes;
     ngx_int_t                 debug_points;
 
     ngx_int_t                 rlimit_nofile;
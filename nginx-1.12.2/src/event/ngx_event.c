@@ -900,6 +900,50 @@ ngx_send_lowat(ngx_connection_t *c, size_t lowat)
 }
 
 
+ngx_int_t
+ngx_notsent_lowat(ngx_connection_t *c, size_t lowat)
+{
+#if (NGX_HAVE_TCP_NOTSENT_LOWAT)
+
+    int  notsent;
+
+    if (lowat == 0 || c->notsent_lowat) {
+        return NGX_OK;
+    }
+
+    /* the option is tried once per connection, and not on unix sockets */
+
+    c->notsent_lowat = 1;
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    if (c->sockaddr->sa_family == AF_UNIX) {
+        return NGX_OK;
+    }
+#endif
+
+    /*
+     * the socket is reported as writable only when the amount
+     * of unsent data is below the watermark, so the send buffer
+     * holds mostly the data in flight
+     */
+
+    notsent = (int) lowat;
+
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   (const void *) &notsent, sizeof(int))
+        == -1)
+    {
+        ngx_connection_error(c, ngx_socket_errno,
+                             "setsockopt(TCP_NOTSENT_LOWAT) failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
 static char *
 ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -524,6 +524,7 @@ u_char *ngx_acceptex_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 
 ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
+ngx_int_t ngx_notsent_lowat(ngx_connection_t *c, size_t lowat);
 
 
 /* used in ngx_log_debugX() */
@@ -44,10 +44,13 @@ typedef enum {
 
 
 typedef struct {
-    ngx_http_expires_t         expires;
-    time_t                     expires_time;
-    ngx_http_complex_value_t  *expires_value;
-    ngx_array_t               *headers;
+    ngx_http_expires_t          expires;
+    time_t                      expires_time;
+    ngx_http_complex_value_t   *expires_value;
+    ngx_array_t                *headers;
+
+    /* leading static headers, for other and for successful statuses */
+    ngx_http_header_template_t  templates[2];
 } ngx_http_headers_conf_t;
 
 
@@ -63,6 +66,8 @@ static ngx_int_t ngx_http_set_last_modified(ngx_http_request_t *r,
     ngx_http_header_val_t *hv, ngx_str_t *value);
 static ngx_int_t ngx_http_set_response_header(ngx_http_request_t *r,
     ngx_http_header_val_t *hv, ngx_str_t *value);
+static ngx_int_t ngx_http_headers_init_templates(ngx_conf_t *cf,
+    ngx_http_headers_conf_t *conf);
 
 static void *ngx_http_headers_create_conf(ngx_conf_t *cf);
 static char *ngx_http_headers_merge_conf(ngx_conf_t *cf,
@@ -149,10 +154,12 @@ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_int_t
 ngx_http_headers_filter(ngx_http_request_t *r)
 {
-    ngx_str_t                 value;
-    ngx_uint_t                i, safe_status;
-    ngx_http_header_val_t    *h;
-    ngx_http_headers_conf_t  *conf;
+    ngx_str_t                    value;
+    ngx_uint_t                   i, n, safe_status;
+    ngx_table_elt_t             *e;
+    ngx_http_header_val_t       *h;
+    ngx_http_headers_conf_t     *conf;
+    ngx_http_header_template_t  *tpl;
 
     conf = ngx_http_get_module_loc_conf(r, ngx_http_headers_filter_module);
 
@@ -188,6 +195,9 @@ ngx_http_headers_filter(ngx_http_request_t *r)
     }
 
     if (conf->headers) {
+        tpl = &conf->templates[safe_status];
+        n = 0;
+
         h = conf->headers->elts;
         for (i = 0; i < conf->headers->nelts; i++) {
 
@@ -195,6 +205,27 @@ ngx_http_headers_filter(ngx_http_request_t *r)
                 continue;
             }
 
+            if (n < tpl->nelts) {
+
+                /* static headers, the header filter uses tpl->text */
+
+                e = ngx_list_push(&r->headers_out.headers);
+                if (e == NULL) {
+                    return NGX_ERROR;
+                }
+
+                e->hash = 1;
+                e->key = h[i].key;
+                e->value = h[i].value.value;
+
+                if (n++ == 0) {
+                    r->headers_out.header_template = tpl;
+                    r->headers_out.header_template_start = e;
+                }
+
+                continue;
+            }
+
             if (ngx_http_complex_value(r, &h[i].value, &value) != NGX_OK) {
                 return NGX_ERROR;
             }
@@ -557,6 +588,7 @@ ngx_http_headers_create_conf(ngx_conf_t *cf)
      *     conf->headers = NULL;
      *     conf->expires_time = 0;
      *     conf->expires_value = NULL;
+     *     conf->templates = { 0 };
      */
 
     conf->expires = NGX_HTTP_EXPIRES_UNSET;
@@ -585,10 +617,90 @@ ngx_http_headers_merge_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->headers = prev->headers;
     }
 
+    if (conf->headers) {
+        if (ngx_http_headers_init_templates(cf, conf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_http_headers_init_templates(ngx_conf_t *cf, ngx_http_headers_conf_t *conf)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_uint_t                   i, n, safe_status;
+    ngx_http_header_val_t       *h;
+    ngx_http_header_template_t  *tpl;
+
+    /*
+     * the leading headers with static values are serialized once,
+     * the serialization stops at the first header with variables
+     * to preserve the order of headers
+     */
+
+    h = conf->headers->elts;
+
+    for (safe_status = 0; safe_status < 2; safe_status++) {
+
+        len = 0;
+        n = 0;
+
+        for (i = 0; i < conf->headers->nelts; i++) {
+
+            if (!safe_status && !h[i].always) {
+                continue;
+            }
+
+            if (h[i].handler != ngx_http_add_header
+                || h[i].value.lengths
+                || h[i].value.value.len == 0)
+            {
+                break;
+            }
+
+            len += h[i].key.len + sizeof(": ") - 1
+                   + h[i].value.value.len + sizeof(CRLF) - 1;
+            n++;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        p = ngx_pnalloc(cf->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        tpl = &conf->templates[safe_status];
+
+        tpl->text.len = len;
+        tpl->text.data = p;
+        tpl->nelts = n;
+
+        for (i = 0; n; i++) {
+
+            if (!safe_status && !h[i].always) {
+                continue;
+            }
+
+            p = ngx_copy(p, h[i].key.data, h[i].key.len);
+            *p++ = ':'; *p++ = ' ';
+            p = ngx_copy(p, h[i].value.value.data, h[i].value.value.len);
+            *p++ = CR; *p++ = LF;
+
+            n--;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_headers_filter_init(ngx_conf_t *cf)
 {
@@ -556,6 +556,13 @@ static ngx_command_t  ngx_http_proxy_commands[] = {
       offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_background_update),
       NULL },
 
+    { ngx_string("proxy_cache_partial"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_proxy_loc_conf_t, upstream.cache_partial),
+      NULL },
+
 #endif
 
     { ngx_string("proxy_temp_path"),
@@ -1157,6 +1164,9 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     ngx_http_script_engine_t      e, le;
     ngx_http_proxy_loc_conf_t    *plcf;
     ngx_http_script_len_code_pt   lcode;
+#if (NGX_HTTP_CACHE)
+    ngx_http_cache_t             *c;
+#endif
 
     u = r->upstream;
 
@@ -1292,6 +1302,22 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
         }
     }
 
+#if (NGX_HTTP_CACHE)
+
+    c = r->cache;
+
+    if (c && c->partial_store) {
+        len += sizeof("Range: bytes=-" CRLF) - 1 + 2 * NGX_OFF_T_LEN;
+
+        if (c->partial_update) {
+            len += sizeof("If-Range: " CRLF) - 1
+                   + ngx_max(c->etag.len,
+                             sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1);
+        }
+    }
+
+#endif
+
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
@@ -1428,6 +1454,38 @@ ngx_http_proxy_create_request(ngx_http_request_t *r)
     }
 
 
+#if (NGX_HTTP_CACHE)
+
+    if (c && c->partial_store) {
+
+        /* a missing part of a partially cached response */
+
+        if (c->partial_end == -1) {
+            b->last = ngx_sprintf(b->last, "Range: bytes=%O-" CRLF,
+                                  c->partial_start);
+
+        } else {
+            b->last = ngx_sprintf(b->last, "Range: bytes=%O-%O" CRLF,
+                                  c->partial_start, c->partial_end);
+        }
+
+        if (c->partial_update) {
+            b->last = ngx_cpymem(b->last, "If-Range: ",
+                                 sizeof("If-Range: ") - 1);
+
+            if (c->etag.len && c->etag.data[0] == '"') {
+                b->last = ngx_copy(b->last, c->etag.data, c->etag.len);
+
+            } else {
+                b->last = ngx_http_time(b->last, c->last_modified);
+            }
+
+            *b->last++ = CR; *b->last++ = LF;
+        }
+    }
+
+#endif
+
     /* add "\r\n" at the header end */
     *b->last++ = CR; *b->last++ = LF;
 
@@ -2872,6 +2930,7 @@ ngx_http_proxy_create_loc_conf(ngx_conf_t *cf)
     conf->upstream.cache_revalidate = NGX_CONF_UNSET;
     conf->upstream.cache_convert_head = NGX_CONF_UNSET;
     conf->upstream.cache_background_update = NGX_CONF_UNSET;
+    conf->upstream.cache_partial = NGX_CONF_UNSET_SIZE;
 #endif
 
     conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
@@ -3180,6 +3239,9 @@ ngx_http_proxy_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->upstream.cache_background_update,
                               prev->upstream.cache_background_update, 0);
 
+    ngx_conf_merge_size_value(conf->upstream.cache_partial,
+                              prev->upstream.cache_partial, 0);
+
 #endif
 
     if (conf->method == NULL) {
@@ -22,9 +22,34 @@ typedef struct {
 } ngx_http_upstream_chash_points_t;
 
 
+#define NGX_HTTP_UPSTREAM_MAGLEV_SIZE   65537
+#define NGX_HTTP_UPSTREAM_MAGLEV_EMPTY  0xffffffff
+
+
+typedef struct {
+    ngx_uint_t                          size;
+    ngx_uint_t                          number;
+    uint32_t                           *lookup;
+
+    /* addresses of the peers the table was built for */
+    ngx_str_t                          *name;
+
+    /*
+     * peers by index and their positions in the list, filled in each
+     * worker on first use and after servers are added or removed
+     */
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_uint_t                          config;
+    ngx_http_upstream_rr_peer_t       **peer;
+    ngx_uint_t                         *index;
+} ngx_http_upstream_maglev_t;
+
+
 typedef struct {
     ngx_http_complex_value_t            key;
     ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_uint_t                          bounded;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -58,6 +83,21 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static void ngx_http_upstream_maglev_map(ngx_http_upstream_maglev_t *maglev,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t config);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
+static ngx_uint_t ngx_http_upstream_hash_load(
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_uint_t ngx_http_upstream_hash_overloaded(
+    ngx_http_upstream_hash_srv_conf_t *hcf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t load);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -66,7 +106,7 @@ static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_hash,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -178,7 +218,19 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single) {
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config
+        && hp->rrp.config != *hp->rrp.peers->config)
+    {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+#endif
+
+    if (hp->tries > 20
+        || hp->rrp.peers->single
+        || hp->rrp.peers->number == 0)
+    {
         ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -231,7 +283,7 @@ ngx_http_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "get hash peer, value:%uD, peer:%ui", hp->hash, p);
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down || peer->ejected) {
             goto next;
         }
 
@@ -300,6 +352,13 @@ ngx_http_upstream_init_chash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
     us->peer.init = ngx_http_upstream_init_chash_peer;
 
     peers = us->peer.data;
+
+    if (peers->number == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no servers resolved at startup in upstream \"%V\" "
+                      "in %s:%ui", &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
     npoints = peers->total_weight * 160;
 
     size = sizeof(ngx_http_upstream_chash_points_t)
@@ -492,7 +551,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                            m;
     ngx_str_t                          *server;
     ngx_int_t                           total;
-    ngx_uint_t                          i, n, best_i;
+    ngx_uint_t                          i, n, best_i, load;
     ngx_http_upstream_rr_peer_t        *peer, *best;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
@@ -503,6 +562,15 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config
+        && hp->rrp.config != *hp->rrp.peers->config)
+    {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+#endif
+
     pc->cached = 0;
     pc->connection = NULL;
 
@@ -512,6 +580,8 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    load = hcf->bounded ? ngx_http_upstream_hash_load(hp->rrp.peers) : 0;
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -534,7 +604,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->hc_down || peer->ejected) {
                 continue;
             }
 
@@ -556,6 +626,13 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (hcf->bounded
+                && ngx_http_upstream_hash_overloaded(hcf, hp->rrp.peers, peer,
+                                                     load))
+            {
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -609,6 +686,367 @@ found:
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    uint32_t                           *lookup;
+    ngx_uint_t                          size, n, i, j, w, c, filled;
+    ngx_uint_t                         *offset, *skip;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+    peers = us->peer.data;
+
+    if (peers->number == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no servers resolved at startup in upstream \"%V\" "
+                      "in %s:%ui", &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+    n = peers->number;
+
+    /*
+     * the table size is a prime well above the number of weighted
+     * peers, so that each peer's permutation covers all entries and
+     * the shares of peers differ by no more than about one percent
+     */
+
+    size = ngx_max(NGX_HTTP_UPSTREAM_MAGLEV_SIZE, peers->total_weight * 100);
+
+    for ( ;; size++) {
+        for (i = 2; i * i <= size; i++) {
+            if (size % i == 0) {
+                break;
+            }
+        }
+
+        if (i * i > size) {
+            break;
+        }
+    }
+
+    maglev = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_maglev_t));
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    lookup = ngx_palloc(cf->pool, size * sizeof(uint32_t));
+    if (lookup == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->peer = ngx_pcalloc(cf->pool,
+                               n * sizeof(ngx_http_upstream_rr_peer_t *));
+    if (maglev->peer == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->index = ngx_pcalloc(cf->pool, n * sizeof(ngx_uint_t));
+    if (maglev->index == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->name = ngx_palloc(cf->pool, n * sizeof(ngx_str_t));
+    if (maglev->name == NULL) {
+        return NGX_ERROR;
+    }
+
+    offset = ngx_alloc(2 * n * sizeof(ngx_uint_t), cf->log);
+    if (offset == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = offset + n;
+
+    /*
+     * each peer prefers table entries in the order offset + j * skip,
+     * the peers take turns, as many per round as their weight, to claim
+     * the next preferred entry which is still empty
+     */
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        maglev->name[i] = peer->name;
+
+        offset[i] = ngx_crc32_long(peer->name.data, peer->name.len) % size;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (size - 1) + 1;
+    }
+
+    ngx_memset(lookup, 0xff, size * sizeof(uint32_t));
+
+    filled = 0;
+
+#if (NGX_SUPPRESS_WARN)
+    c = 0;
+#endif
+
+    for ( ;; ) {
+        for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+
+            for (w = 0; w < (ngx_uint_t) peer->weight; w++) {
+
+                for (j = 0; j < size; j++) {
+                    c = offset[i];
+                    offset[i] = (offset[i] + skip[i]) % size;
+
+                    if (lookup[c] == NGX_HTTP_UPSTREAM_MAGLEV_EMPTY) {
+                        break;
+                    }
+                }
+
+                lookup[c] = (uint32_t) i;
+
+                if (++filled == size) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(offset);
+
+    maglev->size = size;
+    maglev->number = n;
+    maglev->lookup = lookup;
+    maglev->peers = NULL;
+    maglev->config = 0;
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hp = r->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_maglev_map(ngx_http_upstream_maglev_t *maglev,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t config)
+{
+    ngx_uint_t                    i, j;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    if (config == 0) {
+        for (peer = peers->peer, i = 0;
+             peer && i < maglev->number;
+             peer = peer->next, i++)
+        {
+            maglev->peer[i] = peer;
+            maglev->index[i] = i;
+        }
+
+        return;
+    }
+
+    /*
+     * after servers are added or removed at runtime, table entries
+     * are matched to peers by address: entries of removed servers are
+     * skipped, and a server added back gets its entries again; other
+     * added servers are not in the table and only get requests through
+     * round robin
+     */
+
+    for (i = 0; i < maglev->number; i++) {
+        maglev->peer[i] = NULL;
+
+        for (peer = peers->peer, j = 0; peer; peer = peer->next, j++) {
+            if (peer->name.len == maglev->name[i].len
+                && ngx_strncmp(peer->name.data, maglev->name[i].data,
+                               peer->name.len)
+                   == 0)
+            {
+                maglev->peer[i] = peer;
+                maglev->index[i] = j;
+                break;
+            }
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                              now;
+    uintptr_t                           m;
+    ngx_uint_t                          n, p, load;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev hash peer, try: %ui", pc->tries);
+
+    ngx_http_upstream_rr_peers_wlock(hp->rrp.peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config
+        && hp->rrp.config != *hp->rrp.peers->config)
+    {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+#endif
+
+    if (hp->tries > 20 || hp->rrp.peers->single) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    hcf = hp->conf;
+    maglev = hcf->maglev;
+
+    if (maglev->peers != hp->rrp.peers || maglev->config != hp->rrp.config) {
+        ngx_http_upstream_maglev_map(maglev, hp->rrp.peers, hp->rrp.config);
+
+        maglev->peers = hp->rrp.peers;
+        maglev->config = hp->rrp.config;
+    }
+
+    load = hcf->bounded ? ngx_http_upstream_hash_load(hp->rrp.peers) : 0;
+
+    for ( ;; ) {
+
+        /* the following entries are tried on failures */
+
+        p = maglev->lookup[(hp->hash + hp->tries) % maglev->size];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get maglev hash peer, value:%uD, peer:%ui",
+                       hp->hash, p);
+
+        if (peer == NULL) {
+            goto next;
+        }
+
+        n = maglev->index[p] / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << maglev->index[p] % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        if (peer->down || peer->hc_down || peer->ejected) {
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            goto next;
+        }
+
+        if (hcf->bounded
+            && ngx_http_upstream_hash_overloaded(hcf, hp->rrp.peers, peer,
+                                                 load))
+        {
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_hash_load(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                    load;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    load = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        load += peer->conns;
+    }
+
+    return load;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_hash_overloaded(ngx_http_upstream_hash_srv_conf_t *hcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t load)
+{
+    /*
+     * consistent hashing with bounded loads: a peer may not have more
+     * than the load factor times its weighted share of all requests,
+     * including the one being balanced
+     */
+
+    return (uint64_t) peer->conns * 100 * peers->total_weight
+           >= (uint64_t) hcf->bounded * (load + 1) * peer->weight;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -620,6 +1058,8 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
+    conf->bounded = 0;
 
     return conf;
 }
@@ -630,7 +1070,9 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                          n;
     ngx_str_t                         *value;
+    ngx_uint_t                         i;
     ngx_http_upstream_srv_conf_t      *uscf;
     ngx_http_compile_complex_value_t   ccv;
 
@@ -660,15 +1102,45 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                   |NGX_HTTP_UPSTREAM_DOWN;
 
-    if (cf->args->nelts == 2) {
-        uscf->peer.init_upstream = ngx_http_upstream_init_hash;
+    uscf->peer.init_upstream = ngx_http_upstream_init_hash;
 
-    } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
-        uscf->peer.init_upstream = ngx_http_upstream_init_chash;
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    } else {
+        if (i == 2 && ngx_strcmp(value[i].data, "consistent") == 0) {
+            uscf->peer.init_upstream = ngx_http_upstream_init_chash;
+            continue;
+        }
+
+        if (i == 2 && ngx_strcmp(value[i].data, "maglev") == 0) {
+            uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bounded=", 8) == 0) {
+
+            n = ngx_atofp(value[i].data + 8, value[i].len - 8, 2);
+
+            if (n == NGX_ERROR || n <= 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid load factor \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            hcf->bounded = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (hcf->bounded
+        && uscf->peer.init_upstream == ngx_http_upstream_init_hash)
+    {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
+                           "\"bounded\" requires \"consistent\" "
+                           "or \"maglev\"");
         return NGX_CONF_ERROR;
     }
 
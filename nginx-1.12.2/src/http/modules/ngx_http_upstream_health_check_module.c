@@ -0,0 +1,1011 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_HTTP         0
+#define NGX_HTTP_UPSTREAM_HC_TCP          1
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE  16384
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+
+    ngx_uint_t                         type;
+    ngx_uint_t                         status_min;
+    ngx_uint_t                         status_max;
+    ngx_str_t                          body;
+    ngx_str_t                          request;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_event_t                        event;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct ngx_http_upstream_hc_peer_s  ngx_http_upstream_hc_peer_t;
+
+struct ngx_http_upstream_hc_peer_s {
+    ngx_http_upstream_hc_srv_conf_t   *conf;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+    ngx_uint_t                         config;
+
+    ngx_pool_t                        *pool;
+    ngx_log_t                          log;
+    ngx_peer_connection_t              pc;
+    ngx_str_t                          name;
+
+    ngx_buf_t                         *request;
+    ngx_buf_t                         *response;
+    ngx_uint_t                         status;
+
+    unsigned                           connected:1;
+
+    ngx_http_upstream_hc_peer_t       *next;
+};
+
+
+static void ngx_http_upstream_hc_handler(ngx_event_t *ev);
+static ngx_http_upstream_hc_peer_t *ngx_http_upstream_hc_create_peer(
+    ngx_http_upstream_hc_srv_conf_t *hccf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t done);
+static void ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t ok);
+static ngx_int_t ngx_http_upstream_hc_test_connect(ngx_connection_t *c);
+static u_char *ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                        now;
+    ngx_uint_t                        i;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_peer_t      *hp, *list;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = ev->data;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http upstream health check \"%V\"", &hccf->upstream->host);
+
+    /*
+     * every worker runs the timer, and a peer is claimed for a check
+     * by moving its shared check time forward under the peers lock,
+     * so each peer is probed by one worker per interval
+     */
+
+    now = ngx_current_msec;
+    list = NULL;
+
+    peers = hccf->upstream->peer.data;
+
+    for (i = 0; peers && i < 2; i++, peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down) {
+                continue;
+            }
+
+            if ((ngx_msec_int_t) (now - peer->hc_next) < 0) {
+                continue;
+            }
+
+            peer->hc_next = now + hccf->interval;
+
+            hp = ngx_http_upstream_hc_create_peer(hccf, peers, peer);
+            if (hp == NULL) {
+                continue;
+            }
+
+            hp->next = list;
+            list = hp;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    while (list) {
+        hp = list;
+        list = hp->next;
+
+        ngx_http_upstream_hc_connect(hp);
+    }
+
+    ngx_add_timer(ev, hccf->interval);
+}
+
+
+static ngx_http_upstream_hc_peer_t *
+ngx_http_upstream_hc_create_peer(ngx_http_upstream_hc_srv_conf_t *hccf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_pool_t                   *pool;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    hp = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_peer_t));
+    if (hp == NULL) {
+        goto failed;
+    }
+
+    hp->conf = hccf;
+    hp->peers = peers;
+    hp->peer = peer;
+    hp->config = *peers->config;
+    hp->pool = pool;
+
+    /* the peer may live in shared memory, so its address is copied */
+
+    hp->pc.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (hp->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(hp->pc.sockaddr, peer->sockaddr, peer->socklen);
+    hp->pc.socklen = peer->socklen;
+
+    hp->name.data = ngx_pstrdup(pool, &peer->name);
+    if (hp->name.data == NULL) {
+        goto failed;
+    }
+
+    hp->name.len = peer->name.len;
+
+    hp->log = *ngx_cycle->log;
+    hp->log.handler = ngx_http_upstream_hc_log_error;
+    hp->log.data = hp;
+    hp->log.action = "health checking";
+
+    pool->log = &hp->log;
+
+    hp->pc.name = &hp->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = &hp->log;
+    hp->pc.log_error = NGX_ERROR_ERR;
+
+    return hp;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp)
+{
+    ngx_int_t                         rc;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = hp->conf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "http upstream health check connect: %V", &hp->name);
+
+    if (hccf->type == NGX_HTTP_UPSTREAM_HC_HTTP) {
+        hp->request = ngx_calloc_buf(hp->pool);
+        if (hp->request == NULL) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        hp->request->pos = hccf->request.data;
+        hp->request->last = hccf->request.data + hccf->request.len;
+
+        hp->response = ngx_create_temp_buf(hp->pool,
+                                           NGX_HTTP_UPSTREAM_HC_BUFFER_SIZE);
+        if (hp->response == NULL) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+    }
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+
+    c->write->handler = ngx_http_upstream_hc_send_handler;
+    c->read->handler = ngx_http_upstream_hc_recv_handler;
+
+    ngx_add_timer(c->read, hccf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hc_send_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    ssize_t                        n;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_peer_t   *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http upstream health check send handler");
+
+    if (!hp->connected) {
+
+        if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        hp->connected = 1;
+
+        if (hp->conf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+            ngx_http_upstream_hc_finalize(hp, 1);
+            return;
+        }
+    }
+
+    b = hp->request;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    wev->handler = ngx_http_upstream_hc_dummy_handler;
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_recv_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_recv_handler(ngx_event_t *rev)
+{
+    ssize_t                        n;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_connection_t              *c;
+    ngx_http_upstream_hc_peer_t   *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                   "http upstream health check recv handler");
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT,
+                      "health check timed out");
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (!hp->connected) {
+        ngx_http_upstream_hc_send_handler(c->write);
+        return;
+    }
+
+    if (hp->response == NULL) {
+        return;
+    }
+
+    b = hp->response;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            rc = ngx_http_upstream_hc_parse(hp, 1);
+            ngx_http_upstream_hc_finalize(hp, rc == NGX_OK);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        if (n == 0) {
+            rc = ngx_http_upstream_hc_parse(hp, 1);
+            ngx_http_upstream_hc_finalize(hp, rc == NGX_OK);
+            return;
+        }
+
+        b->last += n;
+
+        rc = ngx_http_upstream_hc_parse(hp, 0);
+
+        if (rc != NGX_AGAIN) {
+            ngx_http_upstream_hc_finalize(hp, rc == NGX_OK);
+            return;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp, ngx_uint_t done)
+{
+    u_char                           *p, *last, *body;
+    ngx_buf_t                        *b;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = hp->conf;
+    b = hp->response;
+
+    if (hp->status == 0) {
+
+        /* "HTTP/1.x 200 OK" */
+
+        last = ngx_strlchr(b->pos, b->last, LF);
+
+        if (last == NULL) {
+            if (done) {
+                goto premature;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        p = b->pos;
+
+        if (last - p < 12 || ngx_strncmp(p, "HTTP/", 5) != 0) {
+            goto invalid;
+        }
+
+        p = ngx_strlchr(p + 5, last, ' ');
+
+        if (p == NULL || last - p < 4) {
+            goto invalid;
+        }
+
+        hp->status = ngx_atoi(p + 1, 3);
+
+        if (hp->status == (ngx_uint_t) NGX_ERROR || hp->status < 100) {
+            goto invalid;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                       "http upstream health check status: %ui", hp->status);
+
+        if (hp->status < hccf->status_min || hp->status > hccf->status_max) {
+            ngx_log_error(NGX_LOG_ERR, &hp->log, 0,
+                          "health check status %ui does not match",
+                          hp->status);
+            return NGX_ERROR;
+        }
+    }
+
+    if (hccf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    body = ngx_strlcasestrn(b->pos, b->last, (u_char *) CRLF CRLF, 4 - 1);
+
+    if (body == NULL) {
+        if (done) {
+            goto premature;
+        }
+
+        return NGX_AGAIN;
+    }
+
+    body += 4;
+    last = b->last - hccf->body.len;
+
+    for (p = body; p <= last; p++) {
+        if (ngx_memcmp(p, hccf->body.data, hccf->body.len) == 0) {
+            return NGX_OK;
+        }
+    }
+
+    if (!done) {
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, &hp->log, 0,
+                  "health check response body does not match");
+
+    return NGX_ERROR;
+
+premature:
+
+    ngx_log_error(NGX_LOG_ERR, &hp->log, 0,
+                  "upstream prematurely closed connection "
+                  "or sent too long header in health check response");
+
+    return NGX_ERROR;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, &hp->log, 0,
+                  "upstream sent invalid status line "
+                  "in health check response");
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http upstream health check dummy handler");
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp, ngx_uint_t ok)
+{
+    ngx_uint_t                        changed;
+    ngx_http_upstream_rr_peer_t      *peer, *p;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "http upstream health check %V: %ui", &hp->name, ok);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    hccf = hp->conf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    changed = 0;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    if (*peers->config != hp->config) {
+
+        /* the server might have been removed while it was checked */
+
+        for (p = peers->peer; p; p = p->next) {
+            if (p == peer) {
+                break;
+            }
+        }
+
+        if (p == NULL) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            ngx_destroy_pool(hp->pool);
+            return;
+        }
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    if (ok) {
+        peer->hc_fails = 0;
+
+        if (peer->hc_down && ++peer->hc_passes >= hccf->passes) {
+            peer->hc_down = 0;
+            peer->hc_passes = 0;
+
+            /* forget passive failures, the server is known to be up */
+
+            peer->fails = 0;
+
+            ngx_http_upstream_rr_peer_start(peer);
+
+            changed = 1;
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!peer->hc_down && ++peer->hc_fails >= hccf->fails) {
+            peer->hc_down = 1;
+            peer->hc_fails = 0;
+
+            changed = 1;
+        }
+    }
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (changed && ok) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is healthy",
+                      &hp->name, &hccf->upstream->host);
+
+    } else if (changed) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is unhealthy",
+                      &hp->name, &hccf->upstream->host);
+    }
+
+    ngx_destroy_pool(hp->pool);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            err = c->write->pending_eof ? c->write->kq_errno
+                                        : c->read->kq_errno;
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+#endif
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                       *p;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    hp = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", server: %V",
+                     &hp->conf->upstream->host, &hp->name);
+
+    return p;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+     *     conf->body = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     *     conf->upstream = NULL;
+     *     conf->event = { 0 };
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t *hccf = conf;
+
+    u_char                        *p, *last;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s, uri;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hccf->interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hccf->upstream = uscf;
+    hccf->interval = 5000;
+    hccf->timeout = 1000;
+    hccf->fails = 1;
+    hccf->passes = 1;
+    hccf->status_min = 200;
+    hccf->status_max = 399;
+
+    ngx_str_set(&uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hccf->interval = ngx_parse_time(&s, 0);
+
+            if (hccf->interval == (ngx_msec_t) NGX_ERROR
+                || hccf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hccf->timeout = ngx_parse_time(&s, 0);
+
+            if (hccf->timeout == (ngx_msec_t) NGX_ERROR
+                || hccf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            uri.len = value[i].len - 4;
+            uri.data = &value[i].data[4];
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            p = &value[i].data[7];
+            last = value[i].data + value[i].len;
+
+            s.data = ngx_strlchr(p, last, '-');
+
+            if (s.data == NULL) {
+                s.data = last;
+            }
+
+            n = ngx_atoi(p, s.data - p);
+
+            if (n < 100 || n > 599) {
+                goto invalid;
+            }
+
+            hccf->status_min = n;
+            hccf->status_max = n;
+
+            if (s.data != last) {
+                n = ngx_atoi(s.data + 1, last - s.data - 1);
+
+                if (n < (ngx_int_t) hccf->status_min || n > 599) {
+                    goto invalid;
+                }
+
+                hccf->status_max = n;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hccf->body.len = value[i].len - 5;
+            hccf->body.data = &value[i].data[5];
+
+            if (hccf->body.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hccf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+        return NGX_CONF_OK;
+    }
+
+    hccf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + uri.len
+                        + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                        + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    hccf->request.data = ngx_pnalloc(cf->pool, hccf->request.len);
+    if (hccf->request.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(hccf->request.data,
+                "GET %V HTTP/1.0" CRLF
+                "Host: %V" CRLF
+                "Connection: close" CRLF CRLF,
+                &uri, &uscf->host);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                        i;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+    ngx_http_upstream_main_conf_t    *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hccf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_event_t                      *ev;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+    ngx_http_upstream_main_conf_t    *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hccf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        ev = &hccf->event;
+
+        ev->handler = ngx_http_upstream_hc_handler;
+        ev->data = hccf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        /* spread the first checks of different workers */
+
+        ngx_add_timer(ev, ngx_random() % hccf->interval + 1);
+    }
+
+    return NGX_OK;
+}
@@ -0,0 +1,3068 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * Each upstream request is given a fake connection which is the first
+ * member of its stream: the proxy module writes an HTTP/1.x request to it
+ * and reads an HTTP/1.1 response from it, while the connection methods
+ * translate both into HTTP/2 frames on a real connection shared by several
+ * requests to the same server.
+ */
+
+
+#define NGX_HTTP_UPSTREAM_HTTP2_PREFACE                                       \
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+#define NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE  (1 << 14)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_FRAME_SIZE                                    \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_BUFFER_SIZE                                   \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE                                            \
+     + 2 * NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_HEADERS_SIZE     16384
+#define NGX_HTTP_UPSTREAM_HTTP2_HEADERS_MAX      65536
+
+#define NGX_HTTP_UPSTREAM_HTTP2_OUTPUT_LIMIT     (4 * 65536)
+
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_SID          0x7fffffff
+
+#define NGX_HTTP_UPSTREAM_HTTP2_NO_ERROR         0x0
+#define NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR   0x1
+#define NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR  0x3
+#define NGX_HTTP_UPSTREAM_HTTP2_CANCEL           0x8
+
+#define NGX_HTTP_UPSTREAM_HTTP2_ENABLE_PUSH      0x2
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_STREAMS      0x3
+#define NGX_HTTP_UPSTREAM_HTTP2_INIT_WINDOW      0x4
+#define NGX_HTTP_UPSTREAM_HTTP2_MAX_FRAME_SIZE   0x5
+
+#define NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE  6
+
+
+typedef struct ngx_http_upstream_http2_connection_s
+    ngx_http_upstream_http2_connection_t;
+
+
+typedef struct {
+    ngx_uint_t                         max_streams;
+    ngx_msec_t                         timeout;
+
+    ngx_queue_t                        connections;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_upstream_http2_srv_conf_t;
+
+
+typedef struct {
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_http_upstream_http2_connection_t  *h2;
+    ngx_queue_t                        queue;
+
+    ngx_pool_t                        *pool;
+
+    ngx_uint_t                         id;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+    size_t                             recv_consumed;
+
+    ngx_buf_t                         *header;
+    off_t                              body_rest;
+
+    ngx_buf_t                         *in;
+    size_t                             in_unwindowed;
+
+    unsigned                           header_lf:2;
+    unsigned                           headers_sent:1;
+    unsigned                           headers_received:1;
+    unsigned                           out_closed:1;
+    unsigned                           in_closed:1;
+    unsigned                           blocked:1;
+    unsigned                           error:1;
+
+} ngx_http_upstream_http2_stream_t;
+
+
+struct ngx_http_upstream_http2_connection_s {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_queue_t                        queue;
+    ngx_queue_t                        streams;
+
+    ngx_connection_t                  *connection;
+    ngx_pool_t                        *pool;
+
+    ngx_str_t                         *name;
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+
+    socklen_t                          local_socklen;
+    ngx_sockaddr_t                     local_sockaddr;
+
+    ngx_uint_t                         processing;
+    ngx_uint_t                         max_streams;
+    ngx_uint_t                         next_sid;
+
+    size_t                             send_window;
+    size_t                             recv_window;
+    size_t                             init_window;
+
+    ngx_buf_t                         *in;
+
+    ngx_uint_t                         header_sid;
+    ngx_uint_t                         header_flags;
+    ngx_buf_t                         *header;
+
+    ngx_http_v2_connection_t           hpack;
+
+    ngx_chain_t                       *out;
+    ngx_chain_t                      **last_out;
+    ngx_chain_t                       *tail;
+    ngx_chain_t                       *free;
+    size_t                             out_size;
+
+    unsigned                           connected:1;
+    unsigned                           goaway:1;
+    unsigned                           error:1;
+};
+
+
+typedef struct {
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    ngx_http_request_t                *request;
+    ngx_http_upstream_t               *upstream;
+
+    ngx_http_upstream_http2_stream_t  *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+} ngx_http_upstream_http2_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_http_upstream_http2_connection_t *ngx_http_upstream_http2_connect(
+    ngx_http_upstream_http2_peer_data_t *hp, ngx_peer_connection_t *pc,
+    ngx_int_t *rc);
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_create_stream(
+    ngx_http_upstream_http2_connection_t *h2, ngx_http_request_t *r);
+static void ngx_http_upstream_http2_close_stream(
+    ngx_http_upstream_http2_stream_t *s);
+static void ngx_http_upstream_http2_close(
+    ngx_http_upstream_http2_connection_t *h2);
+static u_char *ngx_http_upstream_http2_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static ngx_int_t ngx_http_upstream_http2_test_connect(ngx_connection_t *c);
+static void ngx_http_upstream_http2_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_http2_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_upstream_http2_process(
+    ngx_http_upstream_http2_connection_t *h2);
+static ngx_int_t ngx_http_upstream_http2_data(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t flags, ngx_uint_t sid,
+    u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_headers(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_header_block(
+    ngx_http_upstream_http2_connection_t *h2);
+static ngx_int_t ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix);
+static ngx_int_t ngx_http_upstream_http2_parse_string(
+    ngx_http_upstream_http2_connection_t *h2, u_char **pos, u_char *end,
+    ngx_str_t *str);
+static ngx_int_t ngx_http_upstream_http2_response_header(
+    ngx_http_upstream_http2_stream_t *s, ngx_array_t *headers);
+static ngx_int_t ngx_http_upstream_http2_rst_stream(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_upstream_http2_settings(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t flags, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_upstream_http2_ping(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t flags, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_upstream_http2_goaway(
+    ngx_http_upstream_http2_connection_t *h2, u_char *pos, size_t len);
+static ngx_int_t ngx_http_upstream_http2_window_update(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid, u_char *pos,
+    size_t len);
+
+static ngx_http_upstream_http2_stream_t *ngx_http_upstream_http2_find_stream(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid);
+static ngx_int_t ngx_http_upstream_http2_append(
+    ngx_http_upstream_http2_stream_t *s, u_char *data, size_t len);
+static ngx_int_t ngx_http_upstream_http2_consumed(
+    ngx_http_upstream_http2_stream_t *s, size_t size);
+static void ngx_http_upstream_http2_stream_error(
+    ngx_http_upstream_http2_stream_t *s, ngx_uint_t status);
+static void ngx_http_upstream_http2_post(ngx_event_t *ev);
+static void ngx_http_upstream_http2_wake(
+    ngx_http_upstream_http2_connection_t *h2);
+
+static u_char *ngx_http_upstream_http2_reserve(
+    ngx_http_upstream_http2_connection_t *h2, size_t size);
+static u_char *ngx_http_upstream_http2_frame(
+    ngx_http_upstream_http2_connection_t *h2, size_t len, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid);
+static ngx_int_t ngx_http_upstream_http2_send_rst_stream(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid,
+    ngx_uint_t status);
+static ngx_int_t ngx_http_upstream_http2_send_window_update(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid, size_t window);
+static ngx_int_t ngx_http_upstream_http2_send(
+    ngx_http_upstream_http2_connection_t *h2);
+
+static ssize_t ngx_http_upstream_http2_recv(ngx_connection_t *fc, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_upstream_http2_recv_chain(ngx_connection_t *fc,
+    ngx_chain_t *in, off_t limit);
+static ssize_t ngx_http_upstream_http2_send_buf(ngx_connection_t *fc,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_upstream_http2_send_chain(ngx_connection_t *fc,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_upstream_http2_request_header(
+    ngx_http_upstream_http2_stream_t *s);
+static u_char *ngx_http_upstream_http2_write_string(u_char *p, u_char *data,
+    size_t len);
+
+static void *ngx_http_upstream_http2_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_http2_commands[] = {
+
+    { ngx_string("http2"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_http2,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_http2_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_http2_create_conf,   /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_http2_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_http2_module_ctx,   /* module context */
+    ngx_http_upstream_http2_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_http2_srv_conf_t  *h2scf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init http2 upstream");
+
+    h2scf = ngx_http_conf_upstream_srv_conf(us,
+                                            ngx_http_upstream_http2_module);
+
+    if (h2scf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    h2scf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_upstream_init_http2_peer;
+
+    /* a stream cannot wait aside while its peer is reused */
+
+    if (us->hedge) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "hedging is not supported with http2 "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        us->hedge = 0;
+    }
+
+    ngx_queue_init(&h2scf->connections);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_http2_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_t                  *u;
+    ngx_http_upstream_http2_peer_data_t  *hp;
+    ngx_http_upstream_http2_srv_conf_t   *h2scf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init http2 upstream peer");
+
+    h2scf = ngx_http_conf_upstream_srv_conf(us,
+                                            ngx_http_upstream_http2_module);
+
+    u = r->upstream;
+
+    if (u->conf->module.len != sizeof("proxy") - 1
+        || ngx_strncmp(u->conf->module.data, "proxy", sizeof("proxy") - 1)
+           != 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "http2 upstream \"%V\" can only be used with proxy_pass",
+                      &us->host);
+        return NGX_ERROR;
+    }
+
+#if (NGX_HTTP_SSL)
+    if (u->ssl) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "http2 upstream \"%V\" does not support SSL", &us->host);
+        return NGX_ERROR;
+    }
+#endif
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "http2 upstream \"%V\" requires the kqueue "
+                      "or epoll event method", &us->host);
+        return NGX_ERROR;
+    }
+
+    hp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_http2_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (h2scf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hp->conf = h2scf;
+    hp->request = r;
+    hp->upstream = u;
+    hp->data = u->peer.data;
+    hp->original_get_peer = u->peer.get;
+    hp->original_free_peer = u->peer.free;
+
+    u->peer.data = hp;
+    u->peer.get = ngx_http_upstream_get_http2_peer;
+    u->peer.free = ngx_http_upstream_free_http2_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_http2_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_int_t                              rc;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_http2_stream_t      *s;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get http2 upstream peer");
+
+    /* ask balancer */
+
+    rc = hp->original_get_peer(pc, hp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /* search for a connection to the same server with a free stream */
+
+    for (q = ngx_queue_head(&hp->conf->connections);
+         q != ngx_queue_sentinel(&hp->conf->connections);
+         q = ngx_queue_next(q))
+    {
+        h2 = ngx_queue_data(q, ngx_http_upstream_http2_connection_t, queue);
+
+        if (h2->goaway
+            || h2->connection->close
+            || h2->processing >= h2->max_streams
+            || ngx_memn2cmp((u_char *) &h2->sockaddr, (u_char *) pc->sockaddr,
+                            h2->socklen, pc->socklen)
+               != 0)
+        {
+            continue;
+        }
+
+        if (pc->local) {
+            if (ngx_cmp_sockaddr(&h2->local_sockaddr.sockaddr,
+                                 h2->local_socklen, pc->local->sockaddr,
+                                 pc->local->socklen, 1)
+                != NGX_OK)
+            {
+                continue;
+            }
+
+        } else if (h2->local_socklen) {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get http2 upstream peer: using connection %p, "
+                       "streams:%ui", h2->connection, h2->processing);
+
+        goto found;
+    }
+
+    h2 = ngx_http_upstream_http2_connect(hp, pc, &rc);
+
+    if (h2 == NULL) {
+        return rc;
+    }
+
+found:
+
+    s = ngx_http_upstream_http2_create_stream(h2, hp->request);
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    hp->stream = s;
+    pc->connection = &s->connection;
+
+    return h2->connected ? NGX_DONE : NGX_AGAIN;
+}
+
+
+static void
+ngx_http_upstream_free_http2_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_http2_peer_data_t  *hp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free http2 upstream peer");
+
+    if (hp->stream) {
+        ngx_http_upstream_http2_close_stream(hp->stream);
+        hp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    hp->original_free_peer(pc, hp->data, state);
+}
+
+
+static ngx_http_upstream_http2_connection_t *
+ngx_http_upstream_http2_connect(ngx_http_upstream_http2_peer_data_t *hp,
+    ngx_peer_connection_t *pc, ngx_int_t *rc)
+{
+    u_char                                *p;
+    size_t                                 len;
+    ngx_log_t                             *log;
+    ngx_pool_t                            *pool;
+    ngx_connection_t                      *c;
+    ngx_peer_connection_t                  peer;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    *rc = NGX_ERROR;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    h2 = ngx_pcalloc(pool, sizeof(ngx_http_upstream_http2_connection_t));
+    if (h2 == NULL) {
+        goto failed;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        goto failed;
+    }
+
+    *log = *ngx_cycle->log;
+    log->action = "processing http2 upstream connection";
+    log->data = h2;
+    log->handler = ngx_http_upstream_http2_log_error;
+
+    pool->log = log;
+
+    h2->in = ngx_create_temp_buf(pool, NGX_HTTP_UPSTREAM_HTTP2_BUFFER_SIZE);
+    if (h2->in == NULL) {
+        goto failed;
+    }
+
+    h2->conf = hp->conf;
+    h2->pool = pool;
+    h2->max_streams = hp->conf->max_streams;
+    h2->next_sid = 1;
+    h2->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    h2->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2->last_out = &h2->out;
+
+    ngx_queue_init(&h2->streams);
+
+    h2->name = pc->name;
+    h2->socklen = pc->socklen;
+    ngx_memcpy(&h2->sockaddr, pc->sockaddr, pc->socklen);
+
+    if (pc->local) {
+        h2->local_socklen = pc->local->socklen;
+        ngx_memcpy(&h2->local_sockaddr, pc->local->sockaddr,
+                   pc->local->socklen);
+    }
+
+    /* preface, settings and connection window update */
+
+    len = sizeof(NGX_HTTP_UPSTREAM_HTTP2_PREFACE) - 1;
+
+    p = ngx_http_upstream_http2_reserve(h2, len);
+    if (p == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(p, NGX_HTTP_UPSTREAM_HTTP2_PREFACE, len);
+
+    len = NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE;
+
+    p = ngx_http_upstream_http2_frame(h2, len, NGX_HTTP_V2_SETTINGS_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, 0);
+    if (p == NULL) {
+        goto failed;
+    }
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_UPSTREAM_HTTP2_ENABLE_PUSH);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    if (ngx_http_upstream_http2_send_window_update(h2, 0,
+                            NGX_HTTP_V2_MAX_WINDOW - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    /* connect */
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = &h2->sockaddr.sockaddr;
+    peer.socklen = h2->socklen;
+    peer.name = pc->name;
+    peer.local = pc->local;
+#if (NGX_HAVE_TRANSPARENT_PROXY)
+    peer.transparent = pc->transparent;
+#endif
+    peer.get = ngx_event_get_peer;
+    peer.log = log;
+    peer.log_error = NGX_ERROR_ERR;
+
+    *rc = ngx_event_connect_peer(&peer);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream connect: %i", *rc);
+
+    if (*rc == NGX_ERROR || *rc == NGX_DECLINED || *rc == NGX_BUSY) {
+        goto failed;
+    }
+
+    c = peer.connection;
+
+    c->data = h2;
+    c->pool = pool;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+
+    c->read->handler = ngx_http_upstream_http2_read_handler;
+    c->write->handler = ngx_http_upstream_http2_write_handler;
+
+    h2->connection = c;
+
+    h2->hpack.connection = c;
+    h2->hpack.pool = pool;
+
+    if (*rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, hp->upstream->conf->connect_timeout);
+
+    } else {
+        h2->connected = 1;
+
+        if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+            ngx_close_connection(c);
+            *rc = NGX_DECLINED;
+            goto failed;
+        }
+    }
+
+    ngx_queue_insert_head(&hp->conf->connections, &h2->queue);
+
+    return h2;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_create_stream(ngx_http_upstream_http2_connection_t *h2,
+    ngx_http_request_t *r)
+{
+    ngx_event_t                       *rev, *wev;
+    ngx_connection_t                  *c, *fc;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    s = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_http2_stream_t));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    c = h2->connection;
+
+    fc = &s->connection;
+    rev = &s->read;
+    wev = &s->write;
+
+    ngx_memcpy(fc, c, sizeof(ngx_connection_t));
+
+    fc->data = NULL;
+    fc->read = rev;
+    fc->write = wev;
+    fc->pool = r->pool;
+    fc->log = r->connection->log;
+
+    fc->recv = ngx_http_upstream_http2_recv;
+    fc->send = ngx_http_upstream_http2_send_buf;
+    fc->recv_chain = ngx_http_upstream_http2_recv_chain;
+    fc->send_chain = ngx_http_upstream_http2_send_chain;
+
+#if (NGX_SSL)
+    fc->ssl = NULL;
+#endif
+
+    fc->sent = 0;
+    fc->buffered = 0;
+    fc->requests = 0;
+    fc->idle = 0;
+    fc->close = 0;
+    fc->error = 0;
+    fc->sendfile = 0;
+    fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    fc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+
+    /*
+     * the events are marked active, so they are never added to
+     * the event method, the streams are woken up by posting them
+     */
+
+    rev->data = fc;
+    rev->active = 1;
+    rev->log = fc->log;
+
+    *wev = *rev;
+
+    wev->write = 1;
+    wev->ready = h2->connected;
+
+    s->h2 = h2;
+    s->pool = r->pool;
+    s->send_window = h2->init_window;
+    s->recv_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    ngx_queue_insert_tail(&h2->streams, &s->queue);
+    h2->processing++;
+
+    c->idle = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    return s;
+}
+
+
+static void
+ngx_http_upstream_http2_close_stream(ngx_http_upstream_http2_stream_t *s)
+{
+    ngx_connection_t                      *fc;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    fc = &s->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "close http2 upstream stream %ui", s->id);
+
+    if (fc->read->timer_set) {
+        ngx_del_timer(fc->read);
+    }
+
+    if (fc->write->timer_set) {
+        ngx_del_timer(fc->write);
+    }
+
+    if (fc->read->posted) {
+        ngx_delete_posted_event(fc->read);
+    }
+
+    if (fc->write->posted) {
+        ngx_delete_posted_event(fc->write);
+    }
+
+    h2 = s->h2;
+
+    if (h2 == NULL) {
+        return;
+    }
+
+    ngx_queue_remove(&s->queue);
+    h2->processing--;
+    s->h2 = NULL;
+
+    if (h2->error) {
+        if (h2->processing == 0) {
+            ngx_http_upstream_http2_close(h2);
+        }
+
+        return;
+    }
+
+    if (s->headers_sent && !s->error && !(s->in_closed && s->out_closed)) {
+        if (ngx_http_upstream_http2_send_rst_stream(h2, s->id,
+                                                NGX_HTTP_UPSTREAM_HTTP2_CANCEL)
+            != NGX_OK)
+        {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+    }
+
+    if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (h2->processing) {
+        return;
+    }
+
+    if (h2->goaway || h2->connection->close || ngx_exiting || ngx_terminate)
+    {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    h2->connection->idle = 1;
+
+    ngx_add_timer(h2->connection->read, h2->conf->timeout);
+}
+
+
+static void
+ngx_http_upstream_http2_close(ngx_http_upstream_http2_connection_t *h2)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->connection->log, 0,
+                   "close http2 upstream connection: %d, streams:%ui",
+                   h2->connection->fd, h2->processing);
+
+    if (!h2->error) {
+        h2->error = 1;
+
+        ngx_queue_remove(&h2->queue);
+
+        for (q = ngx_queue_head(&h2->streams);
+             q != ngx_queue_sentinel(&h2->streams);
+             q = ngx_queue_next(q))
+        {
+            s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+            if (!s->in_closed) {
+                s->error = 1;
+            }
+
+            ngx_http_upstream_http2_post(s->connection.read);
+            ngx_http_upstream_http2_post(s->connection.write);
+        }
+    }
+
+    /*
+     * the socket is kept open while streams are still referenced,
+     * so ngx_http_upstream_test_connect() on them sees a valid descriptor
+     */
+
+    if (h2->processing) {
+        return;
+    }
+
+    ngx_close_connection(h2->connection);
+    ngx_destroy_pool(h2->pool);
+}
+
+
+static u_char *
+ngx_http_upstream_http2_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                                *p;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    h2 = log->data;
+
+    if (h2->name) {
+        p = ngx_snprintf(buf, len, ", upstream: %V", h2->name);
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            err = c->write->pending_eof ? c->write->kq_errno
+                                        : c->read->kq_errno;
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+#endif
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_http2_read_handler(ngx_event_t *rev)
+{
+    ssize_t                                n;
+    ngx_buf_t                             *b;
+    ngx_queue_t                           *q;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_http2_stream_t      *s;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    c = rev->data;
+    h2 = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream read handler");
+
+    if (h2->error) {
+        return;
+    }
+
+    if (c->close) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (rev->timedout) {
+        rev->timedout = 0;
+
+        if (h2->processing == 0) {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+    }
+
+    b = h2->in;
+
+    for ( ;; ) {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+
+            for (q = ngx_queue_head(&h2->streams);
+                 q != ngx_queue_sentinel(&h2->streams) && n == 0;
+                 q = ngx_queue_next(q))
+            {
+                s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+                if (!s->in_closed) {
+                    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                                "upstream prematurely closed http2 connection");
+                    break;
+                }
+            }
+
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_upstream_http2_process(h2) != NGX_OK) {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (h2->goaway && h2->processing == 0) {
+        ngx_http_upstream_http2_close(h2);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_write_handler(ngx_event_t *wev)
+{
+    ngx_queue_t                           *q;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_http2_stream_t      *s;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    c = wev->data;
+    h2 = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream write handler");
+
+    if (h2->error) {
+        return;
+    }
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while connecting");
+        ngx_http_upstream_http2_close(h2);
+        return;
+    }
+
+    if (!h2->connected) {
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        if (ngx_http_upstream_http2_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_http2_close(h2);
+            return;
+        }
+
+        h2->connected = 1;
+
+        for (q = ngx_queue_head(&h2->streams);
+             q != ngx_queue_sentinel(&h2->streams);
+             q = ngx_queue_next(q))
+        {
+            s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+            ngx_http_upstream_http2_post(s->connection.write);
+        }
+    }
+
+    if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_process(ngx_http_upstream_http2_connection_t *h2)
+{
+    u_char      *p;
+    size_t       len;
+    ngx_int_t    rc;
+    ngx_buf_t   *b;
+    ngx_uint_t   type, flags, sid;
+
+    b = h2->in;
+    p = b->pos;
+
+    while (b->last - p >= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+        len = ngx_http_v2_parse_length(ngx_http_v2_parse_uint32(p));
+        type = ngx_http_v2_parse_type(ngx_http_v2_parse_uint32(p));
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        if (len > NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent too large http2 frame: %uz", len);
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (b->last - p) < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2->connection->log, 0,
+                       "http2 upstream frame type:%ui f:%Xd l:%uz sid:%ui",
+                       type, flags, len, sid);
+
+        if (h2->header_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent http2 frame of type %ui "
+                          "instead of CONTINUATION", type);
+            return NGX_ERROR;
+        }
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        switch (type) {
+
+        case NGX_HTTP_V2_DATA_FRAME:
+            rc = ngx_http_upstream_http2_data(h2, flags, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+        case NGX_HTTP_V2_CONTINUATION_FRAME:
+            rc = ngx_http_upstream_http2_headers(h2, type, flags, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+            rc = ngx_http_upstream_http2_rst_stream(h2, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_SETTINGS_FRAME:
+            rc = ngx_http_upstream_http2_settings(h2, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_PING_FRAME:
+            rc = ngx_http_upstream_http2_ping(h2, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_GOAWAY_FRAME:
+            rc = ngx_http_upstream_http2_goaway(h2, p, len);
+            break;
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+            rc = ngx_http_upstream_http2_window_update(h2, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent http2 PUSH_PROMISE frame "
+                          "while push is disabled");
+            rc = NGX_ERROR;
+            break;
+
+        default:
+            /* PRIORITY and unknown frames are ignored */
+            rc = NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p += len;
+    }
+
+    len = b->last - p;
+
+    if (len && p != b->start) {
+        ngx_memmove(b->start, p, len);
+    }
+
+    b->pos = b->start;
+    b->last = b->start + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_data(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t flags, ngx_uint_t sid, u_char *pos, size_t len)
+{
+    size_t                             padding;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent http2 DATA frame with incorrect "
+                      "identifier");
+        return NGX_ERROR;
+    }
+
+    if (len > h2->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream violated http2 connection flow control");
+        return NGX_ERROR;
+    }
+
+    h2->recv_window -= len;
+
+    if (h2->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+        if (ngx_http_upstream_http2_send_window_update(h2, 0,
+                                      NGX_HTTP_V2_MAX_WINDOW - h2->recv_window)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        h2->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    }
+
+    s = ngx_http_upstream_http2_find_stream(h2, sid);
+
+    if (s == NULL || s->error) {
+        return NGX_OK;
+    }
+
+    if (len > s->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream violated http2 stream flow control");
+        ngx_http_upstream_http2_stream_error(s,
+                                       NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    s->recv_window -= len;
+
+    padding = 0;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+
+        if (len == 0 || (size_t) *pos >= len) {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent http2 DATA frame with incorrect "
+                          "padding");
+            return NGX_ERROR;
+        }
+
+        padding = *pos + 1;
+        pos++;
+        len -= padding;
+    }
+
+    if (!s->headers_received || s->in_closed) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent unexpected http2 DATA frame");
+        ngx_http_upstream_http2_stream_error(s,
+                                        NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR);
+        return NGX_OK;
+    }
+
+    if (len && ngx_http_upstream_http2_append(s, pos, len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        s->in_closed = 1;
+
+    } else if (padding
+               && ngx_http_upstream_http2_consumed(s, padding) == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_http2_post(s->connection.read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_headers(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid, u_char *pos, size_t len)
+{
+    size_t      padding, size;
+    ngx_buf_t  *b, *nb;
+
+    if (type == NGX_HTTP_V2_HEADERS_FRAME) {
+
+        if (sid == 0 || sid % 2 == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent http2 HEADERS frame with incorrect "
+                          "identifier");
+            return NGX_ERROR;
+        }
+
+        padding = 0;
+
+        if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+            if (len == 0) {
+                goto size_error;
+            }
+
+            padding = *pos++;
+            len--;
+        }
+
+        if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+            if (len < 5) {
+                goto size_error;
+            }
+
+            pos += 5;
+            len -= 5;
+        }
+
+        if (padding > len) {
+            goto size_error;
+        }
+
+        len -= padding;
+
+        h2->header_sid = sid;
+        h2->header_flags = flags;
+
+        if (h2->header == NULL) {
+            h2->header = ngx_create_temp_buf(h2->pool,
+                                         NGX_HTTP_UPSTREAM_HTTP2_HEADERS_SIZE);
+            if (h2->header == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        h2->header->pos = h2->header->start;
+        h2->header->last = h2->header->start;
+
+    } else if (h2->header_sid == 0 || sid != h2->header_sid) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent unexpected http2 CONTINUATION frame");
+        return NGX_ERROR;
+    }
+
+    b = h2->header;
+
+    if ((size_t) (b->end - b->last) < len) {
+        size = b->last - b->start;
+
+        if (size + len > NGX_HTTP_UPSTREAM_HTTP2_HEADERS_MAX) {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream sent too large http2 header block");
+            return NGX_ERROR;
+        }
+
+        nb = ngx_create_temp_buf(h2->pool, NGX_HTTP_UPSTREAM_HTTP2_HEADERS_MAX);
+        if (nb == NULL) {
+            return NGX_ERROR;
+        }
+
+        nb->last = ngx_cpymem(nb->start, b->start, size);
+
+        ngx_pfree(h2->pool, b->start);
+        h2->header = nb;
+        b = nb;
+    }
+
+    b->last = ngx_cpymem(b->last, pos, len);
+
+    if (flags & NGX_HTTP_V2_END_HEADERS_FLAG) {
+        return ngx_http_upstream_http2_header_block(h2);
+    }
+
+    return NGX_OK;
+
+size_error:
+
+    ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                  "upstream sent http2 HEADERS frame with incorrect length");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_header_block(ngx_http_upstream_http2_connection_t *h2)
+{
+    u_char                            *p, *end, ch;
+    ngx_int_t                          value, rc;
+    ngx_uint_t                         sid, flags, indexed, index, size_update;
+    ngx_uint_t                         prefix;
+    ngx_pool_t                        *pool;
+    ngx_array_t                        headers;
+    ngx_http_v2_header_t              *h;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    sid = h2->header_sid;
+    flags = h2->header_flags;
+
+    h2->header_sid = 0;
+
+    pool = ngx_create_pool(1024, h2->connection->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    h2->hpack.state.pool = pool;
+
+    if (ngx_array_init(&headers, pool, 16, sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    p = h2->header->pos;
+    end = h2->header->last;
+
+    while (p < end) {
+
+        size_update = 0;
+        indexed = 0;
+        index = 0;
+
+        ch = *p;
+
+        if (ch >= (1 << 7)) {
+            /* indexed header field */
+            indexed = 1;
+            prefix = ngx_http_v2_prefix(7);
+
+        } else if (ch >= (1 << 6)) {
+            /* literal header field with incremental indexing */
+            index = 1;
+            prefix = ngx_http_v2_prefix(6);
+
+        } else if (ch >= (1 << 5)) {
+            /* dynamic table size update */
+            size_update = 1;
+            prefix = ngx_http_v2_prefix(5);
+
+        } else {
+            /* literal header field without indexing or never indexed */
+            prefix = ngx_http_v2_prefix(4);
+        }
+
+        value = ngx_http_upstream_http2_parse_int(&p, end, prefix);
+
+        if (value < 0) {
+            goto comp_error;
+        }
+
+        if (size_update) {
+            if (ngx_http_v2_table_size(&h2->hpack, value) != NGX_OK) {
+                goto comp_error;
+            }
+
+            continue;
+        }
+
+        h = ngx_array_push(&headers);
+        if (h == NULL) {
+            goto failed;
+        }
+
+        if (indexed) {
+            if (ngx_http_v2_get_indexed_header(&h2->hpack, value, 0) != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            *h = h2->hpack.state.header;
+            continue;
+        }
+
+        if (value) {
+            if (ngx_http_v2_get_indexed_header(&h2->hpack, value, 1) != NGX_OK)
+            {
+                goto comp_error;
+            }
+
+            h->name = h2->hpack.state.header.name;
+
+        } else if (ngx_http_upstream_http2_parse_string(h2, &p, end, &h->name)
+                   != NGX_OK)
+        {
+            goto comp_error;
+        }
+
+        if (ngx_http_upstream_http2_parse_string(h2, &p, end, &h->value)
+            != NGX_OK)
+        {
+            goto comp_error;
+        }
+
+        if (index) {
+            if (ngx_http_v2_add_header(&h2->hpack, h) != NGX_OK) {
+                goto failed;
+            }
+        }
+    }
+
+    /* the header block is decoded even for closed streams */
+
+    s = ngx_http_upstream_http2_find_stream(h2, sid);
+
+    if (s == NULL || s->error) {
+        ngx_destroy_pool(pool);
+        return NGX_OK;
+    }
+
+    rc = NGX_OK;
+
+    if (!s->headers_received) {
+        rc = ngx_http_upstream_http2_response_header(s, &headers);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_http_upstream_http2_stream_error(s,
+                                        NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR);
+            ngx_destroy_pool(pool);
+            return NGX_OK;
+        }
+
+    } else if (!(flags & NGX_HTTP_V2_END_STREAM_FLAG)) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent http2 trailers without end of stream");
+        ngx_http_upstream_http2_stream_error(s,
+                                        NGX_HTTP_UPSTREAM_HTTP2_PROTOCOL_ERROR);
+        ngx_destroy_pool(pool);
+        return NGX_OK;
+    }
+
+    /* trailers are dropped */
+
+    ngx_destroy_pool(pool);
+
+    if (rc == NGX_AGAIN) {
+        /* informational response */
+        return NGX_OK;
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        s->in_closed = 1;
+    }
+
+    ngx_http_upstream_http2_post(s->connection.read);
+
+    return NGX_OK;
+
+comp_error:
+
+    ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                  "upstream sent invalid http2 header block");
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix)
+{
+    u_char      *p;
+    ngx_uint_t   value, octet, shift;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    value = *p++ & prefix;
+
+    if (value != prefix) {
+        *pos = p;
+        return value;
+    }
+
+    if (end - p > NGX_HTTP_V2_INT_OCTETS) {
+        end = p + NGX_HTTP_V2_INT_OCTETS;
+    }
+
+    for (shift = 0; p != end; shift += 7) {
+        octet = *p++;
+
+        value += (octet & 0x7f) << shift;
+
+        if (octet < 128) {
+            *pos = p;
+            return value;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_parse_string(ngx_http_upstream_http2_connection_t *h2,
+    u_char **pos, u_char *end, ngx_str_t *str)
+{
+    u_char      *p, *d, state;
+    ngx_int_t    len;
+    ngx_uint_t   huff;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p >> 7;
+
+    len = ngx_http_upstream_http2_parse_int(&p, end, ngx_http_v2_prefix(7));
+
+    if (len < 0 || end - p < len) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        str->data = ngx_pnalloc(h2->hpack.state.pool, len * 8 / 5 + 1);
+        if (str->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        state = 0;
+        d = str->data;
+
+        if (ngx_http_v2_huff_decode(&state, p, len, &d, 1,
+                                    h2->connection->log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        str->len = d - str->data;
+
+    } else {
+        str->data = p;
+        str->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_response_header(ngx_http_upstream_http2_stream_t *s,
+    ngx_array_t *headers)
+{
+    size_t                 len;
+    u_char                *p, *text;
+    ngx_str_t             *status;
+    ngx_uint_t             i, n;
+    ngx_http_v2_header_t  *h;
+
+    status = NULL;
+    len = sizeof("HTTP/1.1 " CRLF) - 1 + sizeof(CRLF) - 1;
+
+    h = headers->elts;
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        for (n = 0; n < h[i].name.len; n++) {
+            if (h[i].name.data[n] <= ' ' || h[i].name.data[n] == ':'
+                || h[i].name.data[n] == 0x7f)
+            {
+                if (n == 0 && h[i].name.data[n] == ':') {
+                    continue;
+                }
+
+                goto invalid;
+            }
+        }
+
+        for (n = 0; n < h[i].value.len; n++) {
+            if (h[i].value.data[n] == CR || h[i].value.data[n] == LF
+                || h[i].value.data[n] == '\0')
+            {
+                goto invalid;
+            }
+        }
+
+        if (h[i].name.len && h[i].name.data[0] == ':') {
+
+            if (h[i].name.len != sizeof(":status") - 1
+                || ngx_strncmp(h[i].name.data, ":status",
+                               sizeof(":status") - 1)
+                   != 0
+                || h[i].value.len != 3
+                || status != NULL)
+            {
+                goto invalid;
+            }
+
+            status = &h[i].value;
+            continue;
+        }
+
+        len += h[i].name.len + sizeof(": ") - 1 + h[i].value.len
+               + sizeof(CRLF) - 1;
+    }
+
+    if (status == NULL) {
+        goto invalid;
+    }
+
+    if (status->data[0] == '1') {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "http2 upstream informational response: %V", status);
+        return NGX_AGAIN;
+    }
+
+    len += status->len;
+
+    text = ngx_pnalloc(s->h2->hpack.state.pool, len);
+    if (text == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(text, "HTTP/1.1 ", sizeof("HTTP/1.1 ") - 1);
+    p = ngx_cpymem(p, status->data, status->len);
+    *p++ = CR; *p++ = LF;
+
+    for (i = 0; i < headers->nelts; i++) {
+
+        if (h[i].name.data[0] == ':') {
+            continue;
+        }
+
+        p = ngx_cpymem(p, h[i].name.data, h[i].name.len);
+        *p++ = ':'; *p++ = ' ';
+        p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+        *p++ = CR; *p++ = LF;
+    }
+
+    *p++ = CR; *p++ = LF;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream response header: sid:%ui status:%V",
+                   s->id, status);
+
+    if (ngx_http_upstream_http2_append(s, text, p - text) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->in_unwindowed = p - text;
+    s->headers_received = 1;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                  "upstream sent invalid http2 response header");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_rst_stream(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t sid, u_char *pos, size_t len)
+{
+    ngx_uint_t                         status;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (sid == 0 || len != 4) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent incorrect http2 RST_STREAM frame");
+        return NGX_ERROR;
+    }
+
+    s = ngx_http_upstream_http2_find_stream(h2, sid);
+
+    if (s == NULL) {
+        return NGX_OK;
+    }
+
+    status = ngx_http_v2_parse_uint32(pos);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream RST_STREAM sid:%ui status:%ui",
+                   sid, status);
+
+    /* a server may reset a stream once the whole response is sent */
+
+    if (s->in_closed && status == NGX_HTTP_UPSTREAM_HTTP2_NO_ERROR) {
+        s->out_closed = 1;
+        ngx_http_upstream_http2_post(s->connection.write);
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                  "upstream reset http2 stream with error %ui", status);
+
+    s->error = 1;
+
+    ngx_http_upstream_http2_post(s->connection.read);
+    ngx_http_upstream_http2_post(s->connection.write);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_settings(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t flags, u_char *pos, size_t len)
+{
+    ssize_t                            delta;
+    ngx_uint_t                         id, value;
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+
+        if (len != 0) {
+            goto invalid;
+        }
+
+        return NGX_OK;
+    }
+
+    if (len % NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE) {
+        goto invalid;
+    }
+
+    for ( /* void */ ; len; len -= NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE)
+    {
+        id = ngx_http_v2_parse_uint16(pos);
+        value = ngx_http_v2_parse_uint32(&pos[2]);
+
+        pos += NGX_HTTP_UPSTREAM_HTTP2_SETTINGS_PARAM_SIZE;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->connection->log, 0,
+                       "http2 upstream setting %ui:%ui", id, value);
+
+        switch (id) {
+
+        case NGX_HTTP_UPSTREAM_HTTP2_MAX_STREAMS:
+            h2->max_streams = ngx_min(value, h2->conf->max_streams);
+            break;
+
+        case NGX_HTTP_UPSTREAM_HTTP2_INIT_WINDOW:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                goto invalid;
+            }
+
+            delta = (ssize_t) value - (ssize_t) h2->init_window;
+            h2->init_window = value;
+
+            for (q = ngx_queue_head(&h2->streams);
+                 q != ngx_queue_sentinel(&h2->streams);
+                 q = ngx_queue_next(q))
+            {
+                s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+                s->send_window += delta;
+            }
+
+            break;
+
+        case NGX_HTTP_UPSTREAM_HTTP2_MAX_FRAME_SIZE:
+
+            /* frames sent never exceed the default size */
+
+            if (value < NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                goto invalid;
+            }
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (ngx_http_upstream_http2_frame(h2, 0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                      NGX_HTTP_V2_ACK_FLAG, 0)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_http2_wake(h2);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                  "upstream sent incorrect http2 SETTINGS frame");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_ping(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t flags, u_char *pos, size_t len)
+{
+    u_char  *p;
+
+    if (len != 8) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent incorrect http2 PING frame");
+        return NGX_ERROR;
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    p = ngx_http_upstream_http2_frame(h2, 8, NGX_HTTP_V2_PING_FRAME,
+                                      NGX_HTTP_V2_ACK_FLAG, 0);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, pos, 8);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_goaway(ngx_http_upstream_http2_connection_t *h2,
+    u_char *pos, size_t len)
+{
+    ngx_uint_t                         last, status;
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (len < 8) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent incorrect http2 GOAWAY frame");
+        return NGX_ERROR;
+    }
+
+    last = ngx_http_v2_parse_sid(pos);
+    status = ngx_http_v2_parse_uint32(&pos[4]);
+
+    if (status != NGX_HTTP_UPSTREAM_HTTP2_NO_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent http2 GOAWAY with error %ui", status);
+
+    } else {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2->connection->log, 0,
+                       "http2 upstream GOAWAY last sid:%ui", last);
+    }
+
+    h2->goaway = 1;
+
+    /* streams not processed by the server may be retried elsewhere */
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (s->id == 0 || s->id > last) {
+            s->error = 1;
+            ngx_http_upstream_http2_post(s->connection.read);
+            ngx_http_upstream_http2_post(s->connection.write);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_window_update(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t sid, u_char *pos, size_t len)
+{
+    size_t                             window;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    if (len != 4) {
+        ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                      "upstream sent incorrect http2 WINDOW_UPDATE frame");
+        return NGX_ERROR;
+    }
+
+    window = ngx_http_v2_parse_window(pos);
+
+    if (sid == 0) {
+
+        if (window == 0
+            || window > NGX_HTTP_V2_MAX_WINDOW - h2->send_window)
+        {
+            ngx_log_error(NGX_LOG_ERR, h2->connection->log, 0,
+                          "upstream violated http2 connection flow control");
+            return NGX_ERROR;
+        }
+
+        h2->send_window += window;
+
+        ngx_http_upstream_http2_wake(h2);
+
+        return NGX_OK;
+    }
+
+    s = ngx_http_upstream_http2_find_stream(h2, sid);
+
+    if (s == NULL || s->error) {
+        return NGX_OK;
+    }
+
+    if (window == 0
+        || (ssize_t) window > NGX_HTTP_V2_MAX_WINDOW - s->send_window)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream violated http2 stream flow control");
+        ngx_http_upstream_http2_stream_error(s,
+                                       NGX_HTTP_UPSTREAM_HTTP2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    s->send_window += window;
+
+    if (s->blocked) {
+        s->blocked = 0;
+        ngx_http_upstream_http2_post(s->connection.write);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_upstream_http2_stream_t *
+ngx_http_upstream_http2_find_stream(ngx_http_upstream_http2_connection_t *h2,
+    ngx_uint_t sid)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (s->id == sid) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_append(ngx_http_upstream_http2_stream_t *s,
+    u_char *data, size_t len)
+{
+    size_t      size;
+    ngx_buf_t  *b, *nb;
+
+    b = s->in;
+
+    if (b == NULL) {
+        b = ngx_create_temp_buf(s->pool,
+                                ngx_max(len, NGX_HTTP_V2_DEFAULT_WINDOW));
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->in = b;
+    }
+
+    if ((size_t) (b->end - b->last) < len) {
+        size = b->last - b->pos;
+
+        if ((size_t) (b->end - b->start) >= size + len) {
+            ngx_memmove(b->start, b->pos, size);
+
+        } else {
+            nb = ngx_create_temp_buf(s->pool, size + len);
+            if (nb == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(nb->start, b->pos, size);
+
+            ngx_pfree(s->pool, b->start);
+            s->in = nb;
+            b = nb;
+        }
+
+        b->pos = b->start;
+        b->last = b->start + size;
+    }
+
+    b->last = ngx_cpymem(b->last, data, len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_consumed(ngx_http_upstream_http2_stream_t *s,
+    size_t size)
+{
+    if (s->h2 == NULL || s->in_closed || s->error) {
+        return NGX_DECLINED;
+    }
+
+    s->recv_consumed += size;
+
+    if (s->recv_consumed < NGX_HTTP_V2_DEFAULT_WINDOW / 2) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_upstream_http2_send_window_update(s->h2, s->id,
+                                                   s->recv_consumed)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    s->recv_window += s->recv_consumed;
+    s->recv_consumed = 0;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_http2_stream_error(ngx_http_upstream_http2_stream_t *s,
+    ngx_uint_t status)
+{
+    s->error = 1;
+
+    /* the connection is checked for errors when the output is flushed */
+
+    (void) ngx_http_upstream_http2_send_rst_stream(s->h2, s->id, status);
+
+    ngx_http_upstream_http2_post(s->connection.read);
+    ngx_http_upstream_http2_post(s->connection.write);
+}
+
+
+static void
+ngx_http_upstream_http2_post(ngx_event_t *ev)
+{
+    ev->ready = 1;
+
+    if (!ev->posted) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_upstream_http2_wake(ngx_http_upstream_http2_connection_t *h2)
+{
+    ngx_queue_t                       *q;
+    ngx_http_upstream_http2_stream_t  *s;
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_http2_stream_t, queue);
+
+        if (s->blocked) {
+            s->blocked = 0;
+            ngx_http_upstream_http2_post(s->connection.write);
+        }
+    }
+}
+
+
+static u_char *
+ngx_http_upstream_http2_reserve(ngx_http_upstream_http2_connection_t *h2,
+    size_t size)
+{
+    u_char       *p;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    cl = h2->tail;
+
+    if (cl == NULL || (size_t) (cl->buf->end - cl->buf->last) < size) {
+
+        cl = h2->free;
+
+        if (cl) {
+            h2->free = cl->next;
+
+        } else {
+            cl = ngx_alloc_chain_link(h2->pool);
+            if (cl == NULL) {
+                return NULL;
+            }
+
+            cl->buf = ngx_create_temp_buf(h2->pool,
+                                          NGX_HTTP_UPSTREAM_HTTP2_FRAME_SIZE);
+            if (cl->buf == NULL) {
+                return NULL;
+            }
+        }
+
+        cl->next = NULL;
+
+        *h2->last_out = cl;
+        h2->last_out = &cl->next;
+        h2->tail = cl;
+    }
+
+    b = cl->buf;
+
+    p = b->last;
+    b->last += size;
+
+    h2->out_size += size;
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_frame(ngx_http_upstream_http2_connection_t *h2,
+    size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid)
+{
+    u_char  *p;
+
+    p = ngx_http_upstream_http2_reserve(h2,
+                                        NGX_HTTP_V2_FRAME_HEADER_SIZE + len);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p = ngx_http_v2_write_uint32(p, len << 8 | type);
+    *p++ = (u_char) flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_rst_stream(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid, ngx_uint_t status)
+{
+    u_char  *p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2->connection->log, 0,
+                   "http2 upstream send RST_STREAM sid:%ui status:%ui",
+                   sid, status);
+
+    p = ngx_http_upstream_http2_frame(h2, 4, NGX_HTTP_V2_RST_STREAM_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, status);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send_window_update(
+    ngx_http_upstream_http2_connection_t *h2, ngx_uint_t sid, size_t window)
+{
+    u_char  *p;
+
+    p = ngx_http_upstream_http2_frame(h2, 4, NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                      NGX_HTTP_V2_NO_FLAG, sid);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_v2_write_uint32(p, window);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_send(ngx_http_upstream_http2_connection_t *h2)
+{
+    ngx_uint_t         full;
+    ngx_chain_t       *cl, *ln;
+    ngx_connection_t  *c;
+
+    c = h2->connection;
+
+    if (h2->out == NULL || !h2->connected) {
+        return NGX_OK;
+    }
+
+    full = (h2->out_size >= NGX_HTTP_UPSTREAM_HTTP2_OUTPUT_LIMIT);
+
+    cl = c->send_chain(c, h2->out, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        c->error = 1;
+        return NGX_ERROR;
+    }
+
+    while (h2->out != cl) {
+        ln = h2->out;
+        h2->out = ln->next;
+
+        h2->out_size -= ln->buf->last - ln->buf->start;
+
+        if (ln == h2->tail) {
+            h2->tail = NULL;
+        }
+
+        ln->buf->pos = ln->buf->start;
+        ln->buf->last = ln->buf->start;
+
+        ln->next = h2->free;
+        h2->free = ln;
+    }
+
+    if (full && h2->out_size < NGX_HTTP_UPSTREAM_HTTP2_OUTPUT_LIMIT) {
+        ngx_http_upstream_http2_wake(h2);
+    }
+
+    if (h2->out == NULL) {
+        h2->last_out = &h2->out;
+        return NGX_OK;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv(ngx_connection_t *fc, u_char *buf, size_t size)
+{
+    size_t                                 n, unwindowed;
+    ngx_int_t                              rc;
+    ngx_buf_t                             *b;
+    ngx_http_upstream_http2_stream_t      *s;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    s = (ngx_http_upstream_http2_stream_t *) fc;
+
+    b = s->in;
+
+    if (b && b->pos < b->last && !s->error) {
+        n = ngx_min(size, (size_t) (b->last - b->pos));
+
+        buf = ngx_cpymem(buf, b->pos, n);
+        b->pos += n;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        /* the response header text is not subject to flow control */
+
+        unwindowed = ngx_min(n, s->in_unwindowed);
+        s->in_unwindowed -= unwindowed;
+
+        if (n > unwindowed) {
+            h2 = s->h2;
+
+            rc = ngx_http_upstream_http2_consumed(s, n - unwindowed);
+
+            if (rc == NGX_ERROR
+                || (rc == NGX_OK && ngx_http_upstream_http2_send(h2) != NGX_OK))
+            {
+                ngx_http_upstream_http2_close(h2);
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 upstream recv: sid:%ui %uz", s->id, n);
+
+        return n;
+    }
+
+    if (s->error) {
+        fc->read->ready = 0;
+        fc->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (s->in_closed) {
+        fc->read->ready = 0;
+        fc->read->eof = 1;
+        return 0;
+    }
+
+    fc->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_recv_chain(ngx_connection_t *fc, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t    size;
+    ssize_t   n, total;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+
+        size = in->buf->end - in->buf->last;
+
+        if (limit && (off_t) size > limit - total) {
+            size = (size_t) (limit - total);
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        n = ngx_http_upstream_http2_recv(fc, in->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_upstream_http2_send_buf(ngx_connection_t *fc, u_char *buf,
+    size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_upstream_http2_send_chain(fc, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_http2_send_chain(ngx_connection_t *fc, ngx_chain_t *in,
+    off_t limit)
+{
+    off_t                                  sent;
+    size_t                                 size, len;
+    u_char                                *p;
+    ssize_t                                n;
+    ngx_buf_t                             *b, *nb;
+    ngx_uint_t                             flags;
+    ngx_http_upstream_http2_stream_t      *s;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    s = (ngx_http_upstream_http2_stream_t *) fc;
+    h2 = s->h2;
+
+    if (s->error || h2 == NULL || h2->error) {
+        fc->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (!h2->connected) {
+        fc->write->ready = 0;
+        return in;
+    }
+
+    sent = 0;
+
+    /* collect the request header */
+
+    while (!s->headers_sent && in) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            in = in->next;
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, fc->log, 0,
+                          "http2 upstream request header is not in memory");
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (s->header == NULL) {
+            s->header = ngx_create_temp_buf(s->pool, ngx_buf_size(b));
+            if (s->header == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+        }
+
+        /* search for the end of the header in this buffer */
+
+        for (p = b->pos; p < b->last; p++) {
+
+            if (*p == LF) {
+                if (++s->header_lf == 2) {
+                    p++;
+                    break;
+                }
+
+            } else if (*p != CR) {
+                s->header_lf = 0;
+            }
+        }
+
+        len = p - b->pos;
+
+        if ((size_t) (s->header->end - s->header->last) < len) {
+            nb = ngx_create_temp_buf(s->pool,
+                               2 * (s->header->last - s->header->start) + len);
+            if (nb == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            nb->last = ngx_cpymem(nb->start, s->header->start,
+                                  s->header->last - s->header->start);
+            s->header = nb;
+        }
+
+        s->header->last = ngx_cpymem(s->header->last, b->pos, len);
+        b->pos += len;
+        sent += len;
+
+        if (b->pos == b->last) {
+            in = in->next;
+        }
+
+        if (s->header_lf == 2
+            && ngx_http_upstream_http2_request_header(s) != NGX_OK)
+        {
+            return NGX_CHAIN_ERROR;
+        }
+    }
+
+    /* request body */
+
+    for ( /* void */ ; in && s->headers_sent; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        /* a request body buffered to a temporary file is read from it */
+
+        while (ngx_buf_size(b)) {
+
+            if (s->out_closed || ngx_buf_size(b) > s->body_rest) {
+                ngx_log_error(NGX_LOG_ERR, fc->log, 0,
+                              "http2 upstream request body is larger "
+                              "than content length");
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (s->send_window <= 0
+                || h2->send_window == 0
+                || h2->out_size >= NGX_HTTP_UPSTREAM_HTTP2_OUTPUT_LIMIT)
+            {
+                s->blocked = 1;
+                goto blocked;
+            }
+
+            size = (size_t) ngx_min(ngx_buf_size(b), s->send_window);
+            size = ngx_min(size, h2->send_window);
+            size = ngx_min(size, NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE);
+
+            s->body_rest -= size;
+
+            flags = s->body_rest ? NGX_HTTP_V2_NO_FLAG
+                                 : NGX_HTTP_V2_END_STREAM_FLAG;
+
+            p = ngx_http_upstream_http2_frame(h2, size,
+                                              NGX_HTTP_V2_DATA_FRAME,
+                                              flags, s->id);
+            if (p == NULL) {
+                return NGX_CHAIN_ERROR;
+            }
+
+            if (ngx_buf_in_memory(b)) {
+                ngx_memcpy(p, b->pos, size);
+                b->pos += size;
+
+            } else {
+                n = ngx_read_file(b->file, p, size, b->file_pos);
+
+                if (n == NGX_ERROR) {
+                    return NGX_CHAIN_ERROR;
+                }
+
+                if ((size_t) n != size) {
+                    ngx_log_error(NGX_LOG_ALERT, fc->log, 0,
+                                  ngx_read_file_n " read only %z of %uz "
+                                  "from \"%V\"", n, size, &b->file->name);
+                    return NGX_CHAIN_ERROR;
+                }
+
+                b->file_pos += size;
+            }
+
+            sent += size;
+
+            s->send_window -= size;
+            h2->send_window -= size;
+
+            if (s->body_rest == 0) {
+                s->out_closed = 1;
+            }
+        }
+    }
+
+    fc->sent += sent;
+
+    if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+        fc->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    return in;
+
+blocked:
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 upstream stream %ui blocked, window:%z conn:%uz",
+                   s->id, s->send_window, h2->send_window);
+
+    fc->sent += sent;
+    fc->write->ready = 0;
+
+    if (ngx_http_upstream_http2_send(h2) != NGX_OK) {
+        ngx_http_upstream_http2_close(h2);
+        fc->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    return in;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_http2_request_header(ngx_http_upstream_http2_stream_t *s)
+{
+    size_t                                 len, n;
+    u_char                                *p, *end, *last, *block, *pos;
+    ngx_str_t                              method, uri, host, name, value;
+    ngx_uint_t                             i, flags, type;
+    ngx_array_t                            headers;
+    ngx_http_v2_header_t                  *h;
+    ngx_http_upstream_http2_connection_t  *h2;
+
+    h2 = s->h2;
+
+    p = s->header->pos;
+    end = s->header->last;
+
+    /* request line */
+
+    method.data = p;
+
+    while (p < end && *p != ' ') {
+        p++;
+    }
+
+    method.len = p - method.data;
+
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    uri.data = p;
+
+    while (p < end && *p != ' ' && *p != CR && *p != LF) {
+        p++;
+    }
+
+    uri.len = p - uri.data;
+
+    while (p < end && *p != LF) {
+        p++;
+    }
+
+    if (p == end || method.len == 0 || uri.len == 0) {
+        goto invalid;
+    }
+
+    p++;
+
+    if (ngx_array_init(&headers, s->pool, 16, sizeof(ngx_http_v2_header_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_str_null(&host);
+    s->body_rest = 0;
+
+    /* header lines */
+
+    for ( ;; ) {
+
+        last = ngx_strlchr(p, end, LF);
+
+        if (last == NULL) {
+            goto invalid;
+        }
+
+        n = last - p;
+
+        if (n && p[n - 1] == CR) {
+            n--;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        name.data = p;
+
+        while (p < last && *p != ':') {
+            p++;
+        }
+
+        if (p == last) {
+            goto invalid;
+        }
+
+        name.len = p - name.data;
+
+        p++;
+
+        while (p < last && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        value.data = p;
+        value.len = name.data + n - p;
+
+        while (value.len
+               && (value.data[value.len - 1] == ' '
+                   || value.data[value.len - 1] == '\t'))
+        {
+            value.len--;
+        }
+
+        p = last + 1;
+
+        name.data = ngx_pstrdup(s->pool, &name);
+        if (name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_strlow(name.data, name.data, name.len);
+
+#define ngx_http_upstream_http2_header_is(s)                                 \
+        (name.len == sizeof(s) - 1                                            \
+         && ngx_strncmp(name.data, s, sizeof(s) - 1) == 0)
+
+        if (ngx_http_upstream_http2_header_is("host")) {
+            host = value;
+            continue;
+        }
+
+        if (ngx_http_upstream_http2_header_is("connection")
+            || ngx_http_upstream_http2_header_is("keep-alive")
+            || ngx_http_upstream_http2_header_is("proxy-connection")
+            || ngx_http_upstream_http2_header_is("upgrade"))
+        {
+            continue;
+        }
+
+        if (ngx_http_upstream_http2_header_is("te")
+            && (value.len != sizeof("trailers") - 1
+                || ngx_strncasecmp(value.data, (u_char *) "trailers",
+                                   sizeof("trailers") - 1)
+                   != 0))
+        {
+            continue;
+        }
+
+        if (ngx_http_upstream_http2_header_is("transfer-encoding")) {
+            ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                          "chunked request body is not supported "
+                          "by http2 upstream");
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_upstream_http2_header_is("content-length")) {
+            s->body_rest = ngx_atoof(value.data, value.len);
+
+            if (s->body_rest == NGX_ERROR) {
+                goto invalid;
+            }
+        }
+
+#undef ngx_http_upstream_http2_header_is
+
+        h = ngx_array_push(&headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->name = name;
+        h->value = value;
+    }
+
+    /* encode the header block without using the dynamic table */
+
+    len = 1 + 1 + NGX_HTTP_V2_INT_OCTETS + uri.len;
+
+    if (!(method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0)
+        && !(method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0))
+    {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + method.len;
+
+    } else {
+        len += 1;
+    }
+
+    if (host.len) {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + host.len;
+    }
+
+    h = headers.elts;
+
+    for (i = 0; i < headers.nelts; i++) {
+        len += 1 + NGX_HTTP_V2_INT_OCTETS + h[i].name.len
+               + NGX_HTTP_V2_INT_OCTETS + h[i].value.len;
+    }
+
+    block = ngx_pnalloc(s->pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = block;
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *last++ = 0x82;                            /* :method: GET */
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *last++ = 0x83;                            /* :method: POST */
+
+    } else {
+        *last++ = 0x02;                            /* :method */
+        last = ngx_http_upstream_http2_write_string(last, method.data,
+                                                    method.len);
+    }
+
+    *last++ = 0x86;                                /* :scheme: http */
+
+    *last++ = 0x04;                                /* :path */
+    last = ngx_http_upstream_http2_write_string(last, uri.data, uri.len);
+
+    if (host.len) {
+        *last++ = 0x01;                            /* :authority */
+        last = ngx_http_upstream_http2_write_string(last, host.data,
+                                                    host.len);
+    }
+
+    for (i = 0; i < headers.nelts; i++) {
+        *last++ = 0x00;                            /* literal, new name */
+        last = ngx_http_upstream_http2_write_string(last, h[i].name.data,
+                                                    h[i].name.len);
+        last = ngx_http_upstream_http2_write_string(last, h[i].value.data,
+                                                    h[i].value.len);
+    }
+
+    /* assign a stream identifier */
+
+    if (h2->next_sid > NGX_HTTP_UPSTREAM_HTTP2_MAX_SID) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "http2 upstream stream identifiers exhausted");
+        return NGX_ERROR;
+    }
+
+    s->id = h2->next_sid;
+    h2->next_sid += 2;
+
+    if (h2->next_sid > NGX_HTTP_UPSTREAM_HTTP2_MAX_SID) {
+        h2->goaway = 1;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream request: sid:%ui \"%V %V\" body:%O",
+                   s->id, &method, &uri, s->body_rest);
+
+    /* split into HEADERS and CONTINUATION frames */
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    pos = block;
+
+    do {
+        n = ngx_min((size_t) (last - pos),
+                    NGX_HTTP_UPSTREAM_HTTP2_DEFAULT_FRAME_SIZE);
+
+        flags = NGX_HTTP_V2_NO_FLAG;
+
+        if (type == NGX_HTTP_V2_HEADERS_FRAME && s->body_rest == 0) {
+            flags |= NGX_HTTP_V2_END_STREAM_FLAG;
+        }
+
+        if (pos + n == last) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        p = ngx_http_upstream_http2_frame(h2, n, type, flags, s->id);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(p, pos, n);
+
+        pos += n;
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+
+    } while (pos < last);
+
+    s->headers_sent = 1;
+
+    if (s->body_rest == 0) {
+        s->out_closed = 1;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                  "invalid http2 upstream request header");
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_upstream_http2_write_string(u_char *p, u_char *data, size_t len)
+{
+    ngx_uint_t  prefix;
+
+    prefix = ngx_http_v2_prefix(7);
+
+    if (len < prefix) {
+        *p++ = (u_char) len;
+        return ngx_cpymem(p, data, len);
+    }
+
+    *p++ = (u_char) prefix;
+    len -= prefix;
+
+    while (len >= 128) {
+        *p++ = len % 128 + 128;
+        len /= 128;
+    }
+
+    *p++ = (u_char) len;
+
+    return ngx_cpymem(p, data, len);
+}
+
+
+static void *
+ngx_http_upstream_http2_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_http2_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_http2_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_streams = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_http2(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t        *uscf;
+    ngx_http_upstream_http2_srv_conf_t  *h2scf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (h2scf->max_streams) {
+        return "is duplicate";
+    }
+
+    h2scf->max_streams = 128;
+    h2scf->timeout = 60000;
+
+    /* read options */
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max_streams=", 12) == 0) {
+
+            n = ngx_atoi(&value[i].data[12], value[i].len - 12);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            h2scf->max_streams = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            h2scf->timeout = ngx_parse_time(&s, 0);
+
+            if (h2scf->timeout == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    h2scf->original_init_upstream = uscf->peer.init_upstream
+                                    ? uscf->peer.init_upstream
+                                    : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_http2;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -124,6 +124,13 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_http_upstream_rr_peers_wlock(peers);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config && rrp->config != *peers->config) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+#endif
+
     best = NULL;
     total = 0;
 
@@ -143,7 +150,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down || peer->ejected) {
             continue;
         }
 
@@ -198,7 +205,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->hc_down || peer->ejected) {
                 continue;
             }
 
@@ -278,8 +285,14 @@ failed:
         }
 
         ngx_http_upstream_rr_peers_wlock(peers);
+
+        rrp->peers = peers;
     }
 
+    /* a queued request retries with all the primary servers */
+
+    ngx_http_upstream_rr_peers_reset_tried(rrp);
+
     ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
@@ -0,0 +1,504 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * latencies are kept in microseconds to distinguish fast servers,
+ * though they are measured with millisecond resolution
+ */
+
+#define NGX_HTTP_UPSTREAM_PEAK_EWMA_SCALE  1000
+
+
+typedef struct {
+    ngx_msec_t                         decay;
+} ngx_http_upstream_peak_ewma_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t   rrp;
+
+    ngx_http_upstream_peak_ewma_srv_conf_t  *conf;
+
+    ngx_http_upstream_t               *upstream;
+    ngx_msec_t                         start;
+} ngx_http_upstream_peak_ewma_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_peak_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_peak_ewma_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_peak_ewma_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static uint64_t ngx_http_upstream_peak_ewma_cost(
+    ngx_http_upstream_peak_ewma_srv_conf_t *pecf,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now);
+static void *ngx_http_upstream_peak_ewma_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_peak_ewma(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_peak_ewma_commands[] = {
+
+    { ngx_string("peak_ewma"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstream_peak_ewma,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_peak_ewma_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_peak_ewma_create_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_peak_ewma_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_peak_ewma_module_ctx, /* module context */
+    ngx_http_upstream_peak_ewma_commands,  /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_peak_ewma(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init peak ewma");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_peak_ewma_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_peak_ewma_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init peak ewma peer");
+
+    pp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_peak_ewma_peer_data_t));
+    if (pp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &pp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_peak_ewma_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_peak_ewma_peer;
+
+    pp->conf = ngx_http_conf_upstream_srv_conf(us,
+                                           ngx_http_upstream_peak_ewma_module);
+    pp->upstream = r->upstream;
+    pp->start = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_peak_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp = data;
+
+    time_t                             now;
+    uint64_t                           cost0, cost1;
+    uintptr_t                          m;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i, n, p, k, r, pick[2];
+    ngx_msec_t                         msec;
+    ngx_http_upstream_rr_peer_t       *peer, *best, *choice[2];
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_data_t  *rrp;
+
+    rrp = &pp->rrp;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get peak ewma peer, try: %ui", pc->tries);
+
+    pp->start = ngx_current_msec;
+
+    if (rrp->peers->single) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+    msec = ngx_current_msec;
+
+    peers = rrp->peers;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config && rrp->config != *peers->config) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+#endif
+
+    /*
+     * pick two distinct available peers at random with reservoir
+     * sampling, and choose the one with the lower cost
+     */
+
+    k = 0;
+    choice[0] = NULL;
+    choice[1] = NULL;
+    pick[0] = 0;
+    pick[1] = 0;
+
+    for (peer = peers->peer, i = 0;
+         peer;
+         peer = peer->next, i++)
+    {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n] & m) {
+            continue;
+        }
+
+        if (peer->down || peer->hc_down || peer->ejected) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        r = (k < 2) ? k : (ngx_uint_t) ngx_random() % (k + 1);
+
+        if (r < 2) {
+            choice[r] = peer;
+            pick[r] = i;
+        }
+
+        k++;
+    }
+
+    if (k == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get peak ewma peer, no peer found");
+
+        goto failed;
+    }
+
+    best = choice[0];
+    p = pick[0];
+
+    if (k > 1) {
+        cost0 = ngx_http_upstream_peak_ewma_cost(pp->conf, choice[0], msec);
+        cost1 = ngx_http_upstream_peak_ewma_cost(pp->conf, choice[1], msec);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get peak ewma peer, %V:%uL %V:%uL",
+                       &choice[0]->name, cost0, &choice[1]->name, cost1);
+
+        if (cost1 < cost0
+            || (cost1 == cost0
+                && choice[1]->conns * choice[0]->weight
+                   < choice[0]->conns * choice[1]->weight))
+        {
+            best = choice[1];
+            p = pick[1];
+        }
+    }
+
+    if (now - best->checked > best->fail_timeout) {
+        best->checked = now;
+    }
+
+    pc->sockaddr = best->sockaddr;
+    pc->socklen = best->socklen;
+    pc->name = &best->name;
+
+    best->conns++;
+
+    rrp->current = best;
+
+    n = p / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+    rrp->tried[n] |= m;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if (peers->next) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "get peak ewma peer, backup servers");
+
+        rrp->peers = peers->next;
+
+        n = (rrp->peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        for (i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rc = ngx_http_upstream_get_peak_ewma_peer(pc, pp);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_free_peak_ewma_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_peak_ewma_peer_data_t  *pp = data;
+
+    ngx_uint_t                    sample, ewma, bound;
+    ngx_msec_t                    now, elapsed, decay;
+    ngx_msec_int_t                dt;
+    ngx_http_upstream_state_t    *us;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    peer = pp->rrp.current;
+
+    if (peer == NULL || pp->start == 0) {
+        goto done;
+    }
+
+    now = ngx_current_msec;
+    us = pp->upstream->state;
+
+    /* sample the time to the response header, or the time spent */
+
+    if (us && us->header_time != (ngx_msec_t) -1 && !(state & NGX_PEER_FAILED))
+    {
+        elapsed = us->header_time;
+        bound = 0;
+
+    } else {
+        elapsed = now - pp->start;
+        bound = 1;
+    }
+
+    sample = elapsed * NGX_HTTP_UPSTREAM_PEAK_EWMA_SCALE;
+
+    decay = pp->conf->decay;
+
+    ngx_http_upstream_rr_peers_rlock(pp->rrp.peers);
+    ngx_http_upstream_rr_peer_lock(pp->rrp.peers, peer);
+
+    ewma = peer->ewma;
+
+    /* the stamp may come from another worker which updated its time later */
+
+    dt = (ngx_msec_int_t) (now - peer->ewma_stamp);
+
+    if (dt < 0) {
+        dt = 0;
+    }
+
+    if (bound) {
+
+        /*
+         * a failed or cancelled attempt only shows that the server
+         * takes at least that long, so it never makes it look faster
+         */
+
+        sample = ngx_max(sample, ewma);
+    }
+
+    if (sample > ewma || peer->ewma_stamp == 0) {
+
+        /* the peak is taken as is */
+
+        ewma = sample;
+
+    } else {
+
+        /*
+         * the weight of the old value decays with time since the last
+         * sample, decay / (decay + dt) approximates exp(-dt / decay)
+         */
+
+        ewma = (uint64_t) ewma * decay / (decay + dt)
+               + (uint64_t) sample * dt / (decay + dt);
+    }
+
+    peer->ewma = ewma;
+    peer->ewma_stamp = now ? now : 1;
+
+    ngx_http_upstream_rr_peer_unlock(pp->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(pp->rrp.peers);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free peak ewma peer %V: sample:%M ewma:%ui",
+                   &peer->name, elapsed, ewma);
+
+    pp->start = 0;
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &pp->rrp, state);
+}
+
+
+static uint64_t
+ngx_http_upstream_peak_ewma_cost(ngx_http_upstream_peak_ewma_srv_conf_t *pecf,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t now)
+{
+    uint64_t        ewma;
+    ngx_msec_int_t  dt;
+
+    /* latency decays towards zero while the peer is not sampled */
+
+    ewma = peer->ewma;
+
+    if (ewma && peer->ewma_stamp) {
+        dt = (ngx_msec_int_t) (now - peer->ewma_stamp);
+
+        if (dt > 0) {
+            ewma = ewma * pecf->decay / (pecf->decay + dt);
+        }
+    }
+
+    /*
+     * requests in flight multiply the expected latency, and the cost
+     * is scaled by the configured weight
+     */
+
+    return (ewma + 1) * (peer->conns + 1) * 1000 / peer->weight;
+}
+
+
+static void *
+ngx_http_upstream_peak_ewma_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_peak_ewma_srv_conf_t  *conf;
+
+    conf = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_peak_ewma_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->decay = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_peak_ewma(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_peak_ewma_srv_conf_t  *pecf = conf;
+
+    ngx_str_t                     *value, s;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    pecf->decay = 10000;
+
+    if (cf->args->nelts == 2) {
+        value = cf->args->elts;
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[1].len - 6;
+        s.data = &value[1].data[6];
+
+        pecf->decay = ngx_parse_time(&s, 0);
+
+        if (pecf->decay == (ngx_msec_t) NGX_ERROR || pecf->decay == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay time \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_peak_ewma;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    return NGX_CONF_OK;
+}
@@ -10,12 +10,91 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_CONF_LINE_LEN                                       \
+    (sizeof(" weight= max_fails= fail_timeout=s max_conns= slow_start=ms"     \
+            " backup drain; # id= conns= unhealthy ejected starting\n") - 1   \
+     + 5 * NGX_INT_T_LEN + NGX_TIME_T_LEN + NGX_INT_T_LEN)
+
+
+typedef struct {
+    ngx_int_t                      weight;
+    ngx_int_t                      max_fails;
+    time_t                         fail_timeout;
+    ngx_int_t                      max_conns;
+    ngx_msec_t                     slow_start;
+
+    ngx_uint_t                     set;       /* unsigned  set:1; */
+    ngx_uint_t                     up;        /* unsigned  up:1; */
+    ngx_uint_t                     down;      /* unsigned  down:1; */
+    ngx_uint_t                     drain;     /* unsigned  drain:1; */
+    ngx_uint_t                     backup;    /* unsigned  backup:1; */
+} ngx_http_upstream_conf_params_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t  *upstream;
+    ngx_http_upstream_server_t    *server;
+    ngx_event_t                    event;
+    ngx_uint_t                     resolved;  /* unsigned  resolved:1; */
+} ngx_http_upstream_zone_resolve_t;
+
+
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
     void *data);
 static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_add_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_rr_peer_t *src);
+static void ngx_http_upstream_zone_remove_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_rr_peer_t *peer);
+
+static ngx_int_t ngx_http_upstream_zone_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_zone_resolve_update(
+    ngx_http_upstream_zone_resolve_t *zr, ngx_resolver_addr_t *addrs,
+    ngx_uint_t naddrs);
+static ngx_uint_t ngx_http_upstream_zone_resolved_peer(
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_server_t *server);
+
+static char *ngx_http_upstream_outlier_detection(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static void ngx_http_upstream_outlier_timer(ngx_event_t *ev);
+static void ngx_http_upstream_outlier_detect(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_upstream_rr_peers_t *list, ngx_log_t *log);
+
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_process(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_upstream_conf_parse(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_conf_params_t *params,
+    u_char **err);
+static ngx_int_t ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_conf_params_t *params, ngx_http_upstream_rr_peer_t **pp,
+    u_char **err);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_conf_find(
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t id,
+    ngx_http_upstream_rr_peers_t **list);
+static void ngx_http_upstream_conf_update(ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_conf_params_t *params);
+static void ngx_http_upstream_conf_set(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_params_t *params);
+static ngx_chain_t *ngx_http_upstream_conf_list(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peer_t *one);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_uint_t status, char *text);
+static ngx_int_t ngx_http_upstream_conf_output(ngx_http_request_t *r,
+    ngx_uint_t status, ngx_chain_t *out);
 
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
@@ -27,13 +106,27 @@ static ngx_command_t  ngx_http_upstream_zone_commands[] = {
       0,
       NULL },
 
+    { ngx_string("outlier_detection"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_outlier_detection,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
     NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_upstream_zone_init,           /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -53,7 +146,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_worker,    /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -185,9 +278,15 @@ static ngx_http_upstream_rr_peers_t *
 ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_http_upstream_srv_conf_t *uscf)
 {
+    ngx_uint_t                     id, *config;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
 
+    config = ngx_slab_calloc(shpool, sizeof(ngx_uint_t));
+    if (config == NULL) {
+        return NULL;
+    }
+
     peers = ngx_slab_alloc(shpool, sizeof(ngx_http_upstream_rr_peers_t));
     if (peers == NULL) {
         return NULL;
@@ -196,16 +295,17 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_memcpy(peers, uscf->peer.data, sizeof(ngx_http_upstream_rr_peers_t));
 
     peers->shpool = shpool;
+    peers->config = config;
+
+    id = 0;
 
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
-        /* pool is unlocked */
-        peer = ngx_slab_calloc_locked(shpool,
-                                      sizeof(ngx_http_upstream_rr_peer_t));
+        peer = ngx_http_upstream_zone_copy_peer(peers, *peerp);
         if (peer == NULL) {
             return NULL;
         }
 
-        ngx_memcpy(peer, *peerp, sizeof(ngx_http_upstream_rr_peer_t));
+        peer->id = id++;
 
         *peerp = peer;
     }
@@ -222,16 +322,15 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_memcpy(backup, peers->next, sizeof(ngx_http_upstream_rr_peers_t));
 
     backup->shpool = shpool;
+    backup->config = config;
 
     for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
-        /* pool is unlocked */
-        peer = ngx_slab_calloc_locked(shpool,
-                                      sizeof(ngx_http_upstream_rr_peer_t));
+        peer = ngx_http_upstream_zone_copy_peer(backup, *peerp);
         if (peer == NULL) {
             return NULL;
         }
 
-        ngx_memcpy(peer, *peerp, sizeof(ngx_http_upstream_rr_peer_t));
+        peer->id = id++;
 
         *peerp = peer;
     }
@@ -244,3 +343,1542 @@ done:
 
     return peers;
 }
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_zone_copy_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *src)
+{
+    u_char                       *p;
+    size_t                        size;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /*
+     * the address, name and server strings are allocated together
+     * with the peer, so that ngx_http_upstream_rr_peer_free() can free
+     * a peer removed at runtime
+     */
+
+    size = sizeof(ngx_http_upstream_rr_peer_t) + src->socklen
+           + src->name.len + src->server.len;
+
+    peer = ngx_slab_alloc(peers->shpool, size);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(peer, src, sizeof(ngx_http_upstream_rr_peer_t));
+
+    p = (u_char *) peer + sizeof(ngx_http_upstream_rr_peer_t);
+
+    peer->sockaddr = (struct sockaddr *) p;
+    p = ngx_cpymem(p, src->sockaddr, src->socklen);
+
+    peer->name.data = p;
+    p = ngx_cpymem(p, src->name.data, src->name.len);
+
+    peer->server.data = p;
+    ngx_memcpy(p, src->server.data, src->server.len);
+
+    return peer;
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_zone_add_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peers_t *list, ngx_http_upstream_rr_peer_t *src)
+{
+    ngx_uint_t                     id;
+    ngx_http_upstream_rr_peer_t   *peer, **peerp;
+    ngx_http_upstream_rr_peers_t  *pl;
+
+    id = 0;
+
+    for (pl = peers; pl; pl = pl->next) {
+        for (peer = pl->peer; peer; peer = peer->next) {
+            if (peer->id >= id) {
+                id = peer->id + 1;
+            }
+        }
+    }
+
+    peer = ngx_http_upstream_zone_copy_peer(list, src);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    peer->id = id;
+
+    for (peerp = &list->peer; *peerp; peerp = &(*peerp)->next) { /* void */ }
+
+    *peerp = peer;
+
+    list->number++;
+    list->total_weight += peer->weight;
+    list->weighted = (list->total_weight != list->number);
+
+    peers->single = (peers->number == 1 && peers->next == NULL);
+
+    (*peers->config)++;
+
+    return peer;
+}
+
+
+static void
+ngx_http_upstream_zone_remove_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peers_t *list, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_http_upstream_rr_peer_t  **peerp;
+
+    for (peerp = &list->peer; *peerp != peer; peerp = &(*peerp)->next) {
+        /* void */
+    }
+
+    *peerp = peer->next;
+
+    list->number--;
+    list->total_weight -= peer->weight;
+    list->weighted = (list->total_weight != list->number);
+
+    peers->single = (peers->number == 1 && peers->next == NULL);
+
+    (*peers->config)++;
+
+    /*
+     * requests in progress keep using the peer, it is freed
+     * by ngx_http_upstream_free_round_robin_peer() after the last one
+     */
+
+    if (peer->conns) {
+        peer->zombie = 1;
+        return;
+    }
+
+    ngx_http_upstream_rr_peer_free(list, peer);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                      i, j;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_srv_conf_t  **uscfp, *uscf;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->servers == NULL) {
+            continue;
+        }
+
+        if (uscf->outlier && uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "outlier detection requires upstream \"%V\" "
+                          "in %s:%ui to be in shared memory",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_ERROR;
+        }
+
+        server = uscf->servers->elts;
+
+        for (j = 0; j < uscf->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            if (uscf->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "resolving names at run time requires "
+                              "upstream \"%V\" in %s:%ui "
+                              "to be in shared memory",
+                              &uscf->host, uscf->file_name, uscf->line);
+                return NGX_ERROR;
+            }
+
+            if (clcf->resolver == NULL
+                || clcf->resolver->connections.nelts == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "no resolver defined to resolve names "
+                              "at run time in upstream \"%V\" in %s:%ui",
+                              &uscf->host, uscf->file_name, uscf->line);
+                return NGX_ERROR;
+            }
+
+            uscf->resolver = clcf->resolver;
+            uscf->resolver_timeout = clcf->resolver_timeout;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                         i, j;
+    ngx_event_t                       *ev;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_upstream_srv_conf_t     **uscfp, *uscf;
+    ngx_http_upstream_main_conf_t     *umcf;
+    ngx_http_upstream_zone_resolve_t  *zr;
+
+    /*
+     * peers are shared, so names are resolved and outliers are detected
+     * by one worker only
+     */
+
+    if ((ngx_process != NGX_PROCESS_WORKER
+         && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->servers == NULL) {
+            continue;
+        }
+
+        if (uscf->outlier) {
+            ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+            if (ev == NULL) {
+                return NGX_ERROR;
+            }
+
+            ev->handler = ngx_http_upstream_outlier_timer;
+            ev->data = uscf;
+            ev->log = cycle->log;
+            ev->cancelable = 1;
+
+            ngx_add_timer(ev, uscf->outlier->interval);
+        }
+
+        server = uscf->servers->elts;
+
+        for (j = 0; j < uscf->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            zr = ngx_pcalloc(cycle->pool,
+                             sizeof(ngx_http_upstream_zone_resolve_t));
+            if (zr == NULL) {
+                return NGX_ERROR;
+            }
+
+            zr->upstream = uscf;
+            zr->server = &server[j];
+
+            ev = &zr->event;
+
+            ev->handler = ngx_http_upstream_zone_resolve_timer;
+            ev->data = zr;
+            ev->log = cycle->log;
+            ev->cancelable = 1;
+
+            ngx_add_timer(ev, 1);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t                *ctx;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_zone_resolve_t  *zr;
+
+    zr = ev->data;
+    uscf = zr->upstream;
+
+    ctx = ngx_resolve_start(uscf->resolver, NULL);
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        goto failed;
+    }
+
+    ctx->name = zr->server->host;
+    ctx->service = zr->server->service;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = zr;
+    ctx->timeout = uscf->resolver_timeout;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+failed:
+
+    ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                  "could not start resolving \"%V\" in upstream \"%V\"",
+                  &zr->server->host, &uscf->host);
+
+    ngx_add_timer(ev, 10000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                             valid;
+    ngx_uint_t                         i, j, n, priority;
+    ngx_sockaddr_t                    *sockaddr;
+    ngx_resolver_addr_t               *addrs;
+    ngx_resolver_srv_name_t           *srv;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_upstream_zone_resolve_t  *zr;
+
+    zr = ctx->data;
+    server = zr->server;
+
+    addrs = NULL;
+    sockaddr = NULL;
+    priority = 0;
+    n = 0;
+
+    /* NXDOMAIN means that all addresses are gone */
+
+    if (ctx->state && ctx->state != NGX_RESOLVE_NXDOMAIN) {
+        ngx_log_error(NGX_LOG_ERR, zr->event.log, 0,
+                      "%V could not be resolved (%i: %s) in upstream \"%V\"",
+                      &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state),
+                      &zr->upstream->host);
+        goto done;
+    }
+
+    if (ctx->state == NGX_OK) {
+
+        if (server->service.len) {
+
+            /* only servers of the most preferred priority are used */
+
+            priority = NGX_MAX_UINT32_VALUE;
+
+            for (i = 0; i < ctx->nsrvs; i++) {
+                if (ctx->srvs[i].naddrs && ctx->srvs[i].priority < priority) {
+                    priority = ctx->srvs[i].priority;
+                }
+            }
+
+            for (i = 0; i < ctx->nsrvs; i++) {
+                if (ctx->srvs[i].priority == priority) {
+                    n += ctx->srvs[i].naddrs;
+                }
+            }
+
+            if (n == 0) {
+                ngx_log_error(NGX_LOG_ERR, zr->event.log, 0,
+                              "%V could not be resolved "
+                              "(no SRV target addresses) in upstream \"%V\"",
+                              &ctx->name, &zr->upstream->host);
+                goto done;
+            }
+
+        } else {
+            n = ctx->naddrs;
+        }
+    }
+
+    if (n) {
+        addrs = ngx_alloc(n * (sizeof(ngx_resolver_addr_t)
+                               + sizeof(ngx_sockaddr_t)),
+                          zr->event.log);
+        if (addrs == NULL) {
+            goto done;
+        }
+
+        sockaddr = (ngx_sockaddr_t *) &addrs[n];
+    }
+
+    if (server->service.len) {
+
+        n = 0;
+
+        for (i = 0; i < ctx->nsrvs; i++) {
+            srv = &ctx->srvs[i];
+
+            if (srv->priority != priority) {
+                continue;
+            }
+
+            for (j = 0; j < srv->naddrs; j++) {
+                ngx_memcpy(&sockaddr[n], srv->addrs[j].sockaddr,
+                           srv->addrs[j].socklen);
+
+                addrs[n].sockaddr = &sockaddr[n].sockaddr;
+                addrs[n].socklen = srv->addrs[j].socklen;
+                addrs[n].weight = srv->weight ? srv->weight : 1;
+                n++;
+            }
+        }
+
+    } else {
+
+        for (i = 0; i < n; i++) {
+            ngx_memcpy(&sockaddr[i], ctx->addrs[i].sockaddr,
+                       ctx->addrs[i].socklen);
+
+            ngx_inet_set_port(&sockaddr[i].sockaddr, server->port);
+
+            addrs[i].sockaddr = &sockaddr[i].sockaddr;
+            addrs[i].socklen = ctx->addrs[i].socklen;
+            addrs[i].weight = server->weight;
+        }
+    }
+
+    ngx_http_upstream_zone_resolve_update(zr, addrs, n);
+
+    zr->resolved = 1;
+
+    if (addrs) {
+        ngx_free(addrs);
+    }
+
+done:
+
+    valid = ctx->valid;
+
+    ngx_resolve_name_done(ctx);
+
+    /* names are resolved again once the shortest TTL expires */
+
+    valid -= ngx_time();
+
+    ngx_add_timer(&zr->event, (valid > 0 ? (ngx_msec_t) valid : 1) * 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_update(ngx_http_upstream_zone_resolve_t *zr,
+    ngx_resolver_addr_t *addrs, ngx_uint_t naddrs)
+{
+    u_char                         text[NGX_SOCKADDR_STRLEN];
+    ngx_uint_t                     i;
+    ngx_http_upstream_server_t    *server;
+    ngx_http_upstream_rr_peer_t    src, *peer, *next;
+    ngx_http_upstream_rr_peers_t  *peers, *list;
+
+    server = zr->server;
+    peers = zr->upstream->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (peers->next) {
+        ngx_http_upstream_rr_peers_wlock(peers->next);
+    }
+
+    list = server->backup ? peers->next : peers;
+
+    /*
+     * new addresses are added before stale ones are removed, so that
+     * an upstream is not left without servers when the only name
+     * changes its address
+     */
+
+    for (i = 0; i < naddrs; i++) {
+
+        for (peer = list->peer; peer; peer = peer->next) {
+
+            if (ngx_http_upstream_zone_resolved_peer(peer, server)
+                && ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                    addrs[i].sockaddr, addrs[i].socklen, 1)
+                   == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (peer) {
+
+            /* the address is unchanged, so is the peer and its state */
+
+            if (peer->weight != addrs[i].weight) {
+                list->total_weight -= peer->weight;
+
+                peer->weight = addrs[i].weight;
+                peer->effective_weight = peer->weight;
+                peer->current_weight = 0;
+
+                list->total_weight += peer->weight;
+                list->weighted = (list->total_weight != list->number);
+            }
+
+            continue;
+        }
+
+        ngx_memzero(&src, sizeof(ngx_http_upstream_rr_peer_t));
+
+        src.sockaddr = addrs[i].sockaddr;
+        src.socklen = addrs[i].socklen;
+        src.name.len = ngx_sock_ntop(src.sockaddr, src.socklen, text,
+                                     NGX_SOCKADDR_STRLEN, 1);
+        src.name.data = text;
+        src.server = server->name;
+
+        src.weight = addrs[i].weight;
+        src.effective_weight = src.weight;
+        src.max_conns = server->max_conns;
+        src.max_fails = server->max_fails;
+        src.fail_timeout = server->fail_timeout;
+        src.slow_start = server->slow_start;
+        src.down = server->down;
+
+        /* servers resolved at startup are put into service at once */
+
+        if (zr->resolved) {
+            ngx_http_upstream_rr_peer_start(&src);
+        }
+
+        peer = ngx_http_upstream_zone_add_peer(peers, list, &src);
+        if (peer == NULL) {
+            ngx_log_error(NGX_LOG_CRIT, zr->event.log, 0,
+                          "no memory in upstream zone \"%V\" "
+                          "to add server %V", &zr->upstream->shm_zone->shm.name,
+                          &src.name);
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, zr->event.log, 0,
+                      "upstream \"%V\": server %V of \"%V\" added",
+                      &zr->upstream->host, &peer->name, &server->name);
+    }
+
+    for (peer = list->peer; peer; peer = next) {
+        next = peer->next;
+
+        if (!ngx_http_upstream_zone_resolved_peer(peer, server)) {
+            continue;
+        }
+
+        for (i = 0; i < naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 addrs[i].sockaddr, addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < naddrs || (list == peers && peers->number == 1)) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, zr->event.log, 0,
+                      "upstream \"%V\": server %V of \"%V\" removed",
+                      &zr->upstream->host, &peer->name, &server->name);
+
+        ngx_http_upstream_zone_remove_peer(peers, list, peer);
+    }
+
+    if (peers->next) {
+        ngx_http_upstream_rr_peers_unlock(peers->next);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_zone_resolved_peer(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_server_t *server)
+{
+    return peer->server.len == server->name.len
+           && ngx_strncmp(peer->server.data, server->name.data,
+                          server->name.len)
+              == 0;
+}
+
+
+static char *
+ngx_http_upstream_outlier_detection(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s;
+    ngx_uint_t                     i;
+    ngx_msec_t                     ms;
+    ngx_http_upstream_outlier_t   *ol;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->outlier) {
+        return "is duplicate";
+    }
+
+    ol = ngx_palloc(cf->pool, sizeof(ngx_http_upstream_outlier_t));
+    if (ol == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ol->interval = 10000;
+    ol->ejection_time = 30000;
+    ol->percentile = 95;
+    ol->latency = 300;
+    ol->errors = 20;
+    ol->min_requests = 20;
+    ol->max_ejected = 50;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            ms = ngx_parse_time(&s, 0);
+            if (ms == (ngx_msec_t) NGX_ERROR || ms == 0) {
+                goto invalid;
+            }
+
+            ol->interval = ms;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ejection_time=", 14) == 0) {
+
+            s.len = value[i].len - 14;
+            s.data = value[i].data + 14;
+
+            ms = ngx_parse_time(&s, 0);
+            if (ms == (ngx_msec_t) NGX_ERROR || ms == 0) {
+                goto invalid;
+            }
+
+            ol->ejection_time = ms;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "percentile=", 11) == 0) {
+
+            n = ngx_atoi(value[i].data + 11, value[i].len - 11);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            ol->percentile = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
+
+            n = ngx_atofp(value[i].data + 8, value[i].len - 8, 2);
+            if (n == NGX_ERROR || n <= 100) {
+                goto invalid;
+            }
+
+            ol->latency = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "errors=", 7) == 0) {
+
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            ol->errors = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min_requests=", 13) == 0) {
+
+            n = ngx_atoi(value[i].data + 13, value[i].len - 13);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ol->min_requests = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_ejected=", 12) == 0) {
+
+            n = ngx_atoi(value[i].data + 12, value[i].len - 12);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            ol->max_ejected = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf->outlier = ol;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static void
+ngx_http_upstream_outlier_timer(ngx_event_t *ev)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    uscf = ev->data;
+    peers = uscf->peer.data;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    ngx_http_upstream_outlier_detect(uscf, peers, ev->log);
+
+    if (peers->next) {
+        ngx_http_upstream_rr_peers_wlock(peers->next);
+
+        ngx_http_upstream_outlier_detect(uscf, peers->next, ev->log);
+
+        ngx_http_upstream_rr_peers_unlock(peers->next);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_add_timer(ev, uscf->outlier->interval);
+}
+
+
+static void
+ngx_http_upstream_outlier_detect(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_upstream_rr_peers_t *list, ngx_log_t *log)
+{
+    uint64_t                      total, others;
+    ngx_msec_t                    now, time;
+    ngx_uint_t                    n, ejected, max, requests, errors,
+                                  rate, others_rate;
+    ngx_http_upstream_outlier_t  *ol;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    ol = uscf->outlier;
+    now = ngx_current_msec;
+
+    /* peers whose ejection time has passed are put back into service */
+
+    ejected = 0;
+
+    for (peer = list->peer; peer; peer = peer->next) {
+
+        if (peer->ejected == 0) {
+            continue;
+        }
+
+        if ((ngx_msec_int_t) (peer->ejected - now) > 0) {
+            ejected++;
+            continue;
+        }
+
+        peer->ejected = 0;
+        ngx_http_upstream_rr_peer_start(peer);
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "upstream \"%V\": server %V returned after ejection",
+                      &uscf->host, &peer->name);
+    }
+
+    /*
+     * each peer with enough requests in the interval is compared
+     * with the rest of the population: its latency percentile with
+     * the mean of the others, and its error rate with theirs
+     */
+
+    n = 0;
+    total = 0;
+    requests = 0;
+    errors = 0;
+
+    for (peer = list->peer; peer; peer = peer->next) {
+
+        if (peer->down || peer->hc_down || peer->ejected
+            || peer->ol_requests < ol->min_requests)
+        {
+            continue;
+        }
+
+        n++;
+        total += ngx_http_upstream_time_percentile(peer->ol_times,
+                                                   peer->ol_requests,
+                                                   ol->percentile);
+        requests += peer->ol_requests;
+        errors += peer->ol_errors;
+    }
+
+    max = list->number * ol->max_ejected / 100;
+
+    for (peer = list->peer; n > 1 && peer; peer = peer->next) {
+
+        if (peer->down || peer->hc_down || peer->ejected
+            || peer->ol_requests < ol->min_requests)
+        {
+            continue;
+        }
+
+        time = ngx_http_upstream_time_percentile(peer->ol_times,
+                                                 peer->ol_requests,
+                                                 ol->percentile);
+        others = (total - time) / (n - 1);
+
+        if (others == 0) {
+            others = 1;
+        }
+
+        rate = peer->ol_errors * 100 / peer->ol_requests;
+        others_rate = (errors - peer->ol_errors) * 100
+                      / (requests - peer->ol_requests);
+
+        if ((uint64_t) time * 100 <= others * ol->latency
+            && rate < others_rate + ol->errors)
+        {
+            continue;
+        }
+
+        if (ejected >= max) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "upstream \"%V\": server %V is an outlier, "
+                          "but too many servers are ejected",
+                          &uscf->host, &peer->name);
+            continue;
+        }
+
+        ejected++;
+        peer->ejected = now + ol->ejection_time;
+
+        if (peer->ejected == 0) {
+            peer->ejected = 1;
+        }
+
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "upstream \"%V\": server %V ejected, "
+                      "p%ui %Mms (others %uLms), errors %ui%% (others %ui%%)",
+                      &uscf->host, &peer->name, ol->percentile, time,
+                      others, rate, others_rate);
+    }
+
+    /* statistics are collected anew for each interval */
+
+    for (peer = list->peer; peer; peer = peer->next) {
+        peer->ol_requests = 0;
+        peer->ol_errors = 0;
+        ngx_memzero(peer->ol_times, sizeof(peer->ol_times));
+    }
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                        rc;
+    ngx_str_t                        name;
+    ngx_uint_t                       i;
+    ngx_http_upstream_srv_conf_t   **uscfp, *uscf;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                           "upstream is required");
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscf = NULL;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL
+            || uscfp[i]->host.len != name.len
+            || ngx_strncmp(uscfp[i]->host.data, name.data, name.len) != 0)
+        {
+            continue;
+        }
+
+        uscf = uscfp[i];
+        break;
+    }
+
+    if (uscf == NULL) {
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_FOUND,
+                                           "upstream not found");
+    }
+
+    if (uscf->shm_zone == NULL) {
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                           "upstream has no zone");
+    }
+
+    return ngx_http_upstream_conf_process(r, uscf);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_process(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    u_char                           *err;
+    ngx_int_t                         id, rc;
+    ngx_str_t                         value;
+    ngx_chain_t                      *out;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers, *list;
+    ngx_http_upstream_conf_params_t   params;
+
+    if (ngx_http_upstream_conf_parse(r, uscf, &params, &err) != NGX_OK) {
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                           (char *) err);
+    }
+
+    id = NGX_ERROR;
+
+    if (ngx_http_arg(r, (u_char *) "id", 2, &value) == NGX_OK) {
+        id = ngx_atoi(value.data, value.len);
+
+        if (id == NGX_ERROR) {
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                               "invalid \"id\"");
+        }
+    }
+
+    peers = uscf->peer.data;
+    out = NULL;
+    err = NULL;
+    rc = NGX_HTTP_OK;
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    if (peers->next) {
+        ngx_http_upstream_rr_peers_wlock(peers->next);
+    }
+
+    if (ngx_http_arg(r, (u_char *) "add", 3, &value) == NGX_OK) {
+
+        if (params.backup && peers->next == NULL) {
+            rc = NGX_HTTP_BAD_REQUEST;
+            err = (u_char *) "upstream has no backup servers";
+            goto done;
+        }
+
+        list = params.backup ? peers->next : peers;
+
+        rc = ngx_http_upstream_conf_add(r, peers, list, &params, &peer, &err);
+
+        if (rc == NGX_HTTP_OK) {
+            out = ngx_http_upstream_conf_list(r, uscf, peer);
+        }
+
+        goto done;
+    }
+
+    if (id == NGX_ERROR) {
+
+        if (params.set) {
+            rc = NGX_HTTP_BAD_REQUEST;
+            err = (u_char *) "\"id\" is required";
+            goto done;
+        }
+
+        out = ngx_http_upstream_conf_list(r, uscf, NULL);
+        goto done;
+    }
+
+    peer = ngx_http_upstream_conf_find(peers, (ngx_uint_t) id, &list);
+
+    if (peer == NULL) {
+        rc = NGX_HTTP_NOT_FOUND;
+        err = (u_char *) "server not found";
+        goto done;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "remove", 6, &value) == NGX_OK) {
+
+        if (list == peers && peers->number == 1) {
+            rc = NGX_HTTP_BAD_REQUEST;
+            err = (u_char *) "cannot remove the last server";
+            goto done;
+        }
+
+        ngx_http_upstream_zone_remove_peer(peers, list, peer);
+
+        out = ngx_http_upstream_conf_list(r, uscf, NULL);
+        goto done;
+    }
+
+    ngx_http_upstream_conf_update(list, peer, &params);
+
+    out = ngx_http_upstream_conf_list(r, uscf, peer);
+
+done:
+
+    if (peers->next) {
+        ngx_http_upstream_rr_peers_unlock(peers->next);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (err) {
+        return ngx_http_upstream_conf_send(r, rc, (char *) err);
+    }
+
+    if (rc != NGX_HTTP_OK) {
+        return rc;
+    }
+
+    if (out == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_http_upstream_conf_output(r, NGX_HTTP_OK, out);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_parse(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_conf_params_t *params,
+    u_char **err)
+{
+    time_t      fail_timeout;
+    ngx_int_t   n;
+    ngx_str_t   value;
+    ngx_msec_t  slow_start;
+
+    ngx_memzero(params, sizeof(ngx_http_upstream_conf_params_t));
+
+    params->weight = NGX_CONF_UNSET;
+    params->max_fails = NGX_CONF_UNSET;
+    params->fail_timeout = NGX_CONF_UNSET;
+    params->max_conns = NGX_CONF_UNSET;
+    params->slow_start = NGX_CONF_UNSET_MSEC;
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_WEIGHT)) {
+            goto not_supported;
+        }
+
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR || n == 0) {
+            *err = (u_char *) "invalid \"weight\"";
+            return NGX_ERROR;
+        }
+
+        params->weight = n;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_fails", 9, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_FAILS)) {
+            goto not_supported;
+        }
+
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            *err = (u_char *) "invalid \"max_fails\"";
+            return NGX_ERROR;
+        }
+
+        params->max_fails = n;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "fail_timeout", 12, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_FAIL_TIMEOUT)) {
+            goto not_supported;
+        }
+
+        fail_timeout = ngx_parse_time(&value, 1);
+
+        if (fail_timeout == (time_t) NGX_ERROR) {
+            *err = (u_char *) "invalid \"fail_timeout\"";
+            return NGX_ERROR;
+        }
+
+        params->fail_timeout = fail_timeout;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_conns", 9, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+            goto not_supported;
+        }
+
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            *err = (u_char *) "invalid \"max_conns\"";
+            return NGX_ERROR;
+        }
+
+        params->max_conns = n;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "slow_start", 10, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_SLOW_START)) {
+            goto not_supported;
+        }
+
+        slow_start = ngx_parse_time(&value, 0);
+
+        if (slow_start == (ngx_msec_t) NGX_ERROR) {
+            *err = (u_char *) "invalid \"slow_start\"";
+            return NGX_ERROR;
+        }
+
+        params->slow_start = slow_start;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "down", 4, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_DOWN)) {
+            goto not_supported;
+        }
+
+        params->down = 1;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "drain", 5, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_DOWN)) {
+            goto not_supported;
+        }
+
+        params->drain = 1;
+        params->set = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "up", 2, &value) == NGX_OK) {
+        params->up = 1;
+        params->set = 1;
+    }
+
+    if (params->up + params->down + params->drain > 1) {
+        *err = (u_char *) "\"up\", \"down\" and \"drain\" "
+                          "are mutually exclusive";
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "backup", 6, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_BACKUP)) {
+            goto not_supported;
+        }
+
+        params->backup = 1;
+    }
+
+    return NGX_OK;
+
+not_supported:
+
+    *err = (u_char *) "parameter is not supported by the balancing method";
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_conf_params_t *params, ngx_http_upstream_rr_peer_t **pp,
+    u_char **err)
+{
+    ngx_url_t                     u;
+    ngx_http_upstream_rr_peer_t   src, *peer;
+    ngx_http_upstream_rr_peers_t  *pl;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    if (ngx_http_arg(r, (u_char *) "server", 6, &u.url) != NGX_OK) {
+        *err = (u_char *) "\"server\" is required";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /* the request is processed in a worker, so names are not resolved */
+
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(r->pool, &u) != NGX_OK || u.naddrs != 1) {
+        *err = (u_char *) "invalid \"server\", an address is expected";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    for (pl = peers; pl; pl = pl->next) {
+        for (peer = pl->peer; peer; peer = peer->next) {
+
+            if (peer->name.len == u.addrs[0].name.len
+                && ngx_strncmp(peer->name.data, u.addrs[0].name.data,
+                               peer->name.len)
+                   == 0)
+            {
+                *err = (u_char *) "server already exists";
+                return NGX_HTTP_CONFLICT;
+            }
+        }
+    }
+
+    ngx_memzero(&src, sizeof(ngx_http_upstream_rr_peer_t));
+
+    src.sockaddr = u.addrs[0].sockaddr;
+    src.socklen = u.addrs[0].socklen;
+    src.name = u.addrs[0].name;
+    src.server = u.url;
+
+    src.weight = 1;
+    src.max_fails = 1;
+    src.fail_timeout = 10;
+
+    ngx_http_upstream_conf_set(&src, params);
+
+    src.effective_weight = src.weight;
+
+    ngx_http_upstream_rr_peer_start(&src);
+
+    peer = ngx_http_upstream_zone_add_peer(peers, list, &src);
+    if (peer == NULL) {
+        *err = (u_char *) "no memory in upstream zone";
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    *pp = peer;
+
+    return NGX_HTTP_OK;
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_conf_find(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t id, ngx_http_upstream_rr_peers_t **list)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    for ( /* void */ ; peers; peers = peers->next) {
+        for (peer = peers->peer; peer; peer = peer->next) {
+            if (peer->id == id) {
+                *list = peers;
+                return peer;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_conf_update(ngx_http_upstream_rr_peers_t *list,
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_conf_params_t *params)
+{
+    ngx_uint_t  down;
+
+    down = peer->down;
+
+    list->total_weight -= peer->weight;
+
+    ngx_http_upstream_conf_set(peer, params);
+
+    list->total_weight += peer->weight;
+    list->weighted = (list->total_weight != list->number);
+
+    if (params->weight != NGX_CONF_UNSET) {
+        peer->effective_weight = peer->weight;
+        peer->current_weight = 0;
+    }
+
+    if (params->up) {
+
+        if (down || (peer->max_fails && peer->fails >= peer->max_fails)) {
+            ngx_http_upstream_rr_peer_start(peer);
+        }
+
+        peer->fails = 0;
+    }
+}
+
+
+static void
+ngx_http_upstream_conf_set(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_conf_params_t *params)
+{
+    if (params->weight != NGX_CONF_UNSET) {
+        peer->weight = params->weight;
+    }
+
+    if (params->max_fails != NGX_CONF_UNSET) {
+        peer->max_fails = params->max_fails;
+    }
+
+    if (params->fail_timeout != NGX_CONF_UNSET) {
+        peer->fail_timeout = params->fail_timeout;
+    }
+
+    if (params->max_conns != NGX_CONF_UNSET) {
+        peer->max_conns = params->max_conns;
+    }
+
+    if (params->slow_start != NGX_CONF_UNSET_MSEC) {
+        peer->slow_start = params->slow_start;
+    }
+
+    if (params->up) {
+        peer->down = 0;
+        peer->drain = 0;
+    }
+
+    if (params->down) {
+        peer->down = 1;
+        peer->drain = 0;
+    }
+
+    if (params->drain) {
+        peer->down = 1;
+        peer->drain = 1;
+    }
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_conf_list(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peer_t *one)
+{
+    size_t                         len;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers, *pl;
+
+    peers = uscf->peer.data;
+
+    len = 0;
+
+    if (one == NULL && uscf->queue_max) {
+        len += sizeof("# queue=; queued= overflows= timeouts=\n") - 1
+               + 4 * NGX_ATOMIC_T_LEN;
+    }
+
+    for (pl = peers; pl; pl = pl->next) {
+        for (peer = pl->peer; peer; peer = peer->next) {
+            if (one == NULL || peer == one) {
+                len += sizeof("server ") - 1 + peer->name.len
+                       + NGX_HTTP_UPSTREAM_CONF_LINE_LEN;
+            }
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    for (pl = peers; pl; pl = pl->next) {
+        for (peer = pl->peer; peer; peer = peer->next) {
+
+            if (one && peer != one) {
+                continue;
+            }
+
+            b->last = ngx_sprintf(b->last, "server %V", &peer->name);
+
+            if (peer->weight != 1) {
+                b->last = ngx_sprintf(b->last, " weight=%i", peer->weight);
+            }
+
+            if (peer->max_fails != 1) {
+                b->last = ngx_sprintf(b->last, " max_fails=%ui",
+                                      peer->max_fails);
+            }
+
+            if (peer->fail_timeout != 10) {
+                b->last = ngx_sprintf(b->last, " fail_timeout=%Ts",
+                                      peer->fail_timeout);
+            }
+
+            if (peer->max_conns) {
+                b->last = ngx_sprintf(b->last, " max_conns=%ui",
+                                      peer->max_conns);
+            }
+
+            if (peer->slow_start) {
+                b->last = ngx_sprintf(b->last, " slow_start=%Mms",
+                                      peer->slow_start);
+            }
+
+            if (pl != peers) {
+                b->last = ngx_cpymem(b->last, " backup", 7);
+            }
+
+            if (peer->drain) {
+                b->last = ngx_cpymem(b->last, " drain", 6);
+
+            } else if (peer->down) {
+                b->last = ngx_cpymem(b->last, " down", 5);
+            }
+
+            b->last = ngx_sprintf(b->last, "; # id=%ui conns=%ui",
+                                  peer->id, peer->conns);
+
+            if (peer->hc_down) {
+                b->last = ngx_cpymem(b->last, " unhealthy", 10);
+            }
+
+            if (peer->ejected) {
+                b->last = ngx_cpymem(b->last, " ejected", 8);
+            }
+
+            if (peer->start_time
+                && (ngx_msec_int_t) (ngx_current_msec - peer->start_time)
+                   < (ngx_msec_int_t) peer->slow_start)
+            {
+                b->last = ngx_cpymem(b->last, " starting", 9);
+            }
+
+            *b->last++ = LF;
+        }
+    }
+
+    if (one == NULL && uscf->queue_max) {
+        b->last = ngx_sprintf(b->last,
+                              "# queue=%ui; queued=%uA overflows=%uA "
+                              "timeouts=%uA\n",
+                              uscf->queue_max, peers->queued,
+                              peers->queue_overflows, peers->queue_timeouts);
+    }
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r, ngx_uint_t status,
+    char *text)
+{
+    size_t        len;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    len = ngx_strlen(text);
+
+    b = ngx_create_temp_buf(r->pool, len + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, text, len);
+    *b->last++ = LF;
+
+    cl = ngx_alloc_chain_link(r->pool);
+    if (cl == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return ngx_http_upstream_conf_output(r, status, cl);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_output(ngx_http_request_t *r, ngx_uint_t status,
+    ngx_chain_t *out)
+{
+    ngx_int_t  rc;
+
+    out->buf->last_buf = (r == r->main) ? 1 : 0;
+    out->buf->last_in_chain = 1;
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = out->buf->last - out->buf->pos;
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, out);
+}
@@ -27,7 +27,11 @@
 #define NGX_HTTP_CACHE_ETAG_LEN      128
 #define NGX_HTTP_CACHE_VARY_LEN      128
 
-#define NGX_HTTP_CACHE_VERSION       5
+#define NGX_HTTP_CACHE_VERSION       7
+#define NGX_HTTP_CACHE_INDEX_VERSION 1
+
+#define NGX_HTTP_FILE_CACHE_LRU      0
+#define NGX_HTTP_FILE_CACHE_GDSF     1
 
 
 typedef struct {
@@ -51,7 +55,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         unverified:1;
+    unsigned                         waiters:1;
+                                     /* 8 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -92,8 +98,17 @@ struct ngx_http_cache_s {
 
     ngx_buf_t                       *buf;
 
+    off_t                            range_start;
+    off_t                            range_end;
+    off_t                            partial_start;
+    off_t                            partial_end;
+    off_t                            partial_length;
+    size_t                           block;
+    size_t                           bitmap_len;
+
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
+    ngx_uint_t                       stripe;
 
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
@@ -105,6 +120,7 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
@@ -120,6 +136,14 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         memory:1;
+    unsigned                         rejected:1;
+    unsigned                         parsed:1;
+
+    unsigned                         partial:1;
+    unsigned                         partial_store:1;
+    unsigned                         partial_update:1;
 };
 
 
@@ -131,9 +155,12 @@ typedef struct {
     time_t                           last_modified;
     time_t                           date;
     uint32_t                         crc32;
+    uint32_t                         block;
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_short                          bitmap_len;
+    u_char                           parsed;
     u_char                           etag_len;
     u_char                           etag[NGX_HTTP_CACHE_ETAG_LEN];
     u_char                           vary_len;
@@ -142,15 +169,130 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+/*
+ * the pre-parsed response header stored in place of the raw upstream one:
+ * ngx_http_file_cache_headers_t, the status line, and then for each header
+ * line ngx_http_file_cache_header_line_t followed by the null-terminated
+ * key, lowcase key and value; the fields are not aligned
+ */
+
+typedef struct {
+    off_t                            content_length_n;
+    u_short                          status;
+    u_short                          status_line_len;
+    u_short                          nelts;
+} ngx_http_file_cache_headers_t;
+
+
 typedef struct {
+    ngx_uint_t                       hash;
+    u_short                          key_len;
+    u_short                          value_len;
+} ngx_http_file_cache_header_line_t;
+
+
+#define NGX_HTTP_FILE_CACHE_NULL_VALUE  (u_short) -1
+
+
+typedef struct {
+    ngx_shmtx_sh_t                   lock;
+    ngx_shmtx_t                      mutex;
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
-    ngx_atomic_t                     cold;
-    ngx_atomic_t                     loading;
     off_t                            size;
     ngx_uint_t                       count;
+} ngx_http_file_cache_shard_t;
+
+
+typedef struct {
+    ngx_uint_t                       version;
+    size_t                           bsize;
+    time_t                           time;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    off_t                            fs_size;
+    size_t                           body_start;
+} ngx_http_file_cache_index_entry_t;
+
+
+typedef struct {
+    ngx_fd_t                             fd;
+    u_char                              *temp;
+    ngx_uint_t                           shard;
+    u_char                              *key;
+    u_char                               last[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_http_file_cache_index_entry_t   *entries;
+} ngx_http_file_cache_index_ctx_t;
+
+
+/* the leading fields are shared with ngx_http_file_cache_node_t */
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_object_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_file_cache_memory_sh_t;
+
+
+typedef struct {
+    ngx_atomic_t                     additions;
+    ngx_uint_t                       mask;
+    ngx_atomic_t                     counters[1];
+} ngx_http_file_cache_sketch_t;
+
+
+typedef struct {
+    ngx_path_t                      *path;
+    off_t                            max_size;
+    uint32_t                         hash;
+    ngx_file_dev_t                   dev;
+} ngx_http_file_cache_stripe_t;
+
+
+typedef struct {
+    ngx_atomic_t                     size;
+    ngx_atomic_t                     down;
+    ngx_atomic_t                     opens;
+    ngx_atomic_t                     writes;
+    ngx_atomic_t                     errors;
+    ngx_atomic_t                     mounted;
+} ngx_http_file_cache_stripe_sh_t;
+
+
+typedef struct {
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_http_file_cache_stripe_sh_t *stripes;
+    ngx_http_file_cache_sketch_t    *sketch;
+    ngx_atomic_t                     cold;
+    ngx_atomic_t                     loading;
     ngx_uint_t                       watermark;
+
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     hit_bytes;
+    ngx_atomic_t                     miss_bytes;
+
+    ngx_atomic_t                     evictions;
+    ngx_atomic_t                     evicted;
 } ngx_http_file_cache_sh_t;
 
 
@@ -160,6 +302,11 @@ struct ngx_http_file_cache_s {
 
     ngx_path_t                      *path;
 
+    ngx_http_file_cache_stripe_t    *stripes;
+    ngx_uint_t                       nstripes;
+    ngx_uint_t                       loader_stripe;
+    size_t                           name_len;
+
     off_t                            max_size;
     size_t                           bsize;
 
@@ -167,6 +314,14 @@ struct ngx_http_file_cache_s {
 
     time_t                           fail_time;
 
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       shard;
+
+    ngx_uint_t                       eviction;
+
+    time_t                           stats_time;
+    ngx_atomic_uint_t                stats_requests;
+
     ngx_uint_t                       files;
     ngx_uint_t                       loader_files;
     ngx_msec_t                       last;
@@ -177,8 +332,25 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    ngx_uint_t                       manager_deleted;
+    off_t                            manager_freed;
+    ngx_msec_t                       manager_elapsed;
+
+    size_t                           sketch_size;
+
+    ngx_str_t                        index;
+    time_t                           index_interval;
+    time_t                           index_time;
+    ngx_http_file_cache_index_ctx_t *index_ctx;
+
     ngx_shm_zone_t                  *shm_zone;
 
+    ngx_http_file_cache_memory_sh_t *memory;
+    ngx_slab_pool_t                 *memory_pool;
+    ngx_shm_zone_t                  *memory_zone;
+    size_t                           memory_max_object;
+    ngx_uint_t                       memory_min_uses;
+
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
 };
@@ -191,14 +363,22 @@ ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_partial_test(ngx_http_request_t *r);
+ngx_int_t ngx_http_file_cache_partial_open(ngx_http_request_t *r,
+    ngx_temp_file_t *tf, u_char *header);
+void ngx_http_file_cache_partial_invalidate(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+void ngx_http_file_cache_account(ngx_http_cache_t *c, ngx_uint_t hit,
+    off_t bytes);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_file_cache_valid_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_file_cache_status_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 extern ngx_str_t  ngx_http_cache_status[];
@@ -149,6 +149,13 @@ typedef struct {
 } ngx_http_phase_t;
 
 
+typedef struct {
+    ngx_str_t                  response;
+    size_t                     header_size;
+    size_t                     date;            /* offset of the date */
+} ngx_http_error_response_t;
+
+
 typedef struct {
     ngx_array_t                servers;         /* ngx_http_core_srv_conf_t */
 
@@ -174,6 +181,8 @@ typedef struct {
 
     ngx_uint_t                 try_files;       /* unsigned  try_files:1 */
 
+    ngx_http_error_response_t *error_responses;
+
     ngx_http_phase_t           phases[NGX_HTTP_LOG_PHASE + 1];
 } ngx_http_core_main_conf_t;
 
@@ -357,7 +366,9 @@ struct ngx_http_core_loc_conf_s {
 
     size_t        client_body_buffer_size; /* client_body_buffer_size */
     size_t        send_lowat;              /* send_lowat */
+    size_t        tcp_notsent_lowat;       /* tcp_notsent_lowat */
     size_t        postpone_output;         /* postpone_output */
+    size_t        postpone_pipelined;      /* postpone_pipelined_output */
     size_t        limit_rate;              /* limit_rate */
     size_t        limit_rate_after;        /* limit_rate_after */
     size_t        sendfile_max_chunk;      /* sendfile_max_chunk */
@@ -390,6 +401,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    aio_write;               /* aio_write */
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
     ngx_flag_t    tcp_nodelay;             /* tcp_nodelay */
+    ngx_flag_t    limit_rate_pacing;       /* limit_rate_pacing */
     ngx_flag_t    reset_timedout_connection; /* reset_timedout_connection */
     ngx_flag_t    absolute_redirect;       /* absolute_redirect */
     ngx_flag_t    server_name_in_redirect; /* server_name_in_redirect */
@@ -399,6 +411,7 @@ struct ngx_http_core_loc_conf_s {
     ngx_flag_t    log_not_found;           /* log_not_found */
     ngx_flag_t    log_subrequest;          /* log_subrequest */
     ngx_flag_t    recursive_error_pages;   /* recursive_error_pages */
+    ngx_flag_t    preformatted_errors;     /* preformatted_errors */
     ngx_uint_t    server_tokens;           /* server_tokens */
     ngx_flag_t    chunked_transfer_encoding; /* chunked_transfer_encoding */
     ngx_flag_t    etag;                    /* etag */
@@ -16,6 +16,12 @@ static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static void ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_lock_notify(ngx_rbtree_key_t key);
+static void ngx_http_file_cache_lock_wakeup(ngx_rbtree_key_t key);
+#if !(NGX_WIN32)
+static void ngx_http_file_cache_lock_wakeup_handler(ngx_cycle_t *cycle,
+    ngx_uint_t data);
+#endif
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
@@ -30,10 +36,41 @@ static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_file_cache_memory_get(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_set(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_t *cache, u_char *key);
+static ngx_uint_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_uint_t ngx_http_file_cache_stripe(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_node_stripe(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_path_t *ngx_http_file_cache_path(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_stripe_size(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe, off_t size);
+static ngx_uint_t ngx_http_file_cache_stripe_down(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe);
+static void ngx_http_file_cache_stripe_error(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe, ngx_log_t *log);
+static void ngx_http_file_cache_stripe_check(ngx_http_file_cache_t *cache,
+    ngx_log_t *log, ngx_uint_t init);
+static ngx_int_t ngx_http_file_cache_stripe_over(ngx_http_file_cache_t *cache);
+static ngx_http_file_cache_shard_t *ngx_http_file_cache_shard(
+    ngx_http_file_cache_t *cache, u_char *key);
 static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+    ngx_http_file_cache_lookup(ngx_rbtree_t *rbtree, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
@@ -42,13 +79,21 @@ static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
     ngx_md5_t *md5, ngx_str_t *name);
 static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_partial_commit(ngx_http_request_t *r,
+    ngx_temp_file_t *tf);
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_int_t stripe);
+static ngx_queue_t *ngx_http_file_cache_gdsf_victim(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_shard_t *shard,
+    ngx_int_t stripe);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
-static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+static time_t ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name);
+static off_t ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -63,6 +108,19 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_stats(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_write_batch(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_index_ctx_t *ctx);
+static ngx_http_file_cache_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_int_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_index_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *entry);
+static void ngx_http_file_cache_index_reconcile(ngx_http_file_cache_t *cache);
+static off_t ngx_http_file_cache_size(ngx_http_file_cache_t *cache,
+    ngx_uint_t *count);
+static ngx_int_t ngx_http_file_cache_status_handler(ngx_http_request_t *r);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,14 +137,48 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* requests of this process waiting for a cache lock, hashed by node key */
+
+#define NGX_HTTP_FILE_CACHE_WAITERS      64
+
+static ngx_queue_t  ngx_http_file_cache_waiters[NGX_HTTP_FILE_CACHE_WAITERS];
+
+#if !(NGX_WIN32)
+static ngx_wakeup_handler_pt  ngx_http_file_cache_next_wakeup_handler;
+#endif
+
+
+#define NGX_HTTP_FILE_CACHE_SKETCH_WORD  (2 * sizeof(ngx_atomic_uint_t))
+
+#define ngx_http_file_cache_sketch_word(sketch, n)                            \
+    (&(sketch)->counters[(n) / NGX_HTTP_FILE_CACHE_SKETCH_WORD])
+
+#define ngx_http_file_cache_sketch_shift(n)                                   \
+    (((n) % NGX_HTTP_FILE_CACHE_SKETCH_WORD) << 2)
+
+#define ngx_http_file_cache_sketch_counter(sketch, n)                         \
+    ((*ngx_http_file_cache_sketch_word(sketch, n)                             \
+      >> ngx_http_file_cache_sketch_shift(n)) & 0x0f)
+
+
+#define NGX_HTTP_FILE_CACHE_MAX_USES     1023
+#define NGX_HTTP_FILE_CACHE_INDEX_BATCH  1024
+#define NGX_HTTP_FILE_CACHE_INDEX_SLICE  16
+#define NGX_HTTP_FILE_CACHE_SAMPLES      16
+#define NGX_HTTP_FILE_CACHE_STATS_TIME   60
+#define NGX_HTTP_FILE_CACHE_STRIPE_DOWN  60
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    u_char                       *file;
+    size_t                        len;
+    ngx_uint_t                    n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     cache = shm_zone->data;
 
@@ -110,18 +202,67 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        if (cache->nstripes != ocache->nstripes) {
+            goto stripes;
+        }
+
+        for (n = 1; n < cache->nstripes; n++) {
+            if (ngx_strcmp(cache->stripes[n].path->name.data,
+                           ocache->stripes[n].path->name.data)
+                != 0)
+            {
+                goto stripes;
+            }
+        }
+
         cache->sh = ocache->sh;
 
+        if (cache->sketch_size && cache->sh->sketch == NULL) {
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously no admission sketch, "
+                          "it is ignored until restart", &shm_zone->shm.name);
+
+            cache->sketch_size = 0;
+
+        } else if (cache->sketch_size
+                   && cache->sh->sketch->mask != 2 * cache->sketch_size - 1)
+        {
+            /* the existing sketch is still used, it keeps its own size */
+
+            ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different admission "
+                          "sketch size, the change is ignored until restart",
+                          &shm_zone->shm.name);
+        }
+
         cache->shpool = ocache->shpool;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
 
+        for (n = 1; n < cache->nstripes; n++) {
+            cache->stripes[n].max_size /= cache->bsize;
+        }
+
         if (!cache->sh->cold || cache->sh->loading) {
             cache->path->loader = NULL;
         }
 
         return NGX_OK;
+
+    stripes:
+
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "cache \"%V\" had previously different stripes",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
@@ -133,28 +274,88 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
+    cache->sh = ngx_slab_calloc(cache->shpool,
+                                sizeof(ngx_http_file_cache_sh_t));
     if (cache->sh == NULL) {
         return NGX_ERROR;
     }
 
     cache->shpool->data = cache->sh;
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    cache->sh->shards = ngx_slab_calloc(cache->shpool,
+                                     cache->nshards
+                                     * sizeof(ngx_http_file_cache_shard_t));
+    if (cache->sh->shards == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < cache->nshards; n++) {
+        shard = &cache->sh->shards[n];
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        file = NULL;
+
+#else
+
+        len = ngx_strlen(cache->shpool->mutex.name) + 1 + NGX_INT_T_LEN + 1;
+
+        file = ngx_slab_alloc(cache->shpool, len);
+        if (file == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_sprintf(file, "%s.%ui%Z", cache->shpool->mutex.name, n);
+
+#endif
+
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+    }
+
+    if (cache->sketch_size) {
+        cache->sh->sketch = ngx_slab_calloc(cache->shpool,
+                                     offsetof(ngx_http_file_cache_sketch_t,
+                                              counters)
+                                     + cache->sketch_size);
+        if (cache->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* two 4-bit counters per byte, packed into atomic words */
+
+        cache->sh->sketch->mask = 2 * cache->sketch_size - 1;
+    }
 
-    ngx_queue_init(&cache->sh->queue);
+    if (cache->nstripes > 1) {
+        cache->sh->stripes = ngx_slab_calloc(cache->shpool,
+                                     cache->nstripes
+                                     * sizeof(ngx_http_file_cache_stripe_sh_t));
+        if (cache->sh->stripes == NULL) {
+            return NGX_ERROR;
+        }
+    }
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
 
+    for (n = 1; n < cache->nstripes; n++) {
+        cache->stripes[n].max_size /= cache->bsize;
+    }
+
+    ngx_http_file_cache_stripe_check(cache, shm_zone->shm.log, 1);
+
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
     cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
@@ -171,6 +372,62 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_memory_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
+
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->memory = ocache->memory;
+        cache->memory_pool = ocache->memory_pool;
+
+        return NGX_OK;
+    }
+
+    cache->memory_pool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->memory = cache->memory_pool->data;
+
+        return NGX_OK;
+    }
+
+    cache->memory = ngx_slab_alloc(cache->memory_pool,
+                                   sizeof(ngx_http_file_cache_memory_sh_t));
+    if (cache->memory == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->memory_pool->data = cache->memory;
+
+    ngx_rbtree_init(&cache->memory->rbtree, &cache->memory->sentinel,
+                    ngx_http_file_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->memory->queue);
+
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->memory_pool->log_ctx = ngx_slab_alloc(cache->memory_pool, len);
+    if (cache->memory_pool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->memory_pool->log_ctx, " in cache memory zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* objects are evicted when the zone is full */
+
+    cache->memory_pool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -215,7 +472,9 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -263,6 +522,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -334,7 +594,9 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -342,6 +604,20 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    c->memory = 0;
+
+    if (cache->memory && c->exists) {
+        rc = ngx_http_file_cache_memory_get(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -368,6 +644,13 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         default:
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
                           ngx_open_file_n " \"%s\" failed", c->file.name.data);
+
+            if (cache->nstripes > 1) {
+                ngx_http_file_cache_stripe_error(cache, c->stripe,
+                                                 r->connection->log);
+                goto done;
+            }
+
             return NGX_ERROR;
         }
     }
@@ -375,13 +658,29 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache fd: %d", of.fd);
 
+    if (cache->nstripes > 1) {
+        (void) ngx_atomic_fetch_add(&cache->sh->stripes[c->stripe].opens, 1);
+    }
+
     c->file.fd = of.fd;
     c->file.log = r->connection->log;
     c->uniq = of.uniq;
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    size = c->body_start;
+
+    /* small files are read at once to be stored in the memory zone */
+
+    if (cache->memory
+        && c->length > (off_t) size
+        && c->length <= (off_t) cache->memory_max_object
+        && c->node->uses >= cache->memory_min_uses)
+    {
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -391,6 +690,11 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 done:
 
     if (rv == NGX_DECLINED) {
+
+        if (c->rejected || ngx_http_file_cache_stripe_down(cache, c->stripe)) {
+            return NGX_HTTP_CACHE_SCARCE;
+        }
+
         return ngx_http_file_cache_lock(r, c);
     }
 
@@ -401,8 +705,10 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_uint_t                    i;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -411,8 +717,9 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &c->node->node.key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -421,9 +728,12 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (c->lock_timeout) {
+        c->node->waiters = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http file cache lock u:%d wt:%M",
@@ -447,6 +757,26 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
+    if (ngx_http_file_cache_waiters[0].next == NULL) {
+        for (i = 0; i < NGX_HTTP_FILE_CACHE_WAITERS; i++) {
+            ngx_queue_init(&ngx_http_file_cache_waiters[i]);
+        }
+
+#if !(NGX_WIN32)
+        ngx_http_file_cache_next_wakeup_handler = ngx_wakeup_handler;
+        ngx_wakeup_handler = ngx_http_file_cache_lock_wakeup_handler;
+#endif
+    }
+
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiters[c->node->node.key
+                                          % NGX_HTTP_FILE_CACHE_WAITERS],
+                          &c->wait_queue);
+
+    /*
+     * the lock holder wakes the waiters up as soon as it is done,
+     * the timer is only a fallback if the notification is lost
+     */
+
     timer = c->wait_time - now;
 
     ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -480,9 +810,10 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static void
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -496,17 +827,19 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &c->node->node.key);
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
     timer = c->node->lock_time - now;
 
     if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+        c->node->waiters = 1;
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     if (wait) {
         ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -515,12 +848,79 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 wakeup:
 
+    ngx_queue_remove(&c->wait_queue);
+
     c->waiting = 0;
     r->main->blocked--;
     r->write_event_handler(r);
 }
 
 
+static void
+ngx_http_file_cache_lock_notify(ngx_rbtree_key_t key)
+{
+    ngx_http_file_cache_lock_wakeup(key);
+
+#if !(NGX_WIN32)
+    ngx_wakeup_worker_processes((ngx_cycle_t *) ngx_cycle, key);
+#endif
+}
+
+
+static void
+ngx_http_file_cache_lock_wakeup(ngx_rbtree_key_t key)
+{
+    ngx_queue_t       *q, *waiters;
+    ngx_http_cache_t  *c;
+
+    if (ngx_http_file_cache_waiters[0].next == NULL) {
+        return;
+    }
+
+    waiters = &ngx_http_file_cache_waiters[key % NGX_HTTP_FILE_CACHE_WAITERS];
+
+    for (q = ngx_queue_head(waiters);
+         q != ngx_queue_sentinel(waiters);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
+
+        /*
+         * the key is only a part of the full cache key, so a waiter
+         * of another node may be woken up too, it will wait again
+         */
+
+        if (c->node->node.key != key) {
+            continue;
+        }
+
+        if (c->wait_event.timer_set) {
+            ngx_del_timer(&c->wait_event);
+        }
+
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
+    }
+}
+
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_file_cache_lock_wakeup_handler(ngx_cycle_t *cycle, ngx_uint_t data)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                   "http file cache lock wakeup: %ui", data);
+
+    ngx_http_file_cache_lock_wakeup((ngx_rbtree_key_t) data);
+
+    if (ngx_http_file_cache_next_wakeup_handler) {
+        ngx_http_file_cache_next_wakeup_handler(cycle, data);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -531,12 +931,18 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_int_t                      rc;
     ngx_uint_t                     i;
     ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->memory) {
+        n = (ssize_t) c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -588,6 +994,17 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_DECLINED;
     }
 
+    if (h->bitmap_len
+        && (h->block == 0
+            || h->bitmap_len > h->body_start - h->header_start
+            || (size_t) n < h->body_start))
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect block bitmap",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
     if (h->vary_len) {
         ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
 
@@ -600,6 +1017,17 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     c->buf->last += n;
 
+    cache = c->file_cache;
+
+    if (cache->memory
+        && !c->memory
+        && n == c->length
+        && (size_t) n <= cache->memory_max_object
+        && c->node->uses >= cache->memory_min_uses)
+    {
+        ngx_http_file_cache_memory_set(cache, c);
+    }
+
     c->valid_sec = h->valid_sec;
     c->updating_sec = h->updating_sec;
     c->error_sec = h->error_sec;
@@ -607,16 +1035,25 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     c->date = h->date;
     c->valid_msec = h->valid_msec;
     c->body_start = h->body_start;
+    c->block = h->block;
+    c->bitmap_len = h->bitmap_len;
+    c->parsed = h->parsed;
     c->etag.len = h->etag_len;
     c->etag.data = h->etag;
 
     r->cached = 1;
 
-    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &c->node->node.key);
+
+    if (c->node->unverified) {
+        ngx_shmtx_lock(&shard->mutex);
+        c->node->unverified = 0;
+        ngx_shmtx_unlock(&shard->mutex);
+    }
 
     if (cache->sh->cold) {
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (!c->node->exists) {
             c->node->uses = 1;
@@ -625,10 +1062,11 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             c->node->uniq = c->uniq;
             c->node->fs_size = c->fs_size;
 
-            cache->sh->size += c->fs_size;
+            shard->size += c->fs_size;
+            ngx_http_file_cache_stripe_size(cache, c->stripe, c->fs_size);
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
     }
 
     now = ngx_time();
@@ -637,7 +1075,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->stale_updating = c->valid_sec + c->updating_sec >= now;
         c->stale_error = c->valid_sec + c->error_sec >= now;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
         if (c->node->updating) {
             rc = NGX_HTTP_CACHE_UPDATING;
@@ -649,7 +1087,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
             rc = NGX_HTTP_CACHE_STALE;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
         ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache expired: %i %T %T",
@@ -675,7 +1113,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos,
+                              c->buf->end - c->buf->pos, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -702,7 +1141,8 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos,
+                            c->buf->end - c->buf->pos, 0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -712,7 +1152,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, c->buf->end - c->buf->pos, 0);
 }
 
 
@@ -818,22 +1258,46 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_int_t                     rc;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
     fcn = c->node;
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+    /*
+     * each request is counted once, on its first lookup, whether the key
+     * is cached or not, so that the frequencies of cached entries chosen
+     * as admission victims include their hits
+     */
+
+    if (fcn == NULL && cache->sketch_size) {
+        ngx_http_file_cache_sketch_add(cache, c->key);
+    }
+
+    c->rejected = 0;
+
+    if (fcn) {
+        shard = ngx_http_file_cache_shard(cache, (u_char *) &fcn->node.key);
+        ngx_shmtx_lock(&shard->mutex);
+
+    } else {
+        shard = ngx_http_file_cache_shard(cache, c->key);
+        ngx_shmtx_lock(&shard->mutex);
+
+        fcn = ngx_http_file_cache_lookup(&shard->rbtree, c->key);
     }
 
     if (fcn) {
         ngx_queue_remove(&fcn->queue);
 
         if (c->node == NULL) {
-            fcn->uses++;
+
+            /* the counter saturates, the "gdsf" eviction relies on it */
+
+            if (fcn->uses < NGX_HTTP_FILE_CACHE_MAX_USES) {
+                fcn->uses++;
+            }
+
             fcn->count++;
         }
 
@@ -865,19 +1329,23 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         goto done;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
+    /*
+     * the shard mutex is held while the node is allocated, the slab pool
+     * mutex is always acquired after a shard mutex and never before it
+     */
+
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(cache, shard, -1);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_lock(&shard->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
         if (fcn == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", cache->shpool->log_ctx);
@@ -886,14 +1354,14 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
         }
     }
 
-    cache->sh->count++;
+    shard->count++;
 
     ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
     ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
                NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
     fcn->uses = 1;
     fcn->count = 1;
@@ -914,7 +1382,16 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    if (cache->sketch_size
+        && !fcn->exists
+        && !fcn->error
+        && rc != NGX_AGAIN
+        && !ngx_http_file_cache_admit(cache, shard, c->key))
+    {
+        c->rejected = 1;
+    }
+
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -922,1322 +1399,3211 @@ done:
 
 failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->mutex);
 
     return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+ngx_http_file_cache_memory_get(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_object_t  *obj;
 
-    c = r->cache;
+    cache = c->file_cache;
 
-    if (c->file.name.len) {
-        return NGX_OK;
-    }
+    ngx_shmtx_lock(&cache->memory_pool->mutex);
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    obj = (ngx_http_file_cache_object_t *)
+              ngx_http_file_cache_lookup(&cache->memory->rbtree, c->key);
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
+    /* nodes added by the cache loader do not know file uniq yet */
+
+    if (obj == NULL || (c->uniq && c->uniq != obj->uniq)) {
+        ngx_shmtx_unlock(&cache->memory_pool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, ngx_max(obj->len, c->body_start));
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->memory_pool->mutex);
         return NGX_ERROR;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+    ngx_memcpy(c->buf->pos, obj->data, obj->len);
 
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    c->uniq = obj->uniq;
+    c->length = obj->len;
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+    ngx_queue_remove(&obj->queue);
+    ngx_queue_insert_head(&cache->memory->queue, &obj->queue);
+
+    ngx_shmtx_unlock(&cache->memory_pool->mutex);
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+                   "http file cache memory hit: %O", c->length);
+
+    c->memory = 1;
 
     return NGX_OK;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static void
+ngx_http_file_cache_memory_set(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    size_t                         size;
+    ngx_queue_t                   *q;
+    ngx_http_file_cache_object_t  *obj;
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    size = offsetof(ngx_http_file_cache_object_t, data) + (size_t) c->length;
 
-    while (node != sentinel) {
+    ngx_shmtx_lock(&cache->memory_pool->mutex);
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    obj = (ngx_http_file_cache_object_t *)
+              ngx_http_file_cache_lookup(&cache->memory->rbtree, c->key);
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
+    if (obj) {
+        if (obj->uniq == c->uniq && obj->len == (size_t) c->length) {
+            ngx_shmtx_unlock(&cache->memory_pool->mutex);
+            return;
         }
 
-        /* node_key == node->key */
+        ngx_queue_remove(&obj->queue);
+        ngx_rbtree_delete(&cache->memory->rbtree, &obj->node);
+        ngx_slab_free_locked(cache->memory_pool, obj);
+    }
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    for ( ;; ) {
+        obj = ngx_slab_alloc_locked(cache->memory_pool, size);
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (obj) {
+            break;
+        }
 
-        if (rc == 0) {
-            return fcn;
+        if (ngx_queue_empty(&cache->memory->queue)) {
+            ngx_shmtx_unlock(&cache->memory_pool->mutex);
+            return;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        q = ngx_queue_last(&cache->memory->queue);
+        obj = ngx_queue_data(q, ngx_http_file_cache_object_t, queue);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache memory evict: %uz", obj->len);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->memory->rbtree, &obj->node);
+        ngx_slab_free_locked(cache->memory_pool, obj);
     }
 
-    /* not found */
+    ngx_memcpy((u_char *) &obj->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    return NULL;
+    ngx_memcpy(obj->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    obj->uniq = c->uniq;
+    obj->len = (size_t) c->length;
+
+    ngx_memcpy(obj->data, c->buf->pos, obj->len);
+
+    ngx_rbtree_insert(&cache->memory->rbtree, &obj->node);
+    ngx_queue_insert_head(&cache->memory->queue, &obj->queue);
+
+    ngx_shmtx_unlock(&cache->memory_pool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache memory store: %uz", obj->len);
 }
 
 
 static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_http_file_cache_memory_delete(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    ngx_http_file_cache_object_t  *obj;
 
-    for ( ;; ) {
+    if (cache->memory == NULL) {
+        return;
+    }
 
-        if (node->key < temp->key) {
+    ngx_shmtx_lock(&cache->memory_pool->mutex);
 
-            p = &temp->left;
+    obj = (ngx_http_file_cache_object_t *)
+              ngx_http_file_cache_lookup(&cache->memory->rbtree, key);
 
-        } else if (node->key > temp->key) {
+    if (obj) {
+        ngx_queue_remove(&obj->queue);
+        ngx_rbtree_delete(&cache->memory->rbtree, &obj->node);
+        ngx_slab_free_locked(cache->memory_pool, obj);
+    }
 
-            p = &temp->right;
+    ngx_shmtx_unlock(&cache->memory_pool->mutex);
+}
 
-        } else { /* node->key == temp->key */
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    c = r->cache;
 
-        if (*p == sentinel) {
-            break;
-        }
+    if (c->file.name.len) {
+        return NGX_OK;
+    }
 
-        temp = *p;
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_t *cache, u_char *key)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    uint32_t                       hash[4];
+    ngx_uint_t                     i, n, min, shift;
+    ngx_atomic_t                  *word;
+    ngx_atomic_uint_t              old;
+    ngx_http_file_cache_sketch_t  *sketch;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    sketch = cache->sh->sketch;
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    /*
+     * a count-min sketch with 4-bit saturating counters packed into
+     * atomic words; the key is an MD5 hash already, its four words are
+     * used as independent hashes; a counter is updated by a compare and
+     * swap of its word, so a concurrent update of a neighbouring counter
+     * may only make it retry, and a counter never overflows into another
+     */
 
-    ngx_strlow(buf, vary, len);
+    ngx_memcpy(hash, key, NGX_HTTP_CACHE_KEY_LEN);
 
-    p = buf;
-    last = buf + len;
+    min = 15;
 
-    while (p < last) {
+    for (i = 0; i < 4; i++) {
+        hash[i] &= sketch->mask;
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+        n = ngx_http_file_cache_sketch_counter(sketch, hash[i]);
 
-        name.data = p;
+        if (n < min) {
+            min = n;
+        }
+    }
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+    if (min < 15) {
 
-        name.len = p - name.data;
+        /* conservative update: only the smallest counters are incremented */
 
-        if (name.len == 0) {
-            break;
+        for (i = 0; i < 4; i++) {
+            word = ngx_http_file_cache_sketch_word(sketch, hash[i]);
+            shift = ngx_http_file_cache_sketch_shift(hash[i]);
+
+            for ( ;; ) {
+                old = *word;
+                n = (old >> shift) & 0x0f;
+
+                if (n != min || n == 15) {
+                    break;
+                }
+
+                if (ngx_atomic_cmp_set(word, old,
+                                       old + ((ngx_atomic_uint_t) 1 << shift)))
+                {
+                    break;
+                }
+            }
         }
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+    /* the sketch ages by halving all counters once per sketch->mask adds */
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+    if (ngx_atomic_fetch_add(&sketch->additions, 1) == sketch->mask) {
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache sketch reset");
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
-    }
+        for (i = 0; i <= sketch->mask / NGX_HTTP_FILE_CACHE_SKETCH_WORD; i++) {
+            word = &sketch->counters[i];
 
-    ngx_md5_final(hash, &md5);
+            do {
+                old = *word;
+            } while (!ngx_atomic_cmp_set(word, old,
+                                         (old >> 1)
+                                         & ((ngx_atomic_uint_t) -1 / 15 * 7)));
+        }
+
+        sketch->additions = 0;
+    }
 }
 
 
-static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_t *cache, u_char *key)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    uint32_t                       hash[4];
+    ngx_uint_t                     i, n, min;
+    ngx_http_file_cache_sketch_t  *sketch;
 
-    multiple = 0;
-    normalize = 0;
+    sketch = cache->sh->sketch;
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+    ngx_memcpy(hash, key, NGX_HTTP_CACHE_KEY_LEN);
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    min = 15;
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
+    for (i = 0; i < 4; i++) {
+        n = ngx_http_file_cache_sketch_counter(sketch, hash[i] & sketch->mask);
+
+        if (n < min) {
+            min = n;
+        }
     }
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    return min;
+}
 
-    for (i = 0; /* void */ ; i++) {
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+static ngx_uint_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    off_t                        size;
+    ngx_uint_t                   i, count, tries, candidate, victim;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       victim_key[NGX_HTTP_CACHE_KEY_LEN];
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
-        }
+    /*
+     * the shard mutex is held; the counters of other shards are read
+     * without their mutexes, an approximate value is enough
+     */
 
-        if (header[i].hash == 0) {
-            continue;
-        }
+    size = 0;
+    count = 0;
 
-        if (header[i].key.len != name->len) {
-            continue;
-        }
+    for (i = 0; i < cache->nshards; i++) {
+        size += cache->sh->shards[i].size;
+        count += cache->sh->shards[i].count;
+    }
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
-        }
+    /* everything is admitted while there is room in the cache */
 
-        if (!normalize) {
+    if (size < cache->max_size && count < cache->sh->watermark) {
+        return 1;
+    }
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    /* a victim is an existing entry the manager would force out next */
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+    tries = 20;
 
-            multiple = 1;
+    for (q = ngx_queue_last(&shard->queue);
+         q != ngx_queue_sentinel(&shard->queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-            continue;
+        if (fcn->exists && fcn->count == 0) {
+            break;
         }
 
-        /* normalize spaces */
+        if (--tries == 0) {
+            return 1;
+        }
+    }
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+    if (q == ngx_queue_sentinel(&shard->queue)) {
+        return 1;
+    }
 
-        while (p < last) {
+    ngx_memcpy(victim_key, (u_char *) &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&victim_key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    candidate = ngx_http_file_cache_sketch_estimate(cache, key);
+    victim = ngx_http_file_cache_sketch_estimate(cache, victim_key);
 
-            start = p;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache admission: %ui, victim: %ui",
+                   candidate, victim);
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+    return candidate > victim;
+}
 
-            len = p - start;
 
-            if (len == 0) {
-                break;
-            }
+/*
+ * a key is stored on the stripe which scores it highest, so adding
+ * or removing a stripe only moves the keys which go to or came from it
+ */
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+static ngx_uint_t
+ngx_http_file_cache_stripe(ngx_http_file_cache_t *cache, u_char *key)
+{
+    u_char      buf[NGX_HTTP_CACHE_KEY_LEN + sizeof(uint32_t)];
+    uint32_t    hash, max;
+    ngx_uint_t  i, stripe;
 
-            ngx_md5_update(md5, start, len);
+    if (cache->nstripes == 1) {
+        return 0;
+    }
 
-            multiple = 1;
+    ngx_memcpy(buf, key, NGX_HTTP_CACHE_KEY_LEN);
+
+    max = 0;
+    stripe = 0;
+
+    for (i = 0; i < cache->nstripes; i++) {
+        ngx_memcpy(buf + NGX_HTTP_CACHE_KEY_LEN, &cache->stripes[i].hash,
+                   sizeof(uint32_t));
+
+        hash = ngx_murmur_hash2(buf, sizeof(buf));
+
+        if (i == 0 || hash > max) {
+            max = hash;
+            stripe = i;
         }
     }
+
+    return stripe;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+static ngx_uint_t
+ngx_http_file_cache_node_stripe(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
 {
-    ngx_http_file_cache_t  *cache;
+    u_char  key[NGX_HTTP_CACHE_KEY_LEN];
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
-
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (cache->nstripes == 1) {
+        return 0;
     }
 
-    cache = c->file_cache;
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(key + sizeof(ngx_rbtree_key_t), fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    return ngx_http_file_cache_stripe(cache, key);
+}
 
-    c->node->count--;
-    c->node = NULL;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+static ngx_path_t *
+ngx_http_file_cache_path(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    c->stripe = ngx_http_file_cache_stripe(cache, c->key);
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buf->end - c->buf->start;
+    return cache->stripes[c->stripe].path;
+}
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
 
-    return ngx_http_file_cache_open(r);
+static void
+ngx_http_file_cache_stripe_size(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe, off_t size)
+{
+    if (cache->nstripes > 1 && size) {
+        (void) ngx_atomic_fetch_add(&cache->sh->stripes[stripe].size,
+                                    (ngx_atomic_int_t) size);
+    }
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static ngx_uint_t
+ngx_http_file_cache_stripe_down(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
-
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    if (cache->nstripes == 1) {
+        return 0;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+    return (time_t) cache->sh->stripes[stripe].down > ngx_time();
+}
 
-    c = r->cache;
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+/*
+ * a stripe which failed to store or to open a file, e.g. because its disk
+ * went read-only or away, is not used to store new entries for a while
+ */
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->updating_sec = c->updating_sec;
-    h->error_sec = c->error_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+static void
+ngx_http_file_cache_stripe_error(ngx_http_file_cache_t *cache,
+    ngx_uint_t stripe, ngx_log_t *log)
+{
+    time_t                            now;
+    ngx_atomic_uint_t                 down;
+    ngx_http_file_cache_stripe_sh_t  *sh;
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    if (cache->nstripes == 1) {
+        return;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+    sh = &cache->sh->stripes[stripe];
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+    (void) ngx_atomic_fetch_add(&sh->errors, 1);
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
+    now = ngx_time();
+    down = sh->down;
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
+    if ((time_t) down > now
+        || !ngx_atomic_cmp_set(&sh->down, down,
+                               now + NGX_HTTP_FILE_CACHE_STRIPE_DOWN))
+    {
+        return;
     }
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
-
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "cache \"%V\" stops storing to \"%V\" for %d seconds",
+                  &cache->shm_zone->shm.name,
+                  &cache->stripes[stripe].path->name,
+                  NGX_HTTP_FILE_CACHE_STRIPE_DOWN);
+}
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
-    }
 
-    *p = LF;
+/*
+ * a stripe directory which is a mount point and later is on the same
+ * device as its parent directory is on a disk which is not mounted anymore,
+ * it is not used to store to the parent file system then
+ */
 
-    return NGX_OK;
-}
+static void
+ngx_http_file_cache_stripe_check(ngx_http_file_cache_t *cache, ngx_log_t *log,
+    ngx_uint_t init)
+{
+    u_char                            parent[NGX_MAX_PATH];
+    time_t                            now;
+    ngx_str_t                        *name;
+    ngx_uint_t                        i, n;
+    ngx_file_info_t                   fi, pfi;
+    ngx_atomic_uint_t                 down;
+    ngx_http_file_cache_stripe_sh_t  *sh;
+
+    if (cache->nstripes == 1) {
+        return;
+    }
 
+    for (n = 0; n < cache->nstripes; n++) {
 
-static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_t  *cache;
+        name = &cache->stripes[n].path->name;
+        sh = &cache->sh->stripes[n];
 
-    if (!c->secondary) {
-        return NGX_OK;
-    }
+        if (name->len + sizeof("/..") > NGX_MAX_PATH) {
+            continue;
+        }
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
-        return NGX_OK;
-    }
+        (void) ngx_cpystrn(ngx_cpymem(parent, name->data, name->len),
+                           (u_char *) "/..", sizeof("/.."));
 
-    /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
-     */
+        if (ngx_file_info(name->data, &fi) == NGX_FILE_ERROR
+            || ngx_file_info(parent, &pfi) == NGX_FILE_ERROR)
+        {
+            cache->stripes[n].dev = (ngx_file_dev_t) -1;
+            continue;
+        }
 
-    cache = c->file_cache;
+        cache->stripes[n].dev = ngx_file_dev(&fi);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+        if (ngx_file_dev(&fi) != ngx_file_dev(&pfi)) {
+            sh->mounted = 1;
+            continue;
+        }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (!sh->mounted) {
 
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
+            if (!init) {
+                continue;
+            }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+            for (i = 0; i < n; i++) {
+                if (cache->stripes[i].dev == cache->stripes[n].dev) {
+                    ngx_log_error(NGX_LOG_WARN, log, 0,
+                                  "cache stripe \"%V\" is on the same device "
+                                  "as \"%V\"",
+                                  name, &cache->stripes[i].path->name);
+                    break;
+                }
+            }
 
-    c->file.name.len = 0;
+            continue;
+        }
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+        now = ngx_time();
+        down = sh->down;
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+        if ((time_t) down > now
+            || !ngx_atomic_cmp_set(&sh->down, down,
+                                   now + NGX_HTTP_FILE_CACHE_STRIPE_DOWN))
+        {
+            continue;
+        }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "cache stripe \"%V\" is not mounted anymore, "
+                      "not storing to it", name);
     }
-
-    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_stripe_over(ngx_http_file_cache_t *cache)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t  i;
 
-    c = r->cache;
+    if (cache->nstripes == 1) {
+        return -1;
+    }
 
-    if (c->updated) {
-        return;
+    for (i = 0; i < cache->nstripes; i++) {
+        if (cache->stripes[i].max_size
+            && (off_t) cache->sh->stripes[i].size >= cache->stripes[i].max_size)
+        {
+            return i;
+        }
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    return -1;
+}
 
-    cache = c->file_cache;
 
-    c->updated = 1;
-    c->updating = 0;
+static ngx_http_file_cache_shard_t *
+ngx_http_file_cache_shard(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_rbtree_key_t  node_key;
 
-    uniq = 0;
-    fs_size = 0;
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+    return &cache->sh->shards[node_key % cache->nshards];
+}
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_rbtree_t *rbtree, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
 
-    if (rc == NGX_OK) {
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
 
-            rc = NGX_ERROR;
+    while (node != sentinel) {
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
         }
-    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        /* node_key == node->key */
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
     }
 
-    c->node->updating = 0;
+    /* not found */
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NULL;
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    for ( ;; ) {
 
-    c = r->cache;
+        if (node->key < temp->key) {
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+            p = &temp->left;
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+        } else if (node->key > temp->key) {
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+            p = &temp->right;
 
-        /* cache file may have been deleted */
+        } else { /* node->key == temp->key */
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
-        goto done;
-    }
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
+                       "http file cache vary: %V", &name);
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    c->secondary = 1;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+    h->parsed = (u_char) c->parsed;
+
+    if (c->partial_store) {
+        h->block = (uint32_t) c->block;
+        h->bitmap_len = (u_short) c->bitmap_len;
+    }
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_uint_t                    notify;
+    ngx_rbtree_key_t              key;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    key = c->node->node.key;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    c->node->count--;
+    c->node->updating = 0;
+
+    notify = c->node->waiters;
+    c->node->waiters = 0;
+
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (notify) {
+        ngx_http_file_cache_lock_notify(key);
+    }
+
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, ngx_http_file_cache_path(cache, c))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                         fs_size;
+    ngx_int_t                     rc;
+    ngx_uint_t                    notify;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_rbtree_key_t              key;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+
+    rc = NGX_OK;
+
+    if (c->partial_store) {
+        rc = ngx_http_file_cache_partial_commit(r, tf);
+    }
+
+    if (c->partial_update) {
+
+        /* the blocks were written into the cache file itself */
+
+        rc = NGX_OK;
+
+    } else if (rc == NGX_OK) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache rename: \"%s\" to \"%s\"",
+                       tf->file.name.data, c->file.name.data);
+
+        ext.access = NGX_FILE_OWNER_ACCESS;
+        ext.path_access = NGX_FILE_OWNER_ACCESS;
+        ext.time = -1;
+        ext.create_path = 1;
+        ext.delete_file = 1;
+        ext.log = r->connection->log;
+
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    } else if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tf->file.name.data);
+    }
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+
+            /* a partial entry is a sparse file, only its blocks count */
+
+            fs_size = c->partial_store ? ngx_file_fs_used(&fi)
+                                       : ngx_file_fs_size(&fi);
+            fs_size = (fs_size + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    if (cache->nstripes > 1) {
+        if (rc == NGX_OK) {
+            (void) ngx_atomic_fetch_add(&cache->sh->stripes[c->stripe].writes,
+                                        1);
+
+        } else {
+            ngx_http_file_cache_stripe_error(cache, c->stripe,
+                                             r->connection->log);
+        }
+    }
+
+    ngx_http_file_cache_memory_delete(cache, c->key);
+
+    key = c->node->node.key;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->unverified = 0;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    shard->size += fs_size - c->node->fs_size;
+    ngx_http_file_cache_stripe_size(cache, c->stripe,
+                                    fs_size - c->node->fs_size);
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+    }
+
+    if (c->partial_update) {
+
+        /* unless the lock expired and was taken over */
+
+        if (c->node->lock_time == c->lock_time) {
+            c->node->updating = 0;
+        }
+
+        notify = 0;
+
+    } else {
+        c->node->updating = 0;
+
+        notify = c->node->waiters;
+        c->node->waiters = 0;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (notify) {
+        ngx_http_file_cache_lock_notify(key);
+    }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = NGX_HTTP_CACHE_VERSION;
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+    h.block = (uint32_t) c->block;
+    h.bitmap_len = (u_short) c->bitmap_len;
+    h.parsed = (u_char) c->parsed;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), 0);
+
+    ngx_http_file_cache_memory_delete(c->file_cache, c->key);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+/*
+ * a partial entry keeps a bitmap of the blocks present right before
+ * the body, and the body itself is a sparse file of the complete length
+ */
+
+ngx_int_t
+ngx_http_file_cache_partial_test(ngx_http_request_t *r)
+{
+    off_t                         start, end, length;
+    u_char                       *bitmap;
+    ngx_uint_t                    n, last;
+    ngx_msec_t                    now, timer;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    length = c->length - (off_t) c->body_start;
+
+    if (c->partial) {
+        start = c->range_start;
+        end = c->range_end;
+
+        if (start >= length) {
+
+            /* the range filter rejects the range */
+
+            return NGX_OK;
+        }
+
+        if (end == -1 || end >= length) {
+            end = length - 1;
+        }
+
+    } else {
+        start = 0;
+        end = length - 1;
+    }
+
+    if (end < start) {
+        return NGX_OK;
+    }
+
+    bitmap = c->buf->pos + c->body_start - c->bitmap_len;
+
+    last = (ngx_uint_t) (end / c->block);
+
+    for (n = (ngx_uint_t) (start / c->block); n <= last; n++) {
+        if (n / 8 >= c->bitmap_len || !(bitmap[n / 8] & (1 << (n % 8)))) {
+            break;
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial: %O-%O, missing block %ui",
+                   start, end, n);
+
+    if (n > last) {
+        return NGX_OK;
+    }
+
+    if (!c->partial) {
+
+        /* the whole response is requested, the entry is replaced */
+
+        return NGX_HTTP_CACHE_STALE;
+    }
+
+    c->partial_start = (off_t) (n * c->block);
+
+    if (c->range_end == -1) {
+        c->partial_end = -1;
+
+    } else {
+        c->partial_end = ngx_min((off_t) ((last + 1) * c->block), length) - 1;
+    }
+    c->partial_length = length;
+
+    /*
+     * the blocks are written into the cache file itself, so only
+     * one request at a time fills an entry, the others are not cached
+     */
+
+    now = ngx_current_msec;
+
+    shard = ngx_http_file_cache_shard(c->file_cache,
+                                      (u_char *) &c->node->node.key);
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    timer = c->node->lock_time - now;
+
+    if (!c->node->updating || (ngx_msec_int_t) timer <= 0) {
+        c->node->updating = 1;
+        c->node->lock_time = now + c->lock_age;
+        c->updating = 1;
+        c->lock_time = c->node->lock_time;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (!c->updating) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache partial: updating");
+
+        return NGX_HTTP_CACHE_SCARCE;
+    }
+
+    c->partial_store = 1;
+    c->partial_update = 1;
+
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_http_file_cache_partial_invalidate(ngx_http_request_t *r)
+{
+    time_t             valid_sec;
+    ngx_file_t         file;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial invalidate");
+
+    /* the entry expires, so the next request replaces it as a whole */
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    valid_sec = 0;
+
+    (void) ngx_write_file(&file, (u_char *) &valid_sec, sizeof(time_t),
+                          offsetof(ngx_http_file_cache_header_t, valid_sec));
+
+    ngx_http_file_cache_memory_delete(c->file_cache, c->key);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_file_cache_partial_open(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    u_char *header)
+{
+    ngx_http_cache_t          *c;
+    ngx_pool_cleanup_t        *cln;
+    ngx_pool_cleanup_file_t   *clnf;
+
+    c = r->cache;
+
+    if (c->partial_update) {
+
+        cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        tf->file.fd = ngx_open_file(c->file.name.data, NGX_FILE_RDWR,
+                                    NGX_FILE_OPEN, 0);
+
+        if (tf->file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          c->file.name.data);
+            return NGX_ERROR;
+        }
+
+        tf->file.name = c->file.name;
+
+        cln->handler = ngx_pool_cleanup_file;
+        clnf = cln->data;
+
+        clnf->fd = tf->file.fd;
+        clnf->name = tf->file.name.data;
+        clnf->log = r->pool->log;
+
+    } else {
+
+        if (ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                 tf->persistent, tf->clean, tf->access)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (ngx_write_file(&tf->file, header, c->body_start, 0) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_truncate_file(tf->file.fd,
+                              (off_t) c->body_start + c->partial_length)
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_truncate_file_n " \"%s\" failed",
+                          tf->file.name.data);
+            return NGX_ERROR;
+        }
+    }
+
+    tf->offset = (off_t) c->body_start + c->partial_start;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial open: \"%s\" %O-%O",
+                   tf->file.name.data, c->partial_start, c->partial_end);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_partial_commit(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t              end, offset;
+    u_char            *bitmap;
+    size_t             len;
+    ssize_t            n;
+    ngx_uint_t         i, first, last;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (tf->file.fd == NGX_INVALID_FILE) {
+        return NGX_DECLINED;
+    }
+
+    /* only the blocks received completely are marked as present */
+
+    end = tf->offset - (off_t) c->body_start;
+
+    first = (ngx_uint_t) (c->partial_start / c->block);
+
+    if (end >= c->partial_length) {
+        last = (ngx_uint_t) ((c->partial_length + c->block - 1) / c->block);
+
+    } else {
+        last = (ngx_uint_t) (end / c->block);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache partial commit: %ui-%ui", first, last);
+
+    if (last <= first) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * only the bitmap bytes covering the blocks are rewritten, the entry
+     * is filled by one request at a time, and a bit is set only after
+     * its block was written
+     */
+
+    len = (last - 1) / 8 - first / 8 + 1;
+    offset = c->body_start - c->bitmap_len + first / 8;
+
+    bitmap = ngx_pnalloc(r->pool, len);
+    if (bitmap == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_file(&tf->file, bitmap, len, offset);
+
+    if (n != (ssize_t) len) {
+        return NGX_ERROR;
+    }
+
+    for (i = first; i < last; i++) {
+        bitmap[i / 8 - first / 8] |= (u_char) (1 << (i % 8));
+    }
+
+    n = ngx_write_file(&tf->file, bitmap, len, offset);
+
+    if (n != (ssize_t) len) {
+        return NGX_ERROR;
+    }
+
+    if (!c->partial_update || c->valid_sec == 0) {
+        return NGX_OK;
+    }
+
+    /* the blocks were revalidated, so is the entry */
+
+    n = ngx_write_file(&tf->file, (u_char *) &c->valid_sec, sizeof(time_t),
+                       offsetof(ngx_http_file_cache_header_t, valid_sec));
+
+    if (n != (ssize_t) sizeof(time_t)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    ngx_http_file_cache_account(c, 1, c->length - c->body_start);
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the whole file is already in memory if it was small enough */
+
+    if (c->buf->last - c->buf->pos == c->length) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+        b->memory = (c->length - c->body_start) ? 1: 0;
+
+    } else {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+        b->in_file = (c->length - c->body_start) ? 1: 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_account(ngx_http_cache_t *c, ngx_uint_t hit, off_t bytes)
+{
+    ngx_http_file_cache_sh_t  *sh;
+
+    sh = c->file_cache->sh;
+
+    if (bytes < 0) {
+        bytes = 0;
+    }
+
+    if (hit) {
+        (void) ngx_atomic_fetch_add(&sh->hits, 1);
+        (void) ngx_atomic_fetch_add(&sh->hit_bytes, (ngx_atomic_int_t) bytes);
+
+    } else {
+        (void) ngx_atomic_fetch_add(&sh->misses, 1);
+        (void) ngx_atomic_fetch_add(&sh->miss_bytes, (ngx_atomic_int_t) bytes);
+    }
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                    notify;
+    ngx_rbtree_key_t              key;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (c->waiting) {
+        ngx_queue_remove(&c->wait_queue);
+        c->waiting = 0;
+
+        if (c->wait_event.posted) {
+            ngx_delete_posted_event(&c->wait_event);
+        }
+    }
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    fcn = c->node;
+    key = fcn->node.key;
+    shard = ngx_http_file_cache_shard(cache, (u_char *) &key);
+
+    notify = 0;
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    fcn->count--;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+
+        notify = fcn->waiters;
+        fcn->waiters = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    if (notify) {
+        ngx_http_file_cache_lock_notify(key);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    /* the blocks of a partial update are written into the cache file */
+
+    if (c->temp_file && !c->partial_update) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_int_t stripe)
+{
+    u_char                      *name;
+    off_t                        freed;
+    time_t                       wait;
+    ngx_uint_t                   tries, scan;
+    ngx_queue_t                 *q, *victim;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire: %i", stripe);
+
+    name = ngx_alloc(cache->name_len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    wait = 10;
+    tries = 20;
+    scan = 20 * cache->nstripes;
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    if (cache->eviction == NGX_HTTP_FILE_CACHE_GDSF) {
+        victim = ngx_http_file_cache_gdsf_victim(cache, shard, stripe);
+
+        if (victim) {
+            freed = ngx_http_file_cache_delete(cache, shard, victim, name);
+
+            (void) ngx_atomic_fetch_add(&cache->sh->evictions, 1);
+            (void) ngx_atomic_fetch_add(&cache->sh->evicted,
+                                        (ngx_atomic_int_t) freed);
+            wait = 0;
+
+        } else if (!ngx_queue_empty(&shard->queue)) {
+            wait = 1;
+        }
+
+        ngx_shmtx_unlock(&shard->mutex);
+
+        ngx_free(name);
+
+        return wait;
+    }
+
+    for (q = ngx_queue_last(&shard->queue);
+         q != ngx_queue_sentinel(&shard->queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        /* only the entries of a stripe over its max_size */
+
+        if (stripe != -1
+            && ngx_http_file_cache_node_stripe(cache, fcn)
+               != (ngx_uint_t) stripe)
+        {
+            if (--scan) {
+                continue;
+            }
+
+            wait = 1;
+            break;
+        }
+
+        if (fcn->count == 0) {
+            freed = ngx_http_file_cache_delete(cache, shard, q, name);
+
+            (void) ngx_atomic_fetch_add(&cache->sh->evictions, 1);
+            (void) ngx_atomic_fetch_add(&cache->sh->evicted,
+                                        (ngx_atomic_int_t) freed);
+            wait = 0;
+
+        } else {
+            if (--tries) {
+                continue;
+            }
+
+            wait = 1;
+        }
+
+        break;
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+/*
+ * The sampled Greedy-Dual-Size-Frequency victim: among the least recently
+ * used entries which are not in use the one with the smallest number of
+ * uses per block is chosen, so large objects requested once go first.
+ * The LRU window itself ages the frequencies out.
+ */
+
+static ngx_queue_t *
+ngx_http_file_cache_gdsf_victim(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_int_t stripe)
+{
+    off_t                        size, vsize;
+    ngx_uint_t                   tries, samples, scan;
+    ngx_queue_t                 *q, *victim;
+    ngx_http_file_cache_node_t  *fcn, *vcn;
+
+    victim = NULL;
+    vcn = NULL;
+    vsize = 0;
+
+    tries = 20;
+    samples = NGX_HTTP_FILE_CACHE_SAMPLES;
+    scan = 20 * cache->nstripes;
+
+    for (q = ngx_queue_last(&shard->queue);
+         q != ngx_queue_sentinel(&shard->queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (stripe != -1
+            && ngx_http_file_cache_node_stripe(cache, fcn)
+               != (ngx_uint_t) stripe)
+        {
+            if (--scan) {
+                continue;
+            }
+
+            break;
+        }
+
+        if (fcn->count) {
+            if (--tries) {
+                continue;
+            }
+
+            break;
+        }
+
+        size = fcn->exists ? ngx_max(fcn->fs_size, 1) : 1;
+
+        ngx_log_debug7(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache gdsf: %ui/%O %d "
+                       "%02xd%02xd%02xd%02xd",
+                       (ngx_uint_t) fcn->uses, size, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        /* uses / size < vuses / vsize */
+
+        if (victim == NULL
+            || (off_t) fcn->uses * vsize < (off_t) vcn->uses * size)
+        {
+            victim = q;
+            vcn = fcn;
+            vsize = size;
+        }
+
+        if (--samples == 0) {
+            break;
+        }
+    }
+
+    return victim;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char      *name;
+    time_t       wait, next;
+    ngx_uint_t   i;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    name = ngx_alloc(cache->name_len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    /*
+     * shards are walked one by one, each under its own mutex, starting
+     * from the one where the previous run has stopped
+     */
+
+    next = 10;
+
+    for (i = 0; i < cache->nshards; i++) {
+
+        wait = ngx_http_file_cache_expire_shard(cache,
+                            &cache->sh->shards[cache->shard], name);
+
+        if (wait == 0) {
+            next = 0;
+            break;
+        }
+
+        if (wait < next) {
+            next = wait;
+        }
+
+        cache->shard = (cache->shard + 1) % cache->nshards;
+    }
+
+    ngx_free(name);
+
+    return next;
+}
+
+
+static time_t
+ngx_http_file_cache_expire_shard(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shard->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (ngx_queue_empty(&shard->queue)) {
+            wait = 10;
+            break;
+        }
+
+        q = ngx_queue_last(&shard->queue);
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            (void) ngx_http_file_cache_delete(cache, shard, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&shard->mutex);
+
+    return wait;
+}
+
+
+static off_t
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
+{
+    u_char                      *p;
+    off_t                        fs_size, freed;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    freed = 0;
+
+    if (fcn->exists) {
+        fs_size = fcn->fs_size;
+        shard->size -= fs_size;
+        ngx_http_file_cache_stripe_size(cache,
+                                  ngx_http_file_cache_node_stripe(cache, fcn),
+                                  -fs_size);
+
+        path = cache->stripes[ngx_http_file_cache_node_stripe(cache, fcn)].path;
+
+        p = ngx_cpymem(name, path->name.data, path->name.len);
+        p += 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&shard->mutex);
+
+        if (cache->memory) {
+            ngx_memcpy(key, (u_char *) &fcn->node.key,
+                       sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_http_file_cache_memory_delete(cache, key);
+        }
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+
+        } else {
+            cache->manager_deleted++;
+            cache->manager_freed += fs_size;
+            freed = fs_size;
+        }
+
+        ngx_shmtx_lock(&shard->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+        ngx_slab_free(cache->shpool, fcn);
+        shard->count--;
+    }
+
+    return freed;
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t                         size;
+    time_t                        wait, delay;
+    ngx_int_t                     stripe;
+    ngx_msec_t                    elapsed, next;
+    ngx_uint_t                    i, count, watermark;
+    ngx_http_file_cache_shard_t  *shard;
+
+    /*
+     * the index is written only after the loader has finished, and
+     * in slices of NGX_HTTP_FILE_CACHE_INDEX_SLICE batches per call
+     */
+
+    if (cache->index.len
+        && !cache->sh->cold
+        && !cache->sh->loading
+        && (cache->index_ctx
+            || ngx_time() - cache->index_time >= cache->index_interval))
+    {
+        if (ngx_http_file_cache_index_write(cache) != NGX_AGAIN) {
+            ngx_time_update();
+            cache->index_time = ngx_time();
+        }
+    }
+
+    if (ngx_time() - cache->stats_time >= NGX_HTTP_FILE_CACHE_STATS_TIME) {
+        ngx_http_file_cache_stats(cache);
+        cache->stats_time = ngx_time();
+    }
+
+    ngx_http_file_cache_stripe_check(cache, ngx_cycle->log, 0);
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
         goto done;
     }
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+    for ( ;; ) {
+        size = ngx_http_file_cache_size(cache, &count);
+        watermark = cache->sh->watermark;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        stripe = ngx_http_file_cache_stripe_over(cache);
+
+        if (size < cache->max_size && count < watermark) {
+
+            if (stripe == -1) {
+                break;
+            }
+
+        } else {
+            stripe = -1;
+        }
+
+        /* keys are spread evenly, so shards are forced out in turn */
+
+        wait = 10;
+
+        for (i = 0; i < cache->nshards; i++) {
+            shard = &cache->sh->shards[cache->shard];
+            cache->shard = (cache->shard + 1) % cache->nshards;
+
+            delay = ngx_http_file_cache_forced_expire(cache, shard, stripe);
+
+            if (delay < wait) {
+                wait = delay;
+            }
+
+            if (wait == 0) {
+                break;
+            }
+        }
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
 
-    if (n == NGX_ERROR) {
-        goto done;
-    }
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
     }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
+done:
+
+    if (cache->index_ctx && next > cache->manager_sleep) {
+        next = cache->manager_sleep;
     }
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+    cache->manager_elapsed += elapsed;
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.updating_sec = c->updating_sec;
-    h.error_sec = c->error_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
-    }
+    return next;
+}
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_int_t       rc;
+    ngx_uint_t      i;
+    ngx_path_t     *path;
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
 
-done:
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", file.name.data);
-    }
-}
+    rc = NGX_DECLINED;
 
+    if (cache->index.len) {
+        rc = ngx_http_file_cache_index_load(cache);
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
-{
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+        if (rc == NGX_ABORT) {
+            cache->sh->loading = 0;
+            return;
+        }
 
-    c = r->cache;
+        if (rc == NGX_OK) {
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+            /*
+             * the keys zone is warm now, the directory tree is still
+             * walked to add files created after the index was written
+             * and to remove nodes of files which no longer exist
+             */
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
+            cache->sh->cold = 0;
+        }
     }
 
-    /* we need to allocate all before the header would be sent */
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
 
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    cache->last = ngx_current_msec;
+    cache->files = 0;
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    for (i = 0; i < cache->nstripes; i++) {
+        path = cache->stripes[i].path;
+        cache->loader_stripe = i;
 
-    rc = ngx_http_send_header(r);
+        switch (ngx_walk_tree(&tree, &path->name)) {
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+        case NGX_ABORT:
+            cache->sh->loading = 0;
+            return;
+
+        case NGX_ERROR:
+
+            /* a missing or unreadable disk does not stop the others */
+
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "cache \"%V\" loader skipped \"%V\"",
+                          &cache->shm_zone->shm.name, &path->name);
+            break;
+
+        default:
+            break;
+        }
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (rc == NGX_OK) {
+        ngx_http_file_cache_index_reconcile(cache);
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) ngx_http_file_cache_size(cache, NULL)
+                   * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
 
-    out.buf = b;
-    out.next = NULL;
 
-    return ngx_http_output_filter(r, &out);
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
 
-    if (c->updated || c->node == NULL) {
-        return;
+    cache = ctx->data;
+
+    if (cache->index.len
+        && path->len >= cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
+    {
+        return NGX_OK;
     }
 
-    cache = c->file_cache;
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    } else {
+        ngx_time_update();
 
-    fcn = c->node;
-    fcn->count--;
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
     }
 
-    if (c->error) {
-        fcn->error = c->error;
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
-        }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-    c->updated = 1;
-    c->updating = 0;
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
-        }
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
     }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
-}
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
 
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-    if (c->updated) {
-        return;
-    }
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+        p += 2;
+
+        c.key[i] = (u_char) n;
     }
 
-    ngx_http_file_cache_free(c, NULL);
+    if (ngx_http_file_cache_stripe(cache, c.key) != cache->loader_stripe) {
+        ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                      "cache file \"%s\" is on a wrong stripe", name->data);
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
 }
 
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
-
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    wait = 10;
-    tries = 20;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->mutex);
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    fcn = ngx_http_file_cache_lookup(&shard->rbtree, c->key);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    if (fcn == NULL) {
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+        fcn = ngx_slab_calloc(cache->shpool,
+                              sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
 
-        } else {
-            if (--tries) {
-                continue;
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
             }
 
-            wait = 1;
+            ngx_shmtx_unlock(&shard->mutex);
+            return NGX_ERROR;
         }
 
-        break;
-    }
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        shard->count++;
 
-    ngx_free(name);
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    return wait;
-}
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
+        ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+        shard->size += c->fs_size;
+        ngx_http_file_cache_stripe_size(cache,
+                                  ngx_http_file_cache_stripe(cache, c->key),
+                                  c->fs_size);
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    } else if (fcn->unverified) {
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+        /*
+         * the node was loaded from the index, keep its position, but
+         * take the size from the file found, and forget the file uniq,
+         * as the file may have been replaced after the index was written
+         */
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+        fcn->unverified = 0;
 
-    now = ngx_time();
+        if (fcn->exists && !fcn->updating) {
+            shard->size += c->fs_size - fcn->fs_size;
+            ngx_http_file_cache_stripe_size(cache, cache->loader_stripe,
+                                            c->fs_size - fcn->fs_size);
+            fcn->fs_size = c->fs_size;
+            fcn->uniq = 0;
+        }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_shmtx_unlock(&shard->mutex);
 
-    for ( ;; ) {
+        return NGX_OK;
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+    fcn->expire = ngx_time() + cache->inactive;
 
-        q = ngx_queue_last(&cache->sh->queue);
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_shmtx_unlock(&shard->mutex);
 
-        wait = fcn->expire - now;
+    return NGX_OK;
+}
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    return NGX_OK;
+}
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t  i, count;
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    /*
+     * the counters of other shards are read without their mutexes,
+     * an approximate value is enough for the watermark
+     */
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    count = 0;
 
-next:
+    for (i = 0; i < cache->nshards; i++) {
+        count += cache->sh->shards[i].count;
+    }
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    cache->sh->watermark = count - count / 8;
 
-        ngx_time_update();
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
+static void
+ngx_http_file_cache_stats(ngx_http_file_cache_t *cache)
+{
+    ngx_uint_t                        i;
+    ngx_atomic_uint_t                 hits, misses, hit_bytes, miss_bytes,
+                                      requests;
+    ngx_http_file_cache_sh_t         *sh;
+    ngx_http_file_cache_stripe_sh_t  *st;
+
+    sh = cache->sh;
+
+    hits = sh->hits;
+    misses = sh->misses;
+    hit_bytes = sh->hit_bytes;
+    miss_bytes = sh->miss_bytes;
+
+    requests = hits + misses;
+
+    if (requests != cache->stats_requests) {
+        cache->stats_requests = requests;
+
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                  "cache \"%V\": %uA hits, %uA misses, %uA%% object hit ratio, "
+                  "%uA bytes hit, %uA bytes missed, %uA%% byte hit ratio",
+                  &cache->shm_zone->shm.name, hits, misses,
+                  hits * 100 / requests, hit_bytes, miss_bytes,
+                  hit_bytes + miss_bytes
+                  ? hit_bytes * 100 / (hit_bytes + miss_bytes) : 0);
+
+        for (i = 0; i < cache->nstripes && cache->nstripes > 1; i++) {
+            st = &sh->stripes[i];
+
+            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                          "cache \"%V\" stripe \"%V\": %O bytes, "
+                          "%uA opens, %uA writes, %uA errors%s",
+                          &cache->shm_zone->shm.name,
+                          &cache->stripes[i].path->name,
+                          (off_t) st->size * cache->bsize,
+                          st->opens, st->writes, st->errors,
+                          ngx_http_file_cache_stripe_down(cache, i)
+                          ? ", disabled" : "");
         }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    /* the manager counters are local to the cache manager process */
 
-    ngx_free(name);
+    if (cache->manager_deleted) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "cache \"%V\" manager: %ui files deleted, "
+                      "%O bytes freed, %M ms spent",
+                      &cache->shm_zone->shm.name, cache->manager_deleted,
+                      cache->manager_freed * cache->bsize,
+                      cache->manager_elapsed);
 
-    return wait;
+        cache->manager_deleted = 0;
+        cache->manager_freed = 0;
+        cache->manager_elapsed = 0;
+    }
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static off_t
+ngx_http_file_cache_size(ngx_http_file_cache_t *cache, ngx_uint_t *count)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
-
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
-
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
-
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    off_t                         size;
+    ngx_uint_t                    i, n;
+    ngx_http_file_cache_shard_t  *shard;
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    size = 0;
+    n = 0;
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->sh->shards[i];
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        ngx_shmtx_lock(&shard->mutex);
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+        size += shard->size;
+        n += shard->count;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+        ngx_shmtx_unlock(&shard->mutex);
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    if (count) {
+        *count = n;
     }
+
+    return size;
 }
 
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
+static ngx_int_t
+ngx_http_file_cache_index_write(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_t  *cache = data;
-
-    off_t       size;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    ngx_int_t                            rc;
+    ngx_uint_t                           n;
+    ngx_http_file_cache_index_ctx_t     *ctx;
+    ngx_http_file_cache_index_header_t   h;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ctx = cache->index_ctx;
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    if (ctx) {
+        goto write;
+    }
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index write: \"%V\"", &cache->index);
+
+    ctx = ngx_alloc(sizeof(ngx_http_file_cache_index_ctx_t)
+                    + NGX_HTTP_FILE_CACHE_INDEX_BATCH
+                      * sizeof(ngx_http_file_cache_index_entry_t)
+                    + cache->index.len + sizeof(".tmp"),
+                    ngx_cycle->log);
+    if (ctx == NULL) {
+        return NGX_ERROR;
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    ctx->entries = (ngx_http_file_cache_index_entry_t *) &ctx[1];
+    ctx->temp = (u_char *) &ctx->entries[NGX_HTTP_FILE_CACHE_INDEX_BATCH];
+    ctx->shard = 0;
+    ctx->key = NULL;
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+    (void) ngx_sprintf(ctx->temp, "%V.tmp%Z", &cache->index);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    ctx->fd = ngx_open_file(ctx->temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+    if (ctx->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", ctx->temp);
+        ngx_free(ctx);
+        return NGX_ERROR;
+    }
 
-        if (size < cache->max_size && count < watermark) {
-            break;
-        }
+    cache->index_ctx = ctx;
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
-        }
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.bsize = cache->bsize;
+    h.time = ngx_time();
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
+    if (ngx_write_fd(ctx->fd, &h, sizeof(ngx_http_file_cache_index_header_t))
+        != sizeof(ngx_http_file_cache_index_header_t))
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", ctx->temp);
+        goto failed;
+    }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
+write:
+
+    /* the snapshot is written in slices, one per manager iteration */
+
+    for (n = 0; n < NGX_HTTP_FILE_CACHE_INDEX_SLICE; n++) {
 
-        ngx_time_update();
+        rc = ngx_http_file_cache_index_write_batch(cache, ctx);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (rc == NGX_DONE) {
+            ctx->shard++;
+            ctx->key = NULL;
+
+            if (ctx->shard == cache->nshards) {
+                goto done;
+            }
         }
     }
 
+    return NGX_AGAIN;
+
 done:
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->temp);
+    }
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+    rc = NGX_OK;
 
-    return next;
-}
+    if (ngx_rename_file(ctx->temp, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      ctx->temp, &cache->index);
+        rc = NGX_ERROR;
+    }
 
+    cache->index_ctx = NULL;
+    ngx_free(ctx);
 
-static void
-ngx_http_file_cache_loader(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    return rc;
 
-    ngx_tree_ctx_t  tree;
+failed:
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+    if (ngx_close_file(ctx->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", ctx->temp);
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    if (ngx_delete_file(ctx->temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", ctx->temp);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    cache->index_ctx = NULL;
+    ngx_free(ctx);
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    return NGX_ERROR;
+}
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
-    }
+static ngx_int_t
+ngx_http_file_cache_index_write_batch(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_ctx_t *ctx)
+{
+    size_t                        size;
+    ngx_uint_t                    n, visited;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    shard = &cache->sh->shards[ctx->shard];
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    /*
+     * the shard is walked in key order in batches, so its mutex is not
+     * held for long; the walk resumes from the last key seen
+     */
 
+    n = 0;
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
-}
+    ngx_shmtx_lock(&shard->mutex);
 
+    fcn = ngx_http_file_cache_index_next(shard, ctx->key);
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    for (visited = 0;
+         fcn && visited < NGX_HTTP_FILE_CACHE_INDEX_BATCH;
+         visited++)
+    {
+        ngx_memcpy(ctx->last, (u_char *) &fcn->node.key,
+                   sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&ctx->last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    cache = ctx->data;
+        if (fcn->exists && !fcn->deleting) {
+            ngx_memcpy(ctx->entries[n].key, ctx->last, NGX_HTTP_CACHE_KEY_LEN);
+            ctx->entries[n].uniq = fcn->uniq;
+            ctx->entries[n].expire = fcn->expire;
+            ctx->entries[n].fs_size = fcn->fs_size;
+            ctx->entries[n].body_start = fcn->body_start;
+            n++;
+        }
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+        fcn = ngx_http_file_cache_index_next(shard, ctx->last);
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
-
-    } else {
-        ngx_time_update();
+    ngx_shmtx_unlock(&shard->mutex);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ctx->key = ctx->last;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    size = n * sizeof(ngx_http_file_cache_index_entry_t);
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
+    if (n && ngx_write_fd(ctx->fd, ctx->entries, size) != (ssize_t) size) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_write_fd_n " \"%s\" failed", ctx->temp);
+        return NGX_ERROR;
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    return fcn ? NGX_OK : NGX_DONE;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_shard_t *shard,
+    u_char *key)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn, *next;
+
+    /* the first node with the key greater than the given one, if any */
+
+    node_key = 0;
+
+    if (key) {
+        ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
     }
 
-    return NGX_OK;
-}
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
+    next = NULL;
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+    while (node != sentinel) {
 
-    ngx_time_update();
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+        if (key == NULL || node_key < node->key) {
+            rc = -1;
+
+        } else if (node_key > node->key) {
+            rc = 1;
+
+        } else {
+            rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        }
+
+        if (rc < 0) {
+            next = fcn;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return next;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ssize_t                              n;
+    ngx_fd_t                             fd;
+    ngx_err_t                            err;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, count;
+    ngx_http_file_cache_index_entry_t   *entries;
+    ngx_http_file_cache_index_header_t   h;
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
+    fd = ngx_open_file(cache->index.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%V\" failed", &cache->index);
+        }
+
+        return NGX_DECLINED;
     }
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    entries = NULL;
+    count = 0;
+    rc = NGX_DECLINED;
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
+    n = ngx_read_fd(fd, &h, sizeof(ngx_http_file_cache_index_header_t));
+
+    if (n != sizeof(ngx_http_file_cache_index_header_t)
+        || h.version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h.bsize != cache->bsize)
     {
-        return NGX_OK;
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache index \"%V\" is invalid, ignored", &cache->index);
+        goto done;
     }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+    entries = ngx_alloc(NGX_HTTP_FILE_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        goto done;
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    rc = NGX_OK;
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    for ( ;; ) {
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        n = ngx_read_fd(fd, entries,
+                        NGX_HTTP_FILE_CACHE_INDEX_BATCH
+                        * sizeof(ngx_http_file_cache_index_entry_t));
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_read_fd_n " \"%V\" failed", &cache->index);
+            break;
+        }
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        /* a truncated entry at the end is ignored */
+
+        n /= sizeof(ngx_http_file_cache_index_entry_t);
+
+        if (n == 0) {
+            break;
         }
 
-        p += 2;
+        for (i = 0; i < (ngx_uint_t) n; i++) {
+            if (ngx_http_file_cache_index_add(cache, &entries[i]) != NGX_OK) {
+                goto loaded;
+            }
+        }
 
-        c.key[i] = (u_char) n;
+        count += n;
+
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ABORT;
+            goto done;
+        }
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+loaded:
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %ui entries loaded from index, "
+                  "written at %T", &cache->path->name, count, h.time);
+
+done:
+
+    if (entries) {
+        ngx_free(entries);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &cache->index);
+    }
+
+    return rc;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_index_add(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_index_entry_t *entry)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    shard = ngx_http_file_cache_shard(cache, entry->key);
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+    ngx_shmtx_lock(&shard->mutex);
 
-    if (fcn == NULL) {
+    fcn = ngx_http_file_cache_lookup(&shard->rbtree, entry->key);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+    if (fcn) {
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+        /* the node was created by a request while the cache was cold */
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
-        }
+        ngx_shmtx_unlock(&shard->mutex);
+        return NGX_OK;
+    }
 
-        cache->sh->count++;
+    fcn = ngx_slab_calloc(cache->shpool, sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(cache);
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "could not allocate node%s", cache->shpool->log_ctx);
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        ngx_shmtx_unlock(&shard->mutex);
+        return NGX_ERROR;
+    }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    shard->count++;
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+    ngx_memcpy((u_char *) &fcn->node.key, entry->key,
+               sizeof(ngx_rbtree_key_t));
 
-        cache->sh->size += c->fs_size;
+    ngx_memcpy(fcn->key, &entry->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+    ngx_rbtree_insert(&shard->rbtree, &fcn->node);
 
-    fcn->expire = ngx_time() + cache->inactive;
+    fcn->uses = 1;
+    fcn->exists = 1;
+    fcn->unverified = 1;
+    fcn->uniq = entry->uniq;
+    fcn->expire = entry->expire;
+    fcn->fs_size = entry->fs_size;
+    fcn->body_start = entry->body_start;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    shard->size += entry->fs_size;
+    ngx_http_file_cache_stripe_size(cache,
+                                  ngx_http_file_cache_stripe(cache, entry->key),
+                                  entry->fs_size);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_queue_insert_head(&shard->queue, &fcn->queue);
+
+    ngx_shmtx_unlock(&shard->mutex);
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_index_reconcile(ngx_http_file_cache_t *cache)
 {
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    u_char                       *key;
+    ngx_uint_t                    i, n, removed;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+    u_char                        last[NGX_HTTP_CACHE_KEY_LEN];
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
-    }
+    removed = 0;
 
-    return NGX_OK;
-}
+    /* nodes which were not seen by the directory walk have no files */
 
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->sh->shards[i];
+        key = NULL;
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+        do {
+            ngx_shmtx_lock(&shard->mutex);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+            fcn = ngx_http_file_cache_index_next(shard, key);
+
+            for (n = 0; fcn && n < NGX_HTTP_FILE_CACHE_INDEX_BATCH; n++) {
+
+                ngx_memcpy(last, (u_char *) &fcn->node.key,
+                           sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&last[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                if (fcn->unverified) {
+                    fcn->unverified = 0;
+
+                    if (fcn->count == 0) {
+                        if (fcn->exists) {
+                            shard->size -= fcn->fs_size;
+                            ngx_http_file_cache_stripe_size(cache,
+                                  ngx_http_file_cache_node_stripe(cache, fcn),
+                                  -fcn->fs_size);
+                        }
+
+                        ngx_queue_remove(&fcn->queue);
+                        ngx_rbtree_delete(&shard->rbtree, &fcn->node);
+                        ngx_slab_free(cache->shpool, fcn);
+                        shard->count--;
+
+                        removed++;
+                    }
+                }
+
+                fcn = ngx_http_file_cache_index_next(shard, last);
+            }
+
+            ngx_shmtx_unlock(&shard->mutex);
+
+            key = last;
+
+        } while (fcn);
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %ui stale index entries removed",
+                  &cache->path->name, removed);
 }
 
 
@@ -2272,17 +4638,22 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
-    ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
-                            manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
-    ngx_array_t            *caches;
-    ngx_http_file_cache_t  *cache, **ce;
+    off_t                          max_size, stripe_size;
+    u_char                        *last, *p;
+    size_t                         len;
+    time_t                         inactive, index_interval;
+    ssize_t                        size, memory_size, memory_max_object,
+                                   admission_size;
+    ngx_str_t                      s, v, name, memory_name, index, *value;
+    ngx_int_t                      loader_files, manager_files;
+    ngx_msec_t                     loader_sleep, manager_sleep,
+                                   loader_threshold, manager_threshold;
+    ngx_int_t                      shards, memory_min_uses;
+    size_t                         sketch_size;
+    ngx_uint_t                     i, n, use_temp_path, eviction;
+    ngx_array_t                   *caches, stripes;
+    ngx_http_file_cache_t         *cache, **ce;
+    ngx_http_file_cache_stripe_t  *stripe;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -2294,7 +4665,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ngx_array_init(&stripes, cf->pool, 4,
+                       sizeof(ngx_http_file_cache_stripe_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
     use_temp_path = 1;
+    eviction = NGX_HTTP_FILE_CACHE_LRU;
 
     inactive = 600;
 
@@ -2308,8 +4687,19 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     name.len = 0;
     size = 0;
+    shards = 1;
     max_size = NGX_MAX_OFF_T_VALUE;
 
+    ngx_str_null(&index);
+    index_interval = 600;
+
+    sketch_size = 0;
+
+    memory_name.len = 0;
+    memory_size = 0;
+    memory_max_object = 16384;
+    memory_min_uses = 2;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -2322,6 +4712,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    stripe = ngx_array_push(&stripes);
+    if (stripe == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    stripe->path = cache->path;
+    stripe->max_size = 0;
+
     for (i = 2; i < cf->args->nelts; i++) {
 
         if (ngx_strncmp(value[i].data, "levels=", 7) == 0) {
@@ -2380,6 +4778,25 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                eviction = NGX_HTTP_FILE_CACHE_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "gdsf") == 0) {
+                eviction = NGX_HTTP_FILE_CACHE_GDSF;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid eviction value \"%V\", "
+                                   "it must be \"lru\" or \"gdsf\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2405,6 +4822,161 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return NGX_CONF_ERROR;
         }
 
+        if (ngx_strncmp(value[i].data, "memory_zone=", 12) == 0) {
+
+            memory_name.data = value[i].data + 12;
+
+            p = (u_char *) ngx_strchr(memory_name.data, ':');
+
+            if (p) {
+                memory_name.len = p - memory_name.data;
+
+                p++;
+
+                s.len = value[i].data + value[i].len - p;
+                s.data = p;
+
+                memory_size = ngx_parse_size(&s);
+                if (memory_size > 8191) {
+                    continue;
+                }
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid memory zone size \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            memory_max_object = ngx_parse_size(&s);
+            if (memory_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory_max_object value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            memory_min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (memory_min_uses == NGX_ERROR || memory_min_uses == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory_min_uses value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "admission_sketch=", 17) == 0) {
+
+            s.len = value[i].len - 17;
+            s.data = value[i].data + 17;
+
+            admission_size = ngx_parse_size(&s);
+            if (admission_size < 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid admission_sketch value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            /* the size and the number of counters are powers of two */
+
+            for (sketch_size = 1024;
+                 sketch_size * 2 <= (size_t) admission_size;
+                 sketch_size *= 2)
+            {
+                /* void */
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "stripe=", 7) == 0) {
+
+            stripe = ngx_array_push(&stripes);
+            if (stripe == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            stripe->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (stripe->path == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            stripe->max_size = 0;
+
+            /* "stripe=path:max_size", the path itself may contain colons */
+
+            for (p = s.data + s.len; p > s.data; p--) {
+                if (p[-1] == ':') {
+                    break;
+                }
+            }
+
+            if (p > s.data) {
+                v.len = s.data + s.len - p;
+                v.data = p;
+
+                stripe_size = ngx_parse_offset(&v);
+
+                if (stripe_size > 0) {
+                    stripe->max_size = stripe_size;
+                    s.len = p - 1 - s.data;
+                }
+            }
+
+            if (s.len && s.data[s.len - 1] == '/') {
+                s.len--;
+            }
+
+            if (s.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid stripe value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            stripe->path->name.len = s.len;
+            stripe->path->name.data = ngx_pnalloc(cf->pool, s.len + 1);
+            if (stripe->path->name.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            (void) ngx_cpystrn(stripe->path->name.data, s.data, s.len + 1);
+
+            if (ngx_conf_full_name(cf->cycle, &stripe->path->name, 0)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards == NGX_ERROR || shards == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2420,6 +4992,40 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            index.len = value[i].len - 6;
+            index.data = value[i].data + 6;
+
+            if (index.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &index, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR || index_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index_interval value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2542,11 +5148,65 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->index = index;
+    cache->index_interval = index_interval;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
+    stripe = stripes.elts;
+    stripe[0].path = cache->path;
+
+    len = cache->path->name.len;
+
+    for (n = 1; n < stripes.nelts; n++) {
+
+        for (i = 0; i < n; i++) {
+            if (ngx_strcmp(stripe[i].path->name.data,
+                           stripe[n].path->name.data)
+                == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate stripe \"%V\"",
+                                   &stripe[n].path->name);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        /* stripes are laid out as the main path, but managed with it */
+
+        ngx_memcpy(stripe[n].path->level, cache->path->level,
+                   sizeof(cache->path->level));
+        stripe[n].path->len = cache->path->len;
+        stripe[n].path->data = cache;
+        stripe[n].path->conf_file = cf->conf_file->file.name.data;
+        stripe[n].path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &stripe[n].path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (stripe[n].path->name.len > len) {
+            len = stripe[n].path->name.len;
+        }
+    }
+
+    for (n = 0; n < stripes.nelts; n++) {
+        stripe[n].hash = ngx_crc32_short(stripe[n].path->name.data,
+                                         stripe[n].path->name.len);
+    }
+
+    cache->stripes = stripes.elts;
+    cache->nstripes = stripes.nelts;
+    cache->name_len = len + 1 + cache->path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    /* the sketch is allocated in the keys zone */
+
+    if (sketch_size) {
+        size += sketch_size + ngx_pagesize;
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -2562,8 +5222,31 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (memory_name.len) {
+        cache->memory_zone = ngx_shared_memory_add(cf, &memory_name,
+                                                   memory_size, cmd->post);
+        if (cache->memory_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->memory_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &memory_name);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->memory_zone->init = ngx_http_file_cache_memory_init;
+        cache->memory_zone->data = cache;
+
+        cache->memory_max_object = memory_max_object;
+        cache->memory_min_uses = memory_min_uses;
+    }
+
     cache->use_temp_path = use_temp_path;
 
+    cache->nshards = shards;
+    cache->eviction = eviction;
+    cache->sketch_size = sketch_size;
     cache->inactive = inactive;
     cache->max_size = max_size;
 
@@ -2654,3 +5337,140 @@ ngx_http_file_cache_valid_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 
     return NGX_CONF_OK;
 }
+
+
+char *
+ngx_http_file_cache_status_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_file_cache_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_status_handler(ngx_http_request_t *r)
+{
+    off_t                   size;
+    size_t                  len;
+    ngx_int_t               rc;
+    ngx_buf_t              *b;
+    ngx_uint_t              i, count;
+    ngx_chain_t             out;
+    ngx_list_part_t        *part;
+    ngx_shm_zone_t         *shm_zone;
+    ngx_http_file_cache_t  *cache;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("text/plain") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    /* the cache zones are found among the shared memory zones */
+
+    len = 0;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_http_file_cache_init) {
+            continue;
+        }
+
+        len += shm_zone[i].shm.name.len
+               + sizeof(": size= entries= hits= misses= hit_bytes= "
+                        "miss_bytes= evictions= evicted_bytes=\n") - 1
+               + 2 * NGX_OFF_T_LEN + 6 * NGX_ATOMIC_T_LEN;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len ? len : 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].init != ngx_http_file_cache_init) {
+            continue;
+        }
+
+        cache = shm_zone[i].data;
+
+        size = ngx_http_file_cache_size(cache, &count);
+
+        b->last = ngx_sprintf(b->last,
+                              "%V: size=%O entries=%ui hits=%uA misses=%uA "
+                              "hit_bytes=%uA miss_bytes=%uA evictions=%uA "
+                              "evicted_bytes=%O\n",
+                              &shm_zone[i].shm.name, size * cache->bsize,
+                              count, cache->sh->hits, cache->sh->misses,
+                              cache->sh->hit_bytes, cache->sh->miss_bytes,
+                              cache->sh->evictions,
+                              (off_t) cache->sh->evicted * cache->bsize);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
@@ -11,6 +11,17 @@
 #include <nginx.h>
 
 
+typedef struct {
+    ngx_str_t                  server;
+    ngx_str_t                  content_type;
+} ngx_http_header_filter_loc_conf_t;
+
+
+static ngx_uint_t ngx_http_header_filter_template(ngx_list_part_t *part,
+    ngx_uint_t i, ngx_http_header_template_t *tpl);
+static void *ngx_http_header_filter_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_header_filter_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
 static ngx_int_t ngx_http_header_filter_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_header_filter(ngx_http_request_t *r);
 
@@ -25,8 +36,8 @@ static ngx_http_module_t  ngx_http_header_filter_module_ctx = {
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL,                                  /* merge location configuration */
+    ngx_http_header_filter_create_loc_conf, /* create location configuration */
+    ngx_http_header_filter_merge_loc_conf  /* merge location configuration */
 };
 
 
@@ -152,21 +163,54 @@ ngx_http_header_out_t  ngx_http_headers_out[] = {
 };
 
 
+ngx_str_t *
+ngx_http_status_line(ngx_uint_t status)
+{
+    if (status >= NGX_HTTP_OK && status < NGX_HTTP_LAST_2XX) {
+        status -= NGX_HTTP_OK;
+
+    } else if (status >= NGX_HTTP_MOVED_PERMANENTLY
+               && status < NGX_HTTP_LAST_3XX)
+    {
+        status = status - NGX_HTTP_MOVED_PERMANENTLY + NGX_HTTP_OFF_3XX;
+
+    } else if (status >= NGX_HTTP_BAD_REQUEST && status < NGX_HTTP_LAST_4XX) {
+        status = status - NGX_HTTP_BAD_REQUEST + NGX_HTTP_OFF_4XX;
+
+    } else if (status >= NGX_HTTP_INTERNAL_SERVER_ERROR
+               && status < NGX_HTTP_LAST_5XX)
+    {
+        status = status - NGX_HTTP_INTERNAL_SERVER_ERROR + NGX_HTTP_OFF_5XX;
+
+    } else {
+        return NULL;
+    }
+
+    if (ngx_http_status_lines[status].len == 0) {
+        return NULL;
+    }
+
+    return &ngx_http_status_lines[status];
+}
+
+
 static ngx_int_t
 ngx_http_header_filter(ngx_http_request_t *r)
 {
-    u_char                    *p;
-    size_t                     len;
-    ngx_str_t                  host, *status_line;
-    ngx_buf_t                 *b;
-    ngx_uint_t                 status, i, port;
-    ngx_chain_t                out;
-    ngx_list_part_t           *part;
-    ngx_table_elt_t           *header;
-    ngx_connection_t          *c;
-    ngx_http_core_loc_conf_t  *clcf;
-    ngx_http_core_srv_conf_t  *cscf;
-    u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                             *p;
+    size_t                              len;
+    ngx_str_t                           host, *status_line;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          status, i, port;
+    ngx_chain_t                         out;
+    ngx_list_part_t                    *part;
+    ngx_table_elt_t                    *header;
+    ngx_connection_t                   *c;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_core_srv_conf_t           *cscf;
+    ngx_http_header_template_t         *tpl;
+    ngx_http_header_filter_loc_conf_t  *hlcf;
+    u_char                              addr[NGX_SOCKADDR_STRLEN];
 
     if (r->header_sent) {
         return NGX_OK;
@@ -277,24 +321,24 @@ ngx_http_header_filter(ngx_http_request_t *r)
     }
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_http_header_filter_module);
 
     if (r->headers_out.server == NULL) {
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            len += sizeof(ngx_http_server_full_string) - 1;
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            len += sizeof(ngx_http_server_build_string) - 1;
-
-        } else {
-            len += sizeof(ngx_http_server_string) - 1;
-        }
+        len += hlcf->server.len;
     }
 
     if (r->headers_out.date == NULL) {
         len += sizeof("Date: Mon, 28 Sep 1970 06:00:00 GMT" CRLF) - 1;
     }
 
-    if (r->headers_out.content_type.len) {
+    if (r->headers_out.content_type.data == clcf->default_type.data
+        && r->headers_out.content_type.len == clcf->default_type.len
+        && r->headers_out.charset.len == 0)
+    {
+        /* the default type, it is preformatted in hlcf->content_type */
+        len += hlcf->content_type.len;
+
+    } else if (r->headers_out.content_type.len) {
         len += sizeof("Content-Type: ") - 1
                + r->headers_out.content_type.len + 2;
 
@@ -407,6 +451,8 @@ ngx_http_header_filter(ngx_http_request_t *r)
     }
 #endif
 
+    tpl = r->headers_out.header_template;
+
     part = &r->headers_out.headers.part;
     header = part->elts;
 
@@ -422,6 +468,17 @@ ngx_http_header_filter(ngx_http_request_t *r)
             i = 0;
         }
 
+        if (tpl && &header[i] == r->headers_out.header_template_start) {
+
+            if (ngx_http_header_filter_template(part, i, tpl)) {
+                len += tpl->text.len;
+                i += tpl->nelts - 1;
+                continue;
+            }
+
+            tpl = NULL;
+        }
+
         if (header[i].hash == 0) {
             continue;
         }
@@ -448,20 +505,7 @@ ngx_http_header_filter(ngx_http_request_t *r)
     *b->last++ = CR; *b->last++ = LF;
 
     if (r->headers_out.server == NULL) {
-        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
-            p = ngx_http_server_full_string;
-            len = sizeof(ngx_http_server_full_string) - 1;
-
-        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
-            p = ngx_http_server_build_string;
-            len = sizeof(ngx_http_server_build_string) - 1;
-
-        } else {
-            p = ngx_http_server_string;
-            len = sizeof(ngx_http_server_string) - 1;
-        }
-
-        b->last = ngx_cpymem(b->last, p, len);
+        b->last = ngx_cpymem(b->last, hlcf->server.data, hlcf->server.len);
     }
 
     if (r->headers_out.date == NULL) {
@@ -472,7 +516,14 @@ ngx_http_header_filter(ngx_http_request_t *r)
         *b->last++ = CR; *b->last++ = LF;
     }
 
-    if (r->headers_out.content_type.len) {
+    if (r->headers_out.content_type.data == clcf->default_type.data
+        && r->headers_out.content_type.len == clcf->default_type.len
+        && r->headers_out.charset.len == 0)
+    {
+        b->last = ngx_cpymem(b->last, hlcf->content_type.data,
+                             hlcf->content_type.len);
+
+    } else if (r->headers_out.content_type.len) {
         b->last = ngx_cpymem(b->last, "Content-Type: ",
                              sizeof("Content-Type: ") - 1);
         p = b->last;
@@ -590,6 +641,12 @@ ngx_http_header_filter(ngx_http_request_t *r)
             i = 0;
         }
 
+        if (tpl && &header[i] == r->headers_out.header_template_start) {
+            b->last = ngx_cpymem(b->last, tpl->text.data, tpl->text.len);
+            i += tpl->nelts - 1;
+            continue;
+        }
+
         if (header[i].hash == 0) {
             continue;
         }
@@ -620,6 +677,106 @@ ngx_http_header_filter(ngx_http_request_t *r)
 }
 
 
+static ngx_uint_t
+ngx_http_header_filter_template(ngx_list_part_t *part, ngx_uint_t i,
+    ngx_http_header_template_t *tpl)
+{
+    ngx_uint_t        n;
+    ngx_table_elt_t  *header;
+
+    /*
+     * the preformatted headers can be used only if they are still
+     * in the same list part and none of them was removed by other filters
+     */
+
+    if (i + tpl->nelts > part->nelts) {
+        return 0;
+    }
+
+    header = part->elts;
+
+    for (n = i; n < i + tpl->nelts; n++) {
+        if (header[n].hash == 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static void *
+ngx_http_header_filter_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_header_filter_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_header_filter_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->server = { 0, NULL };
+     *     conf->content_type = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_header_filter_merge_loc_conf(ngx_conf_t *cf, void *parent,
+    void *child)
+{
+    ngx_http_header_filter_loc_conf_t *conf = child;
+
+    u_char                    *p;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    /*
+     * the "Server" and the default "Content-Type" header lines
+     * depend on the location configuration only and are formatted once
+     */
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+        conf->server.data = ngx_http_server_full_string;
+        conf->server.len = sizeof(ngx_http_server_full_string) - 1;
+
+    } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+        conf->server.data = ngx_http_server_build_string;
+        conf->server.len = sizeof(ngx_http_server_build_string) - 1;
+
+    } else {
+        conf->server.data = ngx_http_server_string;
+        conf->server.len = sizeof(ngx_http_server_string) - 1;
+    }
+
+    if (clcf->default_type.len == 0) {
+        return NGX_CONF_OK;
+    }
+
+    conf->content_type.len = sizeof("Content-Type: ") - 1
+                             + clcf->default_type.len + sizeof(CRLF) - 1;
+
+    p = ngx_pnalloc(cf->pool, conf->content_type.len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->content_type.data = p;
+
+    p = ngx_cpymem(p, "Content-Type: ", sizeof("Content-Type: ") - 1);
+    p = ngx_cpymem(p, clcf->default_type.data, clcf->default_type.len);
+    *p++ = CR; *p = LF;
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_int_t
 ngx_http_header_filter_init(ngx_conf_t *cf)
 {
@@ -52,6 +52,7 @@ static void ngx_http_set_lingering_close(ngx_http_request_t *r);
 static void ngx_http_lingering_close_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_post_action(ngx_http_request_t *r);
 static void ngx_http_close_request(ngx_http_request_t *r, ngx_int_t error);
+static void ngx_http_flush_batch(ngx_http_request_t *r);
 static void ngx_http_log_request(ngx_http_request_t *r);
 
 static u_char *ngx_http_log_error(ngx_log_t *log, u_char *buf, size_t len);
@@ -2187,8 +2188,9 @@ ngx_http_find_virtual_server(ngx_connection_t *c,
 static void
 ngx_http_request_handler(ngx_event_t *ev)
 {
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    ngx_connection_t         *c;
+    ngx_http_request_t       *r;
+    ngx_http_output_batch_t  *batch;
 
     c = ev->data;
     r = c->data;
@@ -2204,6 +2206,30 @@ ngx_http_request_handler(ngx_event_t *ev)
     }
 
     if (ev->write) {
+        batch = r->http_connection->batch;
+
+        if (batch && batch->blocked) {
+
+            /* the responses postponed by "postpone_pipelined_output" */
+
+            if (ev->timedout) {
+                ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                              "client timed out");
+                c->timedout = 1;
+                ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+                ngx_http_run_posted_requests(c);
+                return;
+            }
+
+            batch->event->handler(batch->event);
+
+            if (c->error) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                ngx_http_run_posted_requests(c);
+                return;
+            }
+        }
+
         r->write_event_handler(r);
 
     } else {
@@ -2568,6 +2594,7 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
                 || r->header_in->pos < r->header_in->last
                 || r->connection->read->ready)))
     {
+        ngx_http_flush_batch(r);
         ngx_http_set_lingering_close(r);
         return;
     }
@@ -2944,6 +2971,21 @@ ngx_http_set_keepalive(ngx_http_request_t *r)
 
         rev->handler = ngx_http_process_request_line;
         ngx_post_event(rev, &ngx_posted_events);
+
+        if (hc->batch && hc->batch->buf->pos != hc->batch->buf->last) {
+
+            /*
+             * the responses postponed by "postpone_pipelined_output"
+             * are flushed after the pipelined request is processed
+             */
+
+            if (hc->batch->event->posted) {
+                ngx_delete_posted_event(hc->batch->event);
+            }
+
+            ngx_post_event(hc->batch->event, &ngx_posted_events);
+        }
+
         return;
     }
 
@@ -3421,11 +3463,40 @@ ngx_http_close_request(ngx_http_request_t *r, ngx_int_t rc)
     }
 #endif
 
+    ngx_http_flush_batch(r);
+
     ngx_http_free_request(r, rc);
     ngx_http_close_connection(c);
 }
 
 
+static void
+ngx_http_flush_batch(ngx_http_request_t *r)
+{
+    ngx_connection_t         *c;
+    ngx_http_output_batch_t  *batch;
+
+    /*
+     * the responses postponed by "postpone_pipelined_output" are sent
+     * before the connection is closed, even if the last request did
+     * not produce a response
+     */
+
+    c = r->connection;
+    batch = r->http_connection->batch;
+
+    if (batch == NULL || c->timedout) {
+        return;
+    }
+
+    if (batch->event->posted) {
+        ngx_delete_posted_event(batch->event);
+    }
+
+    batch->event->handler(batch->event);
+}
+
+
 void
 ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
 {
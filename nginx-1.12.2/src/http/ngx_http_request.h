@@ -246,6 +246,12 @@ typedef struct {
 } ngx_http_headers_in_t;
 
 
+typedef struct {
+    ngx_str_t                         text;
+    ngx_uint_t                        nelts;
+} ngx_http_header_template_t;
+
+
 typedef struct {
     ngx_list_t                        headers;
 
@@ -275,6 +281,9 @@ typedef struct {
 
     ngx_array_t                       cache_control;
 
+    ngx_http_header_template_t       *header_template;
+    ngx_table_elt_t                  *header_template_start;
+
     off_t                             content_length_n;
     off_t                             content_offset;
     time_t                            date_time;
@@ -299,6 +308,16 @@ typedef struct {
 
 typedef struct ngx_http_addr_conf_s  ngx_http_addr_conf_t;
 
+typedef struct {
+    ngx_connection_t                 *connection;
+    ngx_buf_t                        *buf;
+    ngx_event_t                      *event;
+    ngx_msec_t                        send_timeout;
+    unsigned                          queued:1;
+    unsigned                          blocked:1;
+} ngx_http_output_batch_t;
+
+
 typedef struct {
     ngx_http_addr_conf_t             *addr_conf;
     ngx_http_conf_ctx_t              *conf_ctx;
@@ -315,8 +334,15 @@ typedef struct {
 
     ngx_chain_t                      *free;
 
+    ngx_http_output_batch_t          *batch;
+
+#if (NGX_HAVE_SO_MAX_PACING_RATE)
+    size_t                            pacing_rate;
+#endif
+
     unsigned                          ssl:1;
     unsigned                          proxy_protocol:1;
+    unsigned                          pacing_error:1;
 } ngx_http_connection_t;
 
 
@@ -15,6 +15,8 @@ static ngx_int_t ngx_http_send_error_page(ngx_http_request_t *r,
     ngx_http_err_page_t *err_page);
 static ngx_int_t ngx_http_send_special_response(ngx_http_request_t *r,
     ngx_http_core_loc_conf_t *clcf, ngx_uint_t err);
+static ngx_int_t ngx_http_send_error_response(ngx_http_request_t *r,
+    ngx_http_core_loc_conf_t *clcf, ngx_uint_t err);
 static ngx_int_t ngx_http_send_refresh(ngx_http_request_t *r);
 
 
@@ -395,6 +397,26 @@ static ngx_str_t ngx_http_error_pages[] = {
 };
 
 
+#define NGX_HTTP_ERROR_PAGES                                                  \
+    (sizeof(ngx_http_error_pages) / sizeof(ngx_str_t))
+
+
+/* indexed by the "server_tokens" value */
+
+static ngx_str_t ngx_http_error_servers[] = {
+    ngx_string("Server: nginx" CRLF),
+    ngx_string("Server: " NGINX_VER CRLF),
+    ngx_string("Server: " NGINX_VER_BUILD CRLF)
+};
+
+
+static ngx_str_t ngx_http_error_tails[] = {
+    ngx_string(ngx_http_error_tail),
+    ngx_string(ngx_http_error_full_tail),
+    ngx_string(ngx_http_error_build_tail)
+};
+
+
 ngx_int_t
 ngx_http_special_response_handler(ngx_http_request_t *r, ngx_int_t error)
 {
@@ -651,6 +673,14 @@ ngx_http_send_special_response(ngx_http_request_t *r,
     ngx_uint_t    msie_padding;
     ngx_chain_t   out[3];
 
+    if (clcf->preformatted_errors) {
+        rc = ngx_http_send_error_response(r, clcf, err);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
         len = sizeof(ngx_http_error_full_tail) - 1;
         tail = ngx_http_error_full_tail;
@@ -755,6 +785,210 @@ ngx_http_send_special_response(ngx_http_request_t *r,
 }
 
 
+ngx_int_t
+ngx_http_init_error_responses(ngx_conf_t *cf)
+{
+    u_char                     *p;
+    size_t                      len;
+    ngx_str_t                  *status_line, *page, *server, *tail;
+    ngx_uint_t                  err, status, tokens, keepalive;
+    ngx_http_error_response_t  *er;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    if (cmcf->error_responses) {
+        return NGX_OK;
+    }
+
+    er = ngx_pcalloc(cf->pool, 3 * 2 * NGX_HTTP_ERROR_PAGES
+                               * sizeof(ngx_http_error_response_t));
+    if (er == NULL) {
+        return NGX_ERROR;
+    }
+
+    cmcf->error_responses = er;
+
+    /*
+     * the 4XX and 5XX responses are formatted for each "server_tokens"
+     * value and for both keepalive and closed connections, only the date
+     * is changed at run time; the nginx specific 49X codes are not
+     * preformatted as they are sent with the 400 status
+     */
+
+    for (tokens = 0; tokens < 3; tokens++) {
+
+        server = &ngx_http_error_servers[tokens];
+        tail = &ngx_http_error_tails[tokens];
+
+        for (keepalive = 0; keepalive < 2; keepalive++) {
+
+            for (err = NGX_HTTP_OFF_4XX; err < NGX_HTTP_ERROR_PAGES; err++) {
+
+                page = &ngx_http_error_pages[err];
+
+                if (page->len == 0) {
+                    continue;
+                }
+
+                if (err < NGX_HTTP_OFF_5XX) {
+                    status = err - NGX_HTTP_OFF_4XX + NGX_HTTP_BAD_REQUEST;
+
+                } else {
+                    status = err - NGX_HTTP_OFF_5XX + NGX_HTTP_NGINX_CODES;
+                }
+
+                if (status < NGX_HTTP_INTERNAL_SERVER_ERROR
+                    && status >= NGX_HTTP_NGINX_CODES)
+                {
+                    continue;
+                }
+
+                status_line = ngx_http_status_line(status);
+                if (status_line == NULL) {
+                    continue;
+                }
+
+                len = sizeof("HTTP/1.x ") - 1 + status_line->len
+                      + sizeof(CRLF) - 1
+                      + server->len
+                      + sizeof("Date: Mon, 28 Sep 1970 06:00:00 GMT" CRLF) - 1
+                      + sizeof("Content-Type: text/html" CRLF) - 1
+                      + sizeof("Content-Length: ") - 1 + NGX_SIZE_T_LEN
+                      + sizeof(CRLF) - 1
+                      + sizeof("Connection: keep-alive" CRLF) - 1
+                      + sizeof(CRLF) - 1
+                      + page->len + tail->len;
+
+                p = ngx_pnalloc(cf->pool, len);
+                if (p == NULL) {
+                    return NGX_ERROR;
+                }
+
+                er[err].response.data = p;
+
+                p = ngx_cpymem(p, "HTTP/1.1 ", sizeof("HTTP/1.x ") - 1);
+                p = ngx_cpymem(p, status_line->data, status_line->len);
+                *p++ = CR; *p++ = LF;
+
+                p = ngx_cpymem(p, server->data, server->len);
+
+                p = ngx_cpymem(p, "Date: ", sizeof("Date: ") - 1);
+                er[err].date = p - er[err].response.data;
+                p = ngx_cpymem(p, "Mon, 28 Sep 1970 06:00:00 GMT" CRLF,
+                         sizeof("Mon, 28 Sep 1970 06:00:00 GMT" CRLF) - 1);
+
+                p = ngx_cpymem(p, "Content-Type: text/html" CRLF,
+                               sizeof("Content-Type: text/html" CRLF) - 1);
+
+                p = ngx_sprintf(p, "Content-Length: %uz" CRLF,
+                                page->len + tail->len);
+
+                if (keepalive) {
+                    p = ngx_cpymem(p, "Connection: keep-alive" CRLF,
+                                   sizeof("Connection: keep-alive" CRLF) - 1);
+
+                } else {
+                    p = ngx_cpymem(p, "Connection: close" CRLF,
+                                   sizeof("Connection: close" CRLF) - 1);
+                }
+
+                *p++ = CR; *p++ = LF;
+
+                er[err].header_size = p - er[err].response.data;
+
+                p = ngx_cpymem(p, page->data, page->len);
+                p = ngx_cpymem(p, tail->data, tail->len);
+
+                er[err].response.len = p - er[err].response.data;
+            }
+
+            er += NGX_HTTP_ERROR_PAGES;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_send_error_response(ngx_http_request_t *r,
+    ngx_http_core_loc_conf_t *clcf, ngx_uint_t err)
+{
+    ngx_buf_t                  *b;
+    ngx_chain_t                 out;
+    ngx_http_error_response_t  *er;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    /*
+     * the preformatted response is passed directly to the write filter,
+     * so it is used only if the response has no additional headers
+     */
+
+    if (r != r->main
+        || r->post_action
+        || r->header_sent
+        || r->http_version < NGX_HTTP_VERSION_10
+        || (r->keepalive && clcf->keepalive_header)
+        || (clcf->msie_padding && (r->headers_in.msie || r->headers_in.chrome))
+        || r->headers_out.headers.part.nelts
+        || r->headers_out.headers.part.next
+#if (NGX_HTTP_V2)
+        || r->stream
+#endif
+       )
+    {
+        return NGX_DECLINED;
+    }
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    er = &cmcf->error_responses[(clcf->server_tokens * 2 + r->keepalive)
+                                * NGX_HTTP_ERROR_PAGES + err];
+
+    if (er->response.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    b = ngx_create_temp_buf(r->pool, er->response.len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->pos, er->response.data, er->response.len);
+
+    ngx_memcpy(b->pos + er->date, ngx_cached_http_time.data,
+               ngx_cached_http_time.len);
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+        b->last = b->pos + er->header_size;
+    }
+
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = r->err_status;
+    r->headers_out.status_line.len = 0;
+
+    r->headers_out.content_length_n = er->response.len - er->header_size;
+    r->headers_out.content_type_len = sizeof("text/html") - 1;
+    ngx_str_set(&r->headers_out.content_type, "text/html");
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->header_sent = 1;
+    r->header_size = er->header_size;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http preformatted response: %ui", r->err_status);
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_write_filter(r, &out);
+}
+
+
 static ngx_int_t
 ngx_http_send_refresh(ngx_http_request_t *r)
 {
@@ -10,6 +10,13 @@
 #include <ngx_http.h>
 
 
+/* responses seen before hedging, and after which older ones weigh less */
+#define NGX_HTTP_UPSTREAM_HEDGE_SAMPLES  20
+#define NGX_HTTP_UPSTREAM_HEDGE_WINDOW   1000
+
+#define NGX_HTTP_UPSTREAM_RETRY_WINDOW   10000
+
+
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -17,10 +24,22 @@ static ngx_int_t ngx_http_upstream_cache_get(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_http_file_cache_t **cache);
 static ngx_int_t ngx_http_upstream_cache_send(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_pack_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_buf_t *b);
+static ngx_int_t ngx_http_upstream_cache_unpack_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_background_update(
     ngx_http_request_t *r, ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_cache_partial_range(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_upstream_cache_partial_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_partial_validate(
+    ngx_http_request_t *r, ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_cache_partial_prefix(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_last_modified(ngx_http_request_t *r,
@@ -164,6 +183,8 @@ static ngx_int_t ngx_http_upstream_response_time_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_response_length_variable(
     ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_header_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
@@ -172,6 +193,43 @@ static ngx_int_t ngx_http_upstream_cookie_variable(ngx_http_request_t *r,
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_retry_budget(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+static ngx_int_t ngx_http_upstream_enqueue(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_dequeue(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_queue_reinit(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_config(ngx_http_upstream_t *u);
+static void ngx_http_upstream_post_queue(ngx_http_upstream_srv_conf_t *uscf);
+#if !(NGX_WIN32)
+static void ngx_http_upstream_queue_wakeup_handler(ngx_cycle_t *cycle,
+    ngx_uint_t data);
+#endif
+
+static void ngx_http_upstream_hedge_arm(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_count(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_msec_t ms);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_resume(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_cancel(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t state);
+static void ngx_http_upstream_close_peer_connection(ngx_connection_t *c);
+static void ngx_http_upstream_retry_window(ngx_http_upstream_srv_conf_t *uscf);
+static ngx_int_t ngx_http_upstream_retry_allowed(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
 
 static ngx_int_t ngx_http_upstream_set_local(ngx_http_request_t *r,
   ngx_http_upstream_t *u, ngx_http_upstream_local_t *local);
@@ -338,6 +396,38 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("hedge"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hedge,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("retry_budget"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_retry_budget,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+#if (NGX_HTTP_CACHE)
+
+    { ngx_string("cache_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_file_cache_status_set_slot,
+      0,
+      0,
+      NULL },
+
+#endif
+
       ngx_null_command
 };
 
@@ -403,6 +493,10 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_response_length_variable, 1,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
+    { ngx_string("upstream_queue_time"), NULL,
+      ngx_http_upstream_queue_time_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
 #if (NGX_HTTP_CACHE)
 
     { ngx_string("upstream_cache_status"), NULL,
@@ -429,6 +523,16 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
 };
 
 
+#if !(NGX_WIN32)
+
+/* other workers announce peers freed while requests are queued */
+
+static ngx_uint_t             ngx_http_upstream_queue_wakeup;
+static ngx_wakeup_handler_pt  ngx_http_upstream_next_wakeup_handler;
+
+#endif
+
+
 static ngx_http_upstream_next_t  ngx_http_upstream_next_errors[] = {
     { 500, NGX_HTTP_UPSTREAM_FT_HTTP_500 },
     { 502, NGX_HTTP_UPSTREAM_FT_HTTP_502 },
@@ -787,6 +891,13 @@ found:
         u->peer.tries = u->conf->next_upstream_tries;
     }
 
+    ngx_http_upstream_queue_config(u);
+
+    if (uscf->retry_budget) {
+        ngx_http_upstream_retry_window(uscf);
+        uscf->retry_requests[0]++;
+    }
+
     ngx_http_upstream_connect(r, u);
 }
 
@@ -796,6 +907,7 @@ found:
 static ngx_int_t
 ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
+    off_t                   block;
     ngx_int_t               rc;
     ngx_http_cache_t       *c;
     ngx_http_file_cache_t  *cache;
@@ -866,6 +978,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
 
+        if (u->conf->cache_partial) {
+            ngx_http_upstream_cache_partial_range(r, c);
+        }
+
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
 
@@ -907,6 +1023,46 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         u->cache_status = NGX_HTTP_CACHE_HIT;
     }
 
+    if (rc == NGX_OK && c->bitmap_len) {
+
+        rc = ngx_http_file_cache_partial_test(r);
+
+        switch (rc) {
+
+        case NGX_HTTP_CACHE_SCARCE:
+
+            /* another request fills the entry, the response is not cached */
+
+            u->cache_status = NGX_HTTP_CACHE_MISS;
+            break;
+
+        case NGX_DECLINED:
+
+            /* the validity comes from the response for the missing blocks */
+
+            c->valid_sec = 0;
+            c->updating_sec = 0;
+            c->error_sec = 0;
+
+            if ((c->etag.len && c->etag.data[0] == '"')
+                || c->last_modified != -1)
+            {
+                /* the missing blocks are added to the cache file */
+
+                u->cache_status = NGX_HTTP_CACHE_MISS;
+                break;
+            }
+
+            /* no validator for "If-Range", the entry is replaced */
+
+            c->partial_store = 0;
+            c->partial_update = 0;
+
+            u->cache_status = NGX_HTTP_CACHE_MISS;
+            break;
+        }
+    }
+
     switch (rc) {
 
     case NGX_OK:
@@ -920,6 +1076,21 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->error_sec = 0;
 
         u->buffer.start = NULL;
+
+        if (c->bitmap_len) {
+
+            /*
+             * a partial entry may have holes, so it is neither revalidated
+             * nor sent as a stale response, it is a miss
+             */
+
+            c->last_modified = -1;
+            ngx_str_null(&c->etag);
+
+            u->cache_status = NGX_HTTP_CACHE_MISS;
+            break;
+        }
+
         u->cache_status = NGX_HTTP_CACHE_EXPIRED;
 
         break;
@@ -959,7 +1130,25 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return rc;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+    if (c->partial) {
+
+        if (u->cacheable && !c->partial_update) {
+
+            /* the blocks covering the range are requested */
+
+            c->block = u->conf->cache_partial;
+            block = (off_t) c->block;
+
+            c->partial_start = c->range_start / block * block;
+            c->partial_end = (c->range_end == -1)
+                             ? -1 : (c->range_end / block + 1) * block - 1;
+            c->partial_store = 1;
+
+            c->last_modified = -1;
+            ngx_str_null(&c->etag);
+        }
+
+    } else if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
         u->cacheable = 0;
     }
 
@@ -1042,7 +1231,12 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return NGX_ERROR;
     }
 
-    rc = u->process_header(r);
+    if (c->parsed) {
+        rc = ngx_http_upstream_cache_unpack_headers(r, u);
+
+    } else {
+        rc = u->process_header(r);
+    }
 
     if (rc == NGX_OK) {
 
@@ -1050,6 +1244,22 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->bitmap_len) {
+
+            /* a partial entry is sent as a whole response to range filter */
+
+            r->headers_out.status = NGX_HTTP_OK;
+            r->headers_out.status_line.len = 0;
+            r->headers_out.content_length_n = c->length - c->body_start;
+
+            if (r->headers_out.content_range) {
+                r->headers_out.content_range->hash = 0;
+                r->headers_out.content_range = NULL;
+            }
+
+            r->allow_ranges = 1;
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -1065,6 +1275,260 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
 }
 
 
+/*
+ * the upstream response header is stored in the cache already parsed,
+ * so a cache hit does not parse the status line and header lines again
+ */
+
+static ngx_int_t
+ngx_http_upstream_cache_pack_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_buf_t *b)
+{
+    size_t                              size;
+    u_char                             *p, *start;
+    ngx_uint_t                          i, n;
+    ngx_list_part_t                    *part;
+    ngx_table_elt_t                    *h;
+    ngx_http_cache_t                   *c;
+    ngx_http_file_cache_headers_t       hs;
+    ngx_http_file_cache_header_t       *fh;
+    ngx_http_file_cache_header_line_t   hl;
+
+    c = r->cache;
+
+    if (c->header_start == c->body_start
+        || u->headers_in.status_line.len >= NGX_HTTP_FILE_CACHE_NULL_VALUE)
+    {
+        return NGX_OK;
+    }
+
+    size = sizeof(ngx_http_file_cache_headers_t)
+           + u->headers_in.status_line.len;
+    n = 0;
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len >= NGX_HTTP_FILE_CACHE_NULL_VALUE
+            || h[i].value.len >= NGX_HTTP_FILE_CACHE_NULL_VALUE)
+        {
+            return NGX_OK;
+        }
+
+        size += sizeof(ngx_http_file_cache_header_line_t)
+                + 2 * (h[i].key.len + 1);
+
+        if (h[i].value.data) {
+            size += h[i].value.len + 1;
+        }
+
+        n++;
+    }
+
+    if (c->partial_store) {
+        size += c->bitmap_len;
+    }
+
+    /* the header is read into a buffer of the upstream buffer size */
+
+    if (c->header_start + size > u->conf->buffer_size
+        || n >= NGX_HTTP_FILE_CACHE_NULL_VALUE)
+    {
+        return NGX_OK;
+    }
+
+    start = ngx_palloc(r->pool, c->header_start + size);
+    if (start == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(start, b->pos, c->header_start);
+
+    ngx_memzero(&hs, sizeof(ngx_http_file_cache_headers_t));
+    ngx_memzero(&hl, sizeof(ngx_http_file_cache_header_line_t));
+
+    hs.content_length_n = u->headers_in.content_length_n;
+    hs.status = (u_short) u->headers_in.status_n;
+    hs.status_line_len = (u_short) u->headers_in.status_line.len;
+    hs.nelts = (u_short) n;
+
+    p = ngx_cpymem(p, &hs, sizeof(ngx_http_file_cache_headers_t));
+    p = ngx_cpymem(p, u->headers_in.status_line.data,
+                   u->headers_in.status_line.len);
+
+    part = &u->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        hl.hash = h[i].hash;
+        hl.key_len = (u_short) h[i].key.len;
+        hl.value_len = h[i].value.data ? (u_short) h[i].value.len
+                                       : NGX_HTTP_FILE_CACHE_NULL_VALUE;
+
+        p = ngx_cpymem(p, &hl, sizeof(ngx_http_file_cache_header_line_t));
+
+        p = ngx_cpymem(p, h[i].key.data, h[i].key.len);
+        *p++ = '\0';
+
+        p = ngx_cpymem(p, h[i].lowcase_key, h[i].key.len);
+        *p++ = '\0';
+
+        if (h[i].value.data) {
+            p = ngx_cpymem(p, h[i].value.data, h[i].value.len);
+            *p++ = '\0';
+        }
+    }
+
+    if (c->partial_store) {
+
+        /* no blocks are present yet */
+
+        ngx_memzero(p, c->bitmap_len);
+        p += c->bitmap_len;
+    }
+
+    c->body_start = c->header_start + size;
+    c->parsed = 1;
+
+    fh = (ngx_http_file_cache_header_t *) start;
+    fh->body_start = (u_short) c->body_start;
+    fh->parsed = 1;
+
+    b->start = start;
+    b->pos = start;
+    b->last = p;
+    b->end = p;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache packed headers: %ui, %uz",
+                   n, size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_unpack_headers(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    u_char                             *p, *last;
+    ngx_uint_t                          i;
+    ngx_table_elt_t                    *h;
+    ngx_http_upstream_header_t         *hh;
+    ngx_http_file_cache_headers_t       hs;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_file_cache_header_line_t   hl;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    p = u->buffer.pos;
+    last = u->buffer.start + r->cache->body_start;
+
+    if ((size_t) (last - p) < sizeof(ngx_http_file_cache_headers_t)) {
+        goto invalid;
+    }
+
+    ngx_memcpy(&hs, p, sizeof(ngx_http_file_cache_headers_t));
+    p += sizeof(ngx_http_file_cache_headers_t);
+
+    if ((size_t) (last - p) < hs.status_line_len) {
+        goto invalid;
+    }
+
+    u->headers_in.status_n = hs.status;
+    u->headers_in.status_line.len = hs.status_line_len;
+    u->headers_in.status_line.data = p;
+
+    p += hs.status_line_len;
+
+    for (i = 0; i < hs.nelts; i++) {
+
+        if ((size_t) (last - p) < sizeof(ngx_http_file_cache_header_line_t)) {
+            goto invalid;
+        }
+
+        ngx_memcpy(&hl, p, sizeof(ngx_http_file_cache_header_line_t));
+        p += sizeof(ngx_http_file_cache_header_line_t);
+
+        if ((size_t) (last - p) < 2 * ((size_t) hl.key_len + 1)) {
+            goto invalid;
+        }
+
+        h = ngx_list_push(&u->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = hl.hash;
+
+        h->key.len = hl.key_len;
+        h->key.data = p;
+        p += hl.key_len + 1;
+
+        h->lowcase_key = p;
+        p += hl.key_len + 1;
+
+        if (hl.value_len == NGX_HTTP_FILE_CACHE_NULL_VALUE) {
+
+            /* the empty "Server" and "Date" added by the upstream module */
+
+            ngx_str_null(&h->value);
+            continue;
+        }
+
+        if ((size_t) (last - p) < (size_t) hl.value_len + 1) {
+            goto invalid;
+        }
+
+        h->value.len = hl.value_len;
+        h->value.data = p;
+        p += hl.value_len + 1;
+
+        hh = ngx_hash_find(&umcf->headers_in_hash, h->hash,
+                           h->lowcase_key, h->key.len);
+
+        if (hh && hh->handler(r, h, hh->offset) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    u->headers_in.content_length_n = hs.content_length_n;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "cache file \"%s\" has invalid parsed header",
+                  r->cache->file.name.data);
+
+    return NGX_HTTP_UPSTREAM_INVALID_HEADER;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
     ngx_http_upstream_t *u)
@@ -1137,22 +1601,306 @@ ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
     return NGX_OK;
 }
 
-#endif
-
 
 static void
-ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+ngx_http_upstream_cache_partial_range(ngx_http_request_t *r,
+    ngx_http_cache_t *c)
 {
-    ngx_connection_t              *c;
-    ngx_http_request_t            *r;
-    ngx_http_upstream_t           *u;
-    ngx_http_upstream_resolved_t  *ur;
+    off_t                      start, end, cutoff, cutlim;
+    u_char                    *p, *last;
+    ngx_table_elt_t           *h;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    r = ctx->data;
-    c = r->connection;
+    h = r->headers_in.range;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    u = r->upstream;
-    ur = u->resolved;
+    /*
+     * only a single range, "bytes=N-" or "bytes=N-M", is cached partially;
+     * a partial entry is sent only if the range filter cuts the range out,
+     * otherwise all its blocks are needed
+     */
+
+    if (h == NULL
+        || clcf->max_ranges == 0
+        || r != r->main
+        || r->method != NGX_HTTP_GET
+        || r->headers_in.if_range
+        || h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return;
+    }
+
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
+
+    p = h->value.data + 6;
+    last = h->value.data + h->value.len;
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p == last || *p < '0' || *p > '9') {
+        return;
+    }
+
+    start = 0;
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (start >= cutoff && (start > cutoff || *p - '0' > cutlim)) {
+            return;
+        }
+
+        start = start * 10 + (*p++ - '0');
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    if (p == last || *p++ != '-') {
+        return;
+    }
+
+    while (p < last && *p == ' ') { p++; }
+
+    end = -1;
+
+    if (p < last) {
+
+        if (*p < '0' || *p > '9') {
+            return;
+        }
+
+        end = 0;
+
+        while (p < last && *p >= '0' && *p <= '9') {
+            if (end >= cutoff && (end > cutoff || *p - '0' > cutlim)) {
+                return;
+            }
+
+            end = end * 10 + (*p++ - '0');
+        }
+
+        while (p < last && *p == ' ') { p++; }
+
+        if (p != last || end < start) {
+            return;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache partial range: %O-%O", start, end);
+
+    c->partial = 1;
+    c->range_start = start;
+    c->range_end = end;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_partial_response(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    off_t              start, end, length, need;
+    u_char            *p, *dash, *slash, *last;
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (u->headers_in.status_n != NGX_HTTP_PARTIAL_CONTENT) {
+
+        /* the whole response is cached as usual */
+
+        if (c->partial_update) {
+            c->valid_sec = 0;
+            c->updating_sec = 0;
+            c->error_sec = 0;
+        }
+
+        c->partial_store = 0;
+        c->partial_update = 0;
+        c->bitmap_len = 0;
+
+        return NGX_OK;
+    }
+
+    h = r->headers_out.content_range;
+
+    if (h == NULL
+        || h->value.len < 6
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes ", 6) != 0)
+    {
+        goto invalid;
+    }
+
+    p = h->value.data + 6;
+    last = h->value.data + h->value.len;
+
+    dash = ngx_strlchr(p, last, '-');
+    if (dash == NULL) {
+        goto invalid;
+    }
+
+    slash = ngx_strlchr(dash, last, '/');
+    if (slash == NULL) {
+        goto invalid;
+    }
+
+    start = ngx_atoof(p, dash - p);
+    end = ngx_atoof(dash + 1, slash - dash - 1);
+    length = ngx_atoof(slash + 1, last - slash - 1);
+
+    if (start == NGX_ERROR || end == NGX_ERROR || length == NGX_ERROR
+        || start > end || end >= length)
+    {
+        goto invalid;
+    }
+
+    need = (c->range_end == -1 || c->range_end >= length)
+           ? length - 1 : c->range_end;
+
+    if (start != c->partial_start || end < need) {
+        goto invalid;
+    }
+
+    if (c->partial_update) {
+
+        if (length != c->partial_length) {
+            goto invalid;
+        }
+
+        if (ngx_http_upstream_cache_partial_validate(r, u) != NGX_OK) {
+            ngx_http_file_cache_partial_invalidate(r);
+            return NGX_ERROR;
+        }
+
+    } else {
+        c->partial_length = length;
+        c->bitmap_len = ((length + c->block - 1) / c->block + 7) / 8;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache partial response: %O-%O/%O",
+                   start, end, length);
+
+    /* the range filter cuts the requested range out of the whole response */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.status_line.len = 0;
+    r->headers_out.content_length_n = length;
+
+    if (c->partial_update && c->range_start < c->partial_start) {
+        r->headers_out.content_offset = c->range_start;
+
+    } else {
+        r->headers_out.content_offset = start;
+    }
+
+    h->hash = 0;
+    r->headers_out.content_range = NULL;
+
+    r->allow_ranges = 1;
+    r->single_range = 1;
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "upstream sent unexpected \"Content-Range\" "
+                  "for a partially cached response");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_partial_validate(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_table_elt_t   *h;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    /*
+     * the blocks must come from the same version of the resource,
+     * even if the server ignored "If-Range"
+     */
+
+    if (c->etag.len && c->etag.data[0] == '"') {
+        h = r->headers_out.etag;
+
+        if (h == NULL
+            || h->value.len != c->etag.len
+            || ngx_strncmp(h->value.data, c->etag.data, c->etag.len) != 0)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "etag mismatch in partially cached response");
+            return NGX_ERROR;
+        }
+    }
+
+    if (c->last_modified != -1
+        && r->headers_out.last_modified_time != c->last_modified)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "last-modified mismatch in partially cached response");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_partial_prefix(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    /* the blocks already cached before the first missing one */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->file_pos = c->body_start + c->range_start;
+    b->file_last = c->body_start + c->partial_start;
+
+    b->in_file = 1;
+    b->file = &c->file;
+
+    out.buf = b;
+    out.next = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream cache partial prefix: %O-%O",
+                   b->file_pos, b->file_last);
+
+    return ngx_http_output_filter(r, &out);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_resolved_t  *ur;
+
+    r = ctx->data;
+    c = r->connection;
+
+    u = r->upstream;
+    ur = u->resolved;
 
     ngx_http_set_log_request(c->log, r);
 
@@ -1462,6 +2210,9 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ngx_int_t          rc;
     ngx_connection_t  *c;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_str_t         *name;
+#endif
 
     r->connection->log->action = "connecting to upstream";
 
@@ -1493,19 +2244,77 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
         return;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /*
+     * a server removed at runtime is freed along with its name when
+     * its last connection is released, while the request still logs it
+     */
+
+    if (u->peer.name && u->upstream && u->upstream->shm_zone) {
+        name = ngx_palloc(r->pool, sizeof(ngx_str_t) + u->peer.name->len);
+        if (name == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        name->len = u->peer.name->len;
+        name->data = (u_char *) (name + 1);
+        ngx_memcpy(name->data, u->peer.name->data, name->len);
+
+        u->peer.name = name;
+    }
+
+#endif
+
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
+
+        if (u->hedge) {
+
+            /* there is no other server to hedge to */
+
+            r->upstream_states->nelts--;
+            u->state = NULL;
+
+            ngx_http_upstream_hedge_resume(r, u);
+            return;
+        }
+
+        if (ngx_http_upstream_enqueue(r, u) == NGX_OK) {
+            return;
+        }
+
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
     }
 
+    if (u->queued) {
+        ngx_http_upstream_dequeue(r, u);
+    }
+
     if (rc == NGX_DECLINED) {
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
         return;
     }
 
+    if (u->hedge
+        && ngx_cmp_sockaddr(u->peer.sockaddr, u->peer.socklen,
+                            u->hedge_peer.sockaddr, u->hedge_peer.socklen, 1)
+           == NGX_OK)
+    {
+        /* the balancer picked the slow server again */
+
+        r->upstream_states->nelts--;
+        u->state = NULL;
+
+        ngx_http_upstream_hedge_cancel(r, u);
+        return;
+    }
+
     /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
 
     c = u->peer.connection;
@@ -1675,249 +2484,1004 @@ ngx_http_upstream_ssl_init_connection(ngx_http_request_t *r,
             ngx_add_timer(c->write, u->conf->connect_timeout);
         }
 
-        c->ssl->handler = ngx_http_upstream_ssl_handshake;
-        return;
+        c->ssl->handler = ngx_http_upstream_ssl_handshake;
+        return;
+    }
+
+    ngx_http_upstream_ssl_handshake(c);
+}
+
+
+static void
+ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
+{
+    long                  rc;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    r = c->data;
+    u = r->upstream;
+
+    ngx_http_set_log_request(c->log, r);
+
+    if (c->ssl->handshaked) {
+
+        if (u->conf->ssl_verify) {
+            rc = SSL_get_verify_result(c->ssl->connection);
+
+            if (rc != X509_V_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream SSL certificate verify error: (%l:%s)",
+                              rc, X509_verify_cert_error_string(rc));
+                goto failed;
+            }
+
+            if (ngx_ssl_check_host(c, &u->ssl_name) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream SSL certificate does not match \"%V\"",
+                              &u->ssl_name);
+                goto failed;
+            }
+        }
+
+        if (u->conf->ssl_session_reuse) {
+            u->peer.save_session(&u->peer, u->peer.data);
+        }
+
+        c->write->handler = ngx_http_upstream_handler;
+        c->read->handler = ngx_http_upstream_handler;
+
+        c = r->connection;
+
+        ngx_http_upstream_send_request(r, u, 1);
+
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    if (c->write->timedout) {
+        c = r->connection;
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+failed:
+
+    c = r->connection;
+
+    ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_connection_t *c)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+
+    if (u->conf->ssl_name) {
+        if (ngx_http_complex_value(r, u->conf->ssl_name, &name) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        name = u->ssl_name;
+    }
+
+    if (name.len == 0) {
+        goto done;
+    }
+
+    /*
+     * ssl name here may contain port, notably if derived from $proxy_host
+     * or $http_host; we have to strip it
+     */
+
+    p = name.data;
+    last = name.data + name.len;
+
+    if (*p == '[') {
+        p = ngx_strlchr(p, last, ']');
+
+        if (p == NULL) {
+            p = name.data;
+        }
+    }
+
+    p = ngx_strlchr(p, last, ':');
+
+    if (p != NULL) {
+        name.len = p - name.data;
+    }
+
+    if (!u->conf->ssl_server_name) {
+        goto done;
+    }
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (name.len == 0 || *name.data == '[') {
+        goto done;
+    }
+
+    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
+        goto done;
+    }
+
+    /*
+     * SSL_set_tlsext_host_name() needs a null-terminated string,
+     * hence we explicitly null-terminate name here
+     */
+
+    p = ngx_pnalloc(r->pool, name.len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(p, name.data, name.len + 1);
+
+    name.data = p;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "upstream SSL server name: \"%s\"", name.data);
+
+    if (SSL_set_tlsext_host_name(c->ssl->connection,
+                                 (char *) name.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
+        return NGX_ERROR;
+    }
+
+#endif
+
+done:
+
+    u->ssl_name = name;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    off_t         file_pos;
+    ngx_chain_t  *cl;
+
+    if (u->reinit_request(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->keepalive = 0;
+    u->upgrade = 0;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* reinit the request chain */
+
+    file_pos = 0;
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+
+        /* there is at most one file */
+
+        if (cl->buf->in_file) {
+            cl->buf->file_pos = file_pos;
+            file_pos = cl->buf->file_last;
+        }
+    }
+
+    /* reinit the subrequest's ngx_output_chain() context */
+
+    if (r->request_body && r->request_body->temp_file
+        && r != r->main && u->output.buf)
+    {
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
+            return NGX_ERROR;
+        }
+
+        u->output.free->buf = u->output.buf;
+        u->output.free->next = NULL;
+
+        u->output.buf->pos = u->output.buf->start;
+        u->output.buf->last = u->output.buf->start;
+    }
+
+    u->output.buf = NULL;
+    u->output.in = NULL;
+    u->output.busy = NULL;
+
+    /* reinit u->buffer */
+
+    u->buffer.pos = u->buffer.start;
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        u->buffer.pos += r->cache->header_start;
+    }
+
+#endif
+
+    u->buffer.last = u->buffer.pos;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_enqueue(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    uscf = u->upstream;
+
+    if (uscf == NULL || uscf->queue_max == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (!u->queued) {
+        peers = uscf->peer.data;
+
+        if (uscf->queue_len >= uscf->queue_max) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream queue is full");
+
+            (void) ngx_atomic_fetch_add(&peers->queue_overflows, 1);
+
+            return NGX_DECLINED;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream enqueue: %ui", uscf->queue_len);
+
+        ngx_queue_insert_tail(&uscf->queue, &u->queue);
+        uscf->queue_len++;
+
+        (void) ngx_atomic_fetch_add(&peers->queued, 1);
+
+        u->queued = 1;
+        u->queue_start = ngx_current_msec;
+
+        u->queue_event.handler = ngx_http_upstream_queue_handler;
+        u->queue_event.data = r;
+        u->queue_event.log = r->connection->log;
+
+        ngx_add_timer(&u->queue_event, uscf->queue_timeout);
+
+#if !(NGX_WIN32)
+        if (!ngx_http_upstream_queue_wakeup) {
+            ngx_http_upstream_queue_wakeup = 1;
+            ngx_http_upstream_next_wakeup_handler = ngx_wakeup_handler;
+            ngx_wakeup_handler = ngx_http_upstream_queue_wakeup_handler;
+        }
+#endif
+
+    } else {
+
+        /*
+         * the request was woken up and failed again: it yields its place,
+         * so a request which cannot get a peer does not block the others
+         */
+
+        ngx_queue_remove(&u->queue);
+        ngx_queue_insert_tail(&uscf->queue, &u->queue);
+    }
+
+    /* the state is pushed again by the next attempt */
+
+    r->upstream_states->nelts--;
+    u->state = NULL;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_dequeue(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream dequeue");
+
+    uscf = u->upstream;
+    peers = uscf->peer.data;
+
+    ngx_queue_remove(&u->queue);
+    uscf->queue_len--;
+
+    (void) ngx_atomic_fetch_add(&peers->queued, -1);
+
+    u->queued = 0;
+    u->queue_time += ngx_current_msec - u->queue_start;
+
+    if (u->queue_event.timer_set) {
+        ngx_del_timer(&u->queue_event);
+    }
+
+    if (u->queue_event.posted) {
+        ngx_delete_posted_event(&u->queue_event);
+    }
+}
+
+
+static void
+ngx_http_upstream_queue_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream queue handler, timedout: %d", ev->timedout);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream queue timed out");
+
+        peers = u->upstream->peer.data;
+        (void) ngx_atomic_fetch_add(&peers->queue_timeouts, 1);
+
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+
+    } else if (ngx_http_upstream_queue_reinit(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+
+    } else {
+        ngx_http_upstream_connect(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_queue_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                     tries;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    uscf = u->upstream;
+    peers = uscf->peer.data;
+
+    if (peers->config == NULL || u->queue_config == *peers->config) {
+        return NGX_OK;
+    }
+
+    /*
+     * servers were changed at runtime while the request was queued,
+     * the balancer data no longer match them and are created again
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream queue reinit");
+
+    tries = u->peer.tries;
+
+    u->peer.data = NULL;
+
+    if (uscf->peer.init(r, uscf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (u->peer.tries > tries) {
+        u->peer.tries = tries;
+    }
+
+    ngx_http_upstream_queue_config(u);
+#endif
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_queue_config(ngx_http_upstream_t *u)
+{
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (u->upstream->queue_max == 0) {
+        return;
+    }
+
+    peers = u->upstream->peer.data;
+
+    if (peers->config) {
+        u->queue_config = *peers->config;
+    }
+#endif
+}
+
+
+void
+ngx_http_upstream_wakeup_queue(ngx_http_upstream_srv_conf_t *uscf)
+{
+#if (NGX_HTTP_UPSTREAM_ZONE && !(NGX_WIN32))
+    ngx_http_upstream_rr_peers_t  *peers;
+#endif
+
+    if (uscf->queue_max == 0) {
+        return;
+    }
+
+    ngx_http_upstream_post_queue(uscf);
+
+#if (NGX_HTTP_UPSTREAM_ZONE && !(NGX_WIN32))
+
+    /*
+     * with a zone, peers are shared, so a freed peer is announced
+     * to other workers if they have more requests waiting for it
+     * than this one, which otherwise keeps the peer for its own queue
+     */
+
+    peers = uscf->peer.data;
+
+    if (peers->shpool && peers->queued > 2 * uscf->queue_len) {
+        ngx_wakeup_worker_processes((ngx_cycle_t *) ngx_cycle,
+                                    (ngx_uint_t) uscf);
+    }
+
+#endif
+}
+
+
+static void
+ngx_http_upstream_post_queue(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_queue_t          *q;
+    ngx_http_upstream_t  *u;
+
+    /*
+     * the first request not yet woken up retries, if it fails again,
+     * it moves to the end of the queue
+     */
+
+    for (q = ngx_queue_head(&uscf->queue);
+         q != ngx_queue_sentinel(&uscf->queue);
+         q = ngx_queue_next(q))
+    {
+        u = ngx_queue_data(q, ngx_http_upstream_t, queue);
+
+        if (!u->queue_event.posted) {
+            ngx_post_event(&u->queue_event, &ngx_posted_events);
+            return;
+        }
+    }
+}
+
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_upstream_queue_wakeup_handler(ngx_cycle_t *cycle, ngx_uint_t data)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t  **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cycle->log, 0,
+                   "http upstream queue wakeup");
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf) {
+        uscfp = umcf->upstreams.elts;
+
+        for (i = 0; i < umcf->upstreams.nelts; i++) {
+            if ((ngx_uint_t) uscfp[i] == data && uscfp[i]->queue_len) {
+                ngx_http_upstream_post_queue(uscfp[i]);
+                break;
+            }
+        }
+    }
+
+    if (ngx_http_upstream_next_wakeup_handler) {
+        ngx_http_upstream_next_wakeup_handler(cycle, data);
+    }
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_hedge_arm(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_msec_t                     delay;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = u->upstream;
+
+    /*
+     * only requests which are safe to send twice are hedged, and only
+     * once enough responses are seen to estimate the delay
+     */
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || r->request_body_no_buffering
+        || u->peer.tries < 2
+        || uscf->hedge_samples < NGX_HTTP_UPSTREAM_HEDGE_SAMPLES)
+    {
+        return;
+    }
+
+    delay = ngx_http_upstream_time_percentile(uscf->hedge_hist,
+                                              uscf->hedge_samples,
+                                              uscf->hedge);
+
+    if (delay < uscf->hedge_delay) {
+        delay = uscf->hedge_delay;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge in %M", delay);
+
+    u->hedge_event.handler = ngx_http_upstream_hedge_handler;
+    u->hedge_event.data = r;
+    u->hedge_event.log = r->connection->log;
+
+    ngx_add_timer(&u->hedge_event, delay);
+}
+
+
+static void
+ngx_http_upstream_hedge_count(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_msec_t ms)
+{
+    ngx_uint_t  i;
+
+    ngx_http_upstream_count_time(uscf->hedge_hist, ms);
+
+    if (++uscf->hedge_samples < NGX_HTTP_UPSTREAM_HEDGE_WINDOW) {
+        return;
+    }
+
+    /* older responses weigh less */
+
+    uscf->hedge_samples = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_TIME_BUCKETS; i++) {
+        uscf->hedge_hist[i] /= 2;
+        uscf->hedge_samples += uscf->hedge_hist[i];
+    }
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_uint_t            tries;
+    ngx_connection_t     *c, *pc;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    r = ev->data;
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge handler");
+
+    if (ngx_http_upstream_retry_allowed(r, u) != NGX_OK) {
+        return;
+    }
+
+    if (u->state->bytes_received) {
+
+        /* the response has started, the attempts share the buffer */
+
+        return;
+    }
+
+    pc = u->peer.connection;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "upstream is slow to respond, hedging the request");
+
+    /*
+     * the first attempt waits for the response aside and keeps its peer
+     * until it is known which attempt loses, the second attempt gets
+     * its own balancer data
+     */
+
+    u->hedged = 1;
+    u->hedge = pc;
+    u->hedge_peer = u->peer;
+    u->hedge_start = u->state->response_time;
+    u->hedge_connect_time = u->state->connect_time;
+
+    tries = u->peer.tries;
+
+    u->peer.data = NULL;
+    u->peer.sockaddr = NULL;
+    u->peer.connection = NULL;
+
+    if (u->upstream->peer.init(r, u->upstream) != NGX_OK) {
+        u->peer = u->hedge_peer;
+        u->hedge = NULL;
+        return;
+    }
+
+    if (u->peer.tries > tries) {
+        u->peer.tries = tries;
+    }
+
+    pc->read->handler = ngx_http_upstream_hedge_peer_handler;
+    pc->write->handler = ngx_http_upstream_hedge_peer_handler;
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev)
+{
+    u_char                buf[1];
+    ssize_t               n;
+    ngx_err_t             err;
+    ngx_connection_t     *c;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
+
+    c = ev->data;
+    r = c->data;
+    u = r->upstream;
+
+    if (ev->write) {
+        return;
+    }
+
+    ngx_http_set_log_request(r->connection->log, r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge peer handler, timedout: %d",
+                   ev->timedout);
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
+                      "hedged upstream timed out");
+
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
+    }
+
+    /* the first attempt wins only if it really responds */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    if (n == -1 && err == NGX_EAGAIN) {
+
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        }
+
+        return;
+    }
+
+    if (n <= 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, n == 0 ? 0 : err,
+                      "hedged upstream prematurely closed connection");
+
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_FAILED);
+        return;
+    }
+
+    if (u->state && u->state->bytes_received) {
+
+        /* the hedged attempt has started to respond, it is kept */
+
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_NEXT);
+        return;
+    }
+
+    /* the first attempt responds first, the hedged one is cancelled */
+
+    ngx_http_upstream_hedge_cancel(r, u);
+
+    ngx_http_run_posted_requests(r->connection);
+}
+
+
+static void
+ngx_http_upstream_hedge_cancel(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge cancel");
+
+    if (u->peer.free && u->peer.sockaddr) {
+        u->peer.free(&u->peer, u->peer.data, NGX_PEER_NEXT);
+        u->peer.sockaddr = NULL;
+    }
+
+    if (u->peer.connection) {
+        ngx_http_upstream_close_peer_connection(u->peer.connection);
+        u->peer.connection = NULL;
     }
 
-    ngx_http_upstream_ssl_handshake(c);
+    ngx_http_upstream_hedge_resume(r, u);
 }
 
 
 static void
-ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
+ngx_http_upstream_hedge_resume(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    long                  rc;
-    ngx_http_request_t   *r;
-    ngx_http_upstream_t  *u;
+    ngx_connection_t  *c;
 
-    r = c->data;
-    u = r->upstream;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge resume");
 
-    ngx_http_set_log_request(c->log, r);
+    c = u->hedge;
+    u->hedge = NULL;
 
-    if (c->ssl->handshaked) {
+    /* the first attempt continues with its own peer and balancer data */
 
-        if (u->conf->ssl_verify) {
-            rc = SSL_get_verify_result(c->ssl->connection);
+    u->peer = u->hedge_peer;
 
-            if (rc != X509_V_OK) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream SSL certificate verify error: (%l:%s)",
-                              rc, X509_verify_cert_error_string(rc));
-                goto failed;
-            }
+    if (u->state && u->state->response_time) {
+        u->state->response_time = ngx_current_msec - u->state->response_time;
+    }
 
-            if (ngx_ssl_check_host(c, &u->ssl_name) != NGX_OK) {
-                ngx_log_error(NGX_LOG_ERR, c->log, 0,
-                              "upstream SSL certificate does not match \"%V\"",
-                              &u->ssl_name);
-                goto failed;
-            }
-        }
+    u->state = ngx_array_push(r->upstream_states);
+    if (u->state == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
 
-        if (u->conf->ssl_session_reuse) {
-            u->peer.save_session(&u->peer, u->peer.data);
-        }
+    ngx_memzero(u->state, sizeof(ngx_http_upstream_state_t));
 
-        c->write->handler = ngx_http_upstream_handler;
-        c->read->handler = ngx_http_upstream_handler;
+    u->state->response_time = u->hedge_start;
+    u->state->connect_time = u->hedge_connect_time;
+    u->state->header_time = (ngx_msec_t) -1;
+    u->state->peer = u->peer.name;
 
-        c = r->connection;
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
 
-        ngx_http_upstream_send_request(r, u, 1);
+    u->read_event_handler = ngx_http_upstream_process_header;
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
 
-        ngx_http_run_posted_requests(c);
-        return;
-    }
+    /*
+     * the hedged attempt may have read a part of its response, the response
+     * of the first attempt is parsed from the start
+     */
 
-    if (c->write->timedout) {
-        c = r->connection;
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
-        ngx_http_run_posted_requests(c);
+    if (ngx_http_upstream_reinit(r, u) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
         return;
     }
 
-failed:
-
-    c = r->connection;
-
-    ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+    u->writer.connection = c;
+    u->request_sent = 1;
+    u->request_body_sent = 1;
 
-    ngx_http_run_posted_requests(c);
+    if (c->read->ready) {
+        ngx_http_upstream_process_header(r, u);
+    }
 }
 
 
-static ngx_int_t
-ngx_http_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_connection_t *c)
+static void
+ngx_http_upstream_hedge_close(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t state)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
+    ngx_connection_t           *c;
+    ngx_http_upstream_state_t   hs, *us;
 
-    if (u->conf->ssl_name) {
-        if (ngx_http_complex_value(r, u->conf->ssl_name, &name) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "close hedged upstream connection: %d", u->hedge->fd);
 
-    } else {
-        name = u->ssl_name;
-    }
+    c = u->hedge;
+    u->hedge = NULL;
 
-    if (name.len == 0) {
-        goto done;
-    }
+    /* the response is incomplete, so the connection is never kept alive */
+
+    u->hedge_peer.connection = NULL;
 
     /*
-     * ssl name here may contain port, notably if derived from $proxy_host
-     * or $http_host; we have to strip it
+     * the balancer samples the attempt from the upstream state, so
+     * it is given the one of the first attempt while the peer is freed
      */
 
-    p = name.data;
-    last = name.data + name.len;
-
-    if (*p == '[') {
-        p = ngx_strlchr(p, last, ']');
+    ngx_memzero(&hs, sizeof(ngx_http_upstream_state_t));
 
-        if (p == NULL) {
-            p = name.data;
-        }
-    }
+    hs.response_time = u->hedge_start;
+    hs.connect_time = u->hedge_connect_time;
+    hs.header_time = (ngx_msec_t) -1;
 
-    p = ngx_strlchr(p, last, ':');
+    us = u->state;
+    u->state = &hs;
 
-    if (p != NULL) {
-        name.len = p - name.data;
+    if (u->hedge_peer.free && u->hedge_peer.sockaddr) {
+        u->hedge_peer.free(&u->hedge_peer, u->hedge_peer.data, state);
+        u->hedge_peer.sockaddr = NULL;
     }
 
-    if (!u->conf->ssl_server_name) {
-        goto done;
-    }
+    u->state = us;
 
-#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    ngx_http_upstream_close_peer_connection(c);
+}
 
-    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
 
-    if (name.len == 0 || *name.data == '[') {
-        goto done;
-    }
+static void
+ngx_http_upstream_close_peer_connection(ngx_connection_t *c)
+{
+#if (NGX_HTTP_SSL)
 
-    if (ngx_inet_addr(name.data, name.len) != INADDR_NONE) {
-        goto done;
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        (void) ngx_ssl_shutdown(c);
     }
 
-    /*
-     * SSL_set_tlsext_host_name() needs a null-terminated string,
-     * hence we explicitly null-terminate name here
-     */
+#endif
 
-    p = ngx_pnalloc(r->pool, name.len + 1);
-    if (p == NULL) {
-        return NGX_ERROR;
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
     }
 
-    (void) ngx_cpystrn(p, name.data, name.len + 1);
+    ngx_close_connection(c);
+}
 
-    name.data = p;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "upstream SSL server name: \"%s\"", name.data);
+static void
+ngx_http_upstream_retry_window(ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_msec_t  elapsed;
 
-    if (SSL_set_tlsext_host_name(c->ssl->connection,
-                                 (char *) name.data)
-        == 0)
-    {
-        ngx_ssl_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "SSL_set_tlsext_host_name(\"%s\") failed", name.data);
-        return NGX_ERROR;
-    }
+    elapsed = ngx_current_msec - uscf->retry_window;
 
-#endif
+    if (elapsed < NGX_HTTP_UPSTREAM_RETRY_WINDOW) {
+        return;
+    }
 
-done:
+    if (elapsed < 2 * NGX_HTTP_UPSTREAM_RETRY_WINDOW) {
+        uscf->retry_requests[1] = uscf->retry_requests[0];
+        uscf->retry_retries[1] = uscf->retry_retries[0];
 
-    u->ssl_name = name;
+    } else {
+        uscf->retry_requests[1] = 0;
+        uscf->retry_retries[1] = 0;
+    }
 
-    return NGX_OK;
+    uscf->retry_requests[0] = 0;
+    uscf->retry_retries[0] = 0;
+    uscf->retry_window = ngx_current_msec;
 }
 
-#endif
-
 
 static ngx_int_t
-ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_retry_allowed(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    off_t         file_pos;
-    ngx_chain_t  *cl;
+    ngx_msec_t                     left;
+    ngx_uint_t                     requests, retries;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-    if (u->reinit_request(r) != NGX_OK) {
-        return NGX_ERROR;
+    uscf = u->upstream;
+
+    if (uscf == NULL || uscf->retry_budget == 0) {
+        return NGX_OK;
     }
 
-    u->keepalive = 0;
-    u->upgrade = 0;
+    ngx_http_upstream_retry_window(uscf);
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
-    u->headers_in.content_length_n = -1;
-    u->headers_in.last_modified_time = -1;
+    /*
+     * the previous window is counted in proportion to its part
+     * in the sliding window
+     */
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
+    left = NGX_HTTP_UPSTREAM_RETRY_WINDOW
+           - (ngx_current_msec - uscf->retry_window);
+
+    requests = uscf->retry_requests[0]
+               + uscf->retry_requests[1] * left
+                 / NGX_HTTP_UPSTREAM_RETRY_WINDOW;
+
+    retries = uscf->retry_retries[0]
+              + uscf->retry_retries[1] * left
+                / NGX_HTTP_UPSTREAM_RETRY_WINDOW;
+
+    if (retries >= uscf->retry_min * (NGX_HTTP_UPSTREAM_RETRY_WINDOW / 1000)
+                   + requests * uscf->retry_budget / 100)
     {
-        return NGX_ERROR;
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "upstream retry budget exhausted");
+        return NGX_DECLINED;
     }
 
-    /* reinit the request chain */
+    uscf->retry_retries[0]++;
 
-    file_pos = 0;
+    return NGX_OK;
+}
 
-    for (cl = u->request_bufs; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
 
-        /* there is at most one file */
+void
+ngx_http_upstream_count_time(ngx_uint_t *times, ngx_msec_t ms)
+{
+    ngx_uint_t  n;
 
-        if (cl->buf->in_file) {
-            cl->buf->file_pos = file_pos;
-            file_pos = cl->buf->file_last;
-        }
+    for (n = 0; ms && n < NGX_HTTP_UPSTREAM_TIME_BUCKETS - 1; n++) {
+        ms >>= 1;
     }
 
-    /* reinit the subrequest's ngx_output_chain() context */
-
-    if (r->request_body && r->request_body->temp_file
-        && r != r->main && u->output.buf)
-    {
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            return NGX_ERROR;
-        }
+    times[n]++;
+}
 
-        u->output.free->buf = u->output.buf;
-        u->output.free->next = NULL;
 
-        u->output.buf->pos = u->output.buf->start;
-        u->output.buf->last = u->output.buf->start;
-    }
+ngx_msec_t
+ngx_http_upstream_time_percentile(ngx_uint_t *times, ngx_uint_t n,
+    ngx_uint_t percentile)
+{
+    ngx_uint_t  i, rank, count;
+    ngx_msec_t  low, high;
 
-    u->output.buf = NULL;
-    u->output.in = NULL;
-    u->output.busy = NULL;
+    /*
+     * the bucket i holds times from 2^(i-1) to 2^i milliseconds,
+     * the percentile is interpolated within its bucket
+     */
 
-    /* reinit u->buffer */
+    rank = (n * percentile + 99) / 100;
+    count = 0;
 
-    u->buffer.pos = u->buffer.start;
+    for (i = 0; i < NGX_HTTP_UPSTREAM_TIME_BUCKETS - 1; i++) {
 
-#if (NGX_HTTP_CACHE)
+        if (count + times[i] >= rank) {
+            break;
+        }
 
-    if (r->cache) {
-        u->buffer.pos += r->cache->header_start;
+        count += times[i];
     }
 
-#endif
+    low = i ? (ngx_msec_t) 1 << (i - 1) : 0;
+    high = (ngx_msec_t) 1 << i;
 
-    u->buffer.last = u->buffer.pos;
+    if (times[i] == 0) {
+        return low;
+    }
 
-    return NGX_OK;
+    return low + (high - low) * (rank - count) / times[i];
 }
 
 
@@ -2003,6 +3567,10 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     ngx_add_timer(c->read, u->conf->read_timeout);
 
+    if (u->upstream && u->upstream->hedge && !u->hedged) {
+        ngx_http_upstream_hedge_arm(r, u);
+    }
+
     if (c->read->ready) {
         ngx_http_upstream_process_header(r, u);
         return;
@@ -2275,6 +3843,17 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n;
 
+        if (u->hedge_event.timer_set) {
+            ngx_del_timer(&u->hedge_event);
+        }
+
+        if (u->hedge) {
+
+            /* the hedged attempt responds first, the other one is cancelled */
+
+            ngx_http_upstream_hedge_close(r, u, NGX_PEER_NEXT);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -2315,6 +3894,10 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->state->header_time = ngx_current_msec - u->state->response_time;
 
+    if (u->upstream && u->upstream->hedge) {
+        ngx_http_upstream_hedge_count(u->upstream, u->state->header_time);
+    }
+
     if (u->headers_in.status_n >= NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (ngx_http_upstream_test_next(r, u) == NGX_OK) {
@@ -2829,6 +4412,18 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache
+        && r->cache->partial_store
+        && ngx_http_upstream_cache_partial_response(r, u) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+#endif
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
@@ -2838,6 +4433,23 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->header_sent = 1;
 
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache
+        && r->cache->partial_update
+        && r->cache->range_start < r->cache->partial_start
+        && !r->header_only)
+    {
+        rc = ngx_http_upstream_cache_partial_prefix(r, u);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, rc);
+            return;
+        }
+    }
+
+#endif
+
     if (u->upgrade) {
 
 #if (NGX_HTTP_CACHE)
@@ -2955,7 +4567,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_CACHE)
 
-    if (r->cache && r->cache->file.fd != NGX_INVALID_FILE) {
+    if (r->cache
+        && r->cache->file.fd != NGX_INVALID_FILE
+        && !r->cache->partial_update)
+    {
         ngx_pool_run_cleanup_file(r->pool, r->cache->file.fd);
         r->cache->file.fd = NGX_INVALID_FILE;
     }
@@ -2994,15 +4609,22 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         if (valid == 0) {
             valid = ngx_http_file_cache_valid(u->conf->cache_valid,
-                                              u->headers_in.status_n);
+                                              r->cache->partial_store
+                                              ? NGX_HTTP_OK
+                                              : u->headers_in.status_n);
             if (valid) {
                 r->cache->valid_sec = now + valid;
             }
         }
 
-        if (valid) {
+        if (r->cache->partial_update) {
+
+            /* the header of the cache file is kept as is */
+
+        } else if (valid) {
             r->cache->date = now;
             r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
+            r->cache->parsed = 0;
 
             if (u->headers_in.status_n == NGX_HTTP_OK
                 || u->headers_in.status_n == NGX_HTTP_PARTIAL_CONTENT)
@@ -3077,7 +4699,8 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #if (NGX_HTTP_CACHE)
         if (r->cache && !r->cache->file_cache->use_temp_path) {
-            p->temp_file->path = r->cache->file_cache->path;
+            p->temp_file->path =
+                          r->cache->file_cache->stripes[r->cache->stripe].path;
             p->temp_file->file.name = r->cache->file.name;
         }
 #endif
@@ -3122,6 +4745,49 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
         p->buf_to_file->pos = u->buffer.start;
         p->buf_to_file->last = u->buffer.pos;
         p->buf_to_file->temporary = 1;
+
+#if (NGX_HTTP_CACHE)
+
+        if (r->cache
+            && !r->cache->partial_update
+            && ngx_http_upstream_cache_pack_headers(r, u, p->buf_to_file)
+               != NGX_OK)
+        {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        if (r->cache && r->cache->partial_store) {
+
+            if (!r->cache->partial_update && !r->cache->parsed) {
+
+                /* no room for the block bitmap in the header */
+
+                u->cacheable = 0;
+                p->cacheable = u->store;
+                p->temp_file->persistent = u->store;
+                p->buf_to_file = NULL;
+
+                ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else {
+
+                /* the blocks are written at their offsets in the file */
+
+                if (ngx_http_file_cache_partial_open(r, p->temp_file,
+                                                     p->buf_to_file->pos)
+                    != NGX_OK)
+                {
+                    ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                    return;
+                }
+
+                p->buf_to_file = NULL;
+                u->cache_partial = 1;
+            }
+        }
+
+#endif
     }
 
     if (ngx_event_flags & NGX_USE_IOCP_EVENT) {
@@ -3928,7 +5594,12 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
         if (u->cacheable) {
 
-            if (p->upstream_done) {
+            if (p->upstream_done
+                || (u->cache_partial
+                    && (p->upstream_eof || p->upstream_error)))
+            {
+                /* a partial response keeps the blocks received completely */
+
                 ngx_http_file_cache_update(r, p->temp_file);
 
             } else if (p->upstream_eof) {
@@ -4084,6 +5755,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http next upstream, %xi", ft_type);
 
+    if (u->hedge_event.timer_set) {
+        ngx_del_timer(&u->hedge_event);
+    }
+
     if (u->peer.sockaddr) {
 
         if (ft_type == NGX_HTTP_UPSTREAM_FT_HTTP_403
@@ -4148,6 +5823,19 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
 
     u->state->status = status;
 
+    if (u->hedge) {
+
+        /* the hedged attempt failed, the first one is still in progress */
+
+        if (u->peer.connection) {
+            ngx_http_upstream_close_peer_connection(u->peer.connection);
+            u->peer.connection = NULL;
+        }
+
+        ngx_http_upstream_hedge_resume(r, u);
+        return;
+    }
+
     timeout = u->conf->next_upstream_timeout;
 
     if (u->request_sent
@@ -4159,7 +5847,8 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     if (u->peer.tries == 0
         || ((u->conf->next_upstream & ft_type) != ft_type)
         || (u->request_sent && r->request_body_no_buffering)
-        || (timeout && ngx_current_msec - u->peer.start_time >= timeout))
+        || (timeout && ngx_current_msec - u->peer.start_time >= timeout)
+        || ngx_http_upstream_retry_allowed(r, u) != NGX_OK)
     {
 #if (NGX_HTTP_CACHE)
 
@@ -4240,6 +5929,18 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->queued) {
+        ngx_http_upstream_dequeue(r, u);
+    }
+
+    if (u->hedge_event.timer_set) {
+        ngx_del_timer(&u->hedge_event);
+    }
+
+    if (u->hedge) {
+        ngx_http_upstream_hedge_close(r, u, NGX_PEER_NEXT);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -4331,6 +6032,18 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
             }
         }
 
+        if (!r->cached && !r->cache_updater && u->state
+            && (u->cache_status == NGX_HTTP_CACHE_MISS
+                || u->cache_status == NGX_HTTP_CACHE_EXPIRED))
+        {
+            ngx_http_file_cache_account(r->cache, 0,
+                                        u->state->response_length);
+        }
+
+        if (u->cache_partial) {
+            ngx_http_file_cache_update(r, u->pipe->temp_file);
+        }
+
         ngx_http_file_cache_free(r->cache, u->pipe->temp_file);
     }
 
@@ -5479,6 +7192,44 @@ ngx_http_upstream_response_length_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_queue_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char               *p;
+    ngx_msec_int_t        ms;
+    ngx_http_upstream_t  *u;
+
+    u = r->upstream;
+
+    if (u == NULL || u->upstream == NULL || u->upstream->queue_max == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_TIME_T_LEN + 4);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ms = u->queue_time;
+
+    if (u->queued) {
+        ms += ngx_current_msec - u->queue_start;
+    }
+
+    ms = ngx_max(ms, 0);
+
+    v->len = ngx_sprintf(p, "%T.%03M", (time_t) ms / 1000, ms % 1000) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_header_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -5634,7 +7385,8 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                                          |NGX_HTTP_UPSTREAM_DOWN
-                                         |NGX_HTTP_UPSTREAM_BACKUP);
+                                         |NGX_HTTP_UPSTREAM_BACKUP
+                                         |NGX_HTTP_UPSTREAM_SLOW_START);
     if (uscf == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -5734,6 +7486,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_url_t                    u;
     ngx_int_t                    weight, max_conns, max_fails;
     ngx_uint_t                   i;
+    ngx_msec_t                   slow_start;
     ngx_http_upstream_server_t  *us;
 
     us = ngx_array_push(uscf->servers);
@@ -5749,6 +7502,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     max_conns = 0;
     max_fails = 1;
     fail_timeout = 10;
+    slow_start = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -5815,6 +7569,24 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "slow_start=", 11) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_SLOW_START)) {
+                goto not_supported;
+            }
+
+            s.len = value[i].len - 11;
+            s.data = &value[i].data[11];
+
+            slow_start = ngx_parse_time(&s, 0);
+
+            if (slow_start == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         if (ngx_strcmp(value[i].data, "backup") == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_BACKUP)) {
@@ -5837,6 +7609,27 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            us->service.len = value[i].len - 8;
+            us->service.data = &value[i].data[8];
+
+            if (us->service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+#endif
+
         goto invalid;
     }
 
@@ -5845,6 +7638,24 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u.url = value[1];
     u.default_port = 80;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (us->service.len) {
+
+        if (!us->resolve) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" requires "
+                               "\"resolve\" parameter", &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        /* addresses of a service are only known from SRV records */
+
+        u.no_resolve = 1;
+    }
+
+#endif
+
     if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
         if (u.err) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
@@ -5854,6 +7665,39 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (us->resolve) {
+
+        if (u.family == AF_UNIX
+            || u.url.data[0] == '['
+            || ngx_inet_addr(u.host.data, u.host.len) != INADDR_NONE)
+        {
+            if (us->service.len) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "service upstream \"%V\" requires "
+                                   "domain name", &u.url);
+                return NGX_CONF_ERROR;
+            }
+
+            /* addresses never change */
+
+            us->resolve = 0;
+
+        } else if (us->service.len && !u.no_port) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" may not have port",
+                               &u.url);
+            return NGX_CONF_ERROR;
+
+        } else {
+            us->host = u.host;
+            us->port = u.port;
+        }
+    }
+
+#endif
+
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
@@ -5861,6 +7705,7 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->max_conns = max_conns;
     us->max_fails = max_fails;
     us->fail_timeout = fail_timeout;
+    us->slow_start = slow_start;
 
     return NGX_CONF_OK;
 
@@ -5881,6 +7726,178 @@ not_supported:
 }
 
 
+static char *
+ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_msec_t   timeout;
+
+    if (uscf->queue_max) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    timeout = 60000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "timeout=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = &value[2].data[8];
+
+        timeout = ngx_parse_time(&s, 0);
+
+        if (timeout == (ngx_msec_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf->queue_max = n;
+    uscf->queue_timeout = timeout;
+
+    ngx_queue_init(&uscf->queue);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_hedge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+    ngx_msec_t   delay;
+
+    if (uscf->hedge) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    uscf->hedge = 95;
+    uscf->hedge_delay = 10;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "percentile=", 11) == 0) {
+
+            n = ngx_atoi(value[i].data + 11, value[i].len - 11);
+
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                goto invalid;
+            }
+
+            uscf->hedge = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min_delay=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            delay = ngx_parse_time(&s, 0);
+
+            if (delay == (ngx_msec_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            uscf->hedge_delay = delay;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_retry_budget(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+
+    if (uscf->retry_budget) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    s = value[1];
+
+    if (s.len && s.data[s.len - 1] == '%') {
+        s.len--;
+    }
+
+    n = ngx_atoi(s.data, s.len);
+
+    if (n == NGX_ERROR || n == 0 || n > 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->retry_budget = n;
+    uscf->retry_min = 1;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "min=", 4) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atoi(value[2].data + 4, value[2].len - 4);
+
+        if (n == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        uscf->retry_min = n;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 ngx_http_upstream_srv_conf_t *
 ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
 {
@@ -99,8 +99,13 @@ typedef struct {
     time_t                           fail_timeout;
     ngx_msec_t                       slow_start;
 
+    ngx_str_t                        host;
+    in_port_t                        port;
+    ngx_str_t                        service;
+
     unsigned                         down:1;
     unsigned                         backup:1;
+    unsigned                         resolve:1;
 
     NGX_COMPAT_BEGIN(6)
     NGX_COMPAT_END
@@ -113,9 +118,26 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT  0x0008
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
+#define NGX_HTTP_UPSTREAM_SLOW_START    0x0040
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
 
 
+/* response times are counted in power of two milliseconds */
+
+#define NGX_HTTP_UPSTREAM_TIME_BUCKETS  20
+
+
+typedef struct {
+    ngx_msec_t                       interval;
+    ngx_msec_t                       ejection_time;
+    ngx_uint_t                       percentile;
+    ngx_uint_t                       latency;  /* factor * 100 */
+    ngx_uint_t                       errors;
+    ngx_uint_t                       min_requests;
+    ngx_uint_t                       max_ejected;
+} ngx_http_upstream_outlier_t;
+
+
 struct ngx_http_upstream_srv_conf_s {
     ngx_http_upstream_peer_t         peer;
     void                           **srv_conf;
@@ -129,8 +151,33 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
 
+    ngx_uint_t                       queue_max;
+    ngx_msec_t                       queue_timeout;
+
+    /* requests of this worker waiting for a peer */
+    ngx_queue_t                      queue;
+    ngx_uint_t                       queue_len;
+
+    ngx_uint_t                       hedge;  /* percentile */
+    ngx_msec_t                       hedge_delay;
+
+    /* response header times seen by this worker */
+    ngx_uint_t                       hedge_hist[NGX_HTTP_UPSTREAM_TIME_BUCKETS];
+    ngx_uint_t                       hedge_samples;
+
+    ngx_uint_t                       retry_budget;  /* percent */
+    ngx_uint_t                       retry_min;
+
+    /* requests and retries of this worker, current and previous window */
+    ngx_uint_t                       retry_requests[2];
+    ngx_uint_t                       retry_retries[2];
+    ngx_msec_t                       retry_window;
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
+    ngx_resolver_t                  *resolver;
+    ngx_msec_t                       resolver_timeout;
+    ngx_http_upstream_outlier_t     *outlier;
 #endif
 };
 
@@ -206,6 +253,8 @@ typedef struct {
     ngx_flag_t                       cache_convert_head;
     ngx_flag_t                       cache_background_update;
 
+    size_t                           cache_partial;
+
     ngx_array_t                     *cache_valid;
     ngx_array_t                     *cache_bypass;
     ngx_array_t                     *cache_purge;
@@ -364,6 +413,18 @@ struct ngx_http_upstream_s {
 
     ngx_http_upstream_state_t       *state;
 
+    ngx_queue_t                      queue;
+    ngx_event_t                      queue_event;
+    ngx_msec_t                       queue_start;
+    ngx_msec_t                       queue_time;
+    ngx_uint_t                       queue_config;
+
+    ngx_event_t                      hedge_event;
+    ngx_connection_t                *hedge;
+    ngx_peer_connection_t            hedge_peer;
+    ngx_msec_t                       hedge_start;
+    ngx_msec_t                       hedge_connect_time;
+
     ngx_str_t                        method;
     ngx_str_t                        schema;
     ngx_str_t                        uri;
@@ -380,6 +441,7 @@ struct ngx_http_upstream_s {
     unsigned                         ssl:1;
 #if (NGX_HTTP_CACHE)
     unsigned                         cache_status:3;
+    unsigned                         cache_partial:1;
 #endif
 
     unsigned                         buffering:1;
@@ -389,6 +451,8 @@ struct ngx_http_upstream_s {
     unsigned                         request_sent:1;
     unsigned                         request_body_sent:1;
     unsigned                         header_sent:1;
+    unsigned                         queued:1;
+    unsigned                         hedged:1;
 };
 
 
@@ -409,6 +473,10 @@ ngx_int_t ngx_http_upstream_create(ngx_http_request_t *r);
 void ngx_http_upstream_init(ngx_http_request_t *r);
 ngx_http_upstream_srv_conf_t *ngx_http_upstream_add(ngx_conf_t *cf,
     ngx_url_t *u, ngx_uint_t flags);
+void ngx_http_upstream_wakeup_queue(ngx_http_upstream_srv_conf_t *uscf);
+void ngx_http_upstream_count_time(ngx_uint_t *times, ngx_msec_t ms);
+ngx_msec_t ngx_http_upstream_time_percentile(ngx_uint_t *times, ngx_uint_t n,
+    ngx_uint_t percentile);
 char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
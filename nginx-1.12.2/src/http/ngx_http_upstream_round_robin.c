@@ -13,9 +13,26 @@
 #define ngx_http_upstream_tries(p) ((p)->number                               \
                                     + ((p)->next ? (p)->next->number : 0))
 
+/*
+ * weights are scaled in the smooth weighted round-robin balancing,
+ * so that the weight of a peer in slow start grows gradually even if
+ * the configured weight is 1
+ */
+
+#define NGX_HTTP_UPSTREAM_RR_SCALE  100
+
 
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
+static ngx_int_t ngx_http_upstream_rr_peer_weight(
+    ngx_http_upstream_rr_peer_t *peer);
+#if (NGX_HTTP_UPSTREAM_ZONE)
+static void ngx_http_upstream_rr_peer_sample(
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t state);
+#endif
+static void ngx_http_upstream_rr_peer_release(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
 
 #if (NGX_HTTP_SSL)
 
@@ -32,7 +49,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n, w;
+    ngx_uint_t                     i, j, n, w, r;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
@@ -44,6 +61,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
         n = 0;
         w = 0;
+        r = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
             if (server[i].backup) {
@@ -52,9 +70,12 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
+            r |= server[i].resolve;
         }
 
-        if (n == 0) {
+        /* servers resolved at run time may have no addresses yet */
+
+        if (n == 0 && !r) {
             ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
                           "no servers in upstream \"%V\" in %s:%ui",
                           &us->host, us->file_name, us->line);
@@ -95,6 +116,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
 
@@ -110,6 +132,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
         n = 0;
         w = 0;
+        r = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
             if (!server[i].backup) {
@@ -118,9 +141,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
             n += server[i].naddrs;
             w += server[i].naddrs * server[i].weight;
+            r |= server[i].resolve;
         }
 
-        if (n == 0) {
+        if (n == 0 && !r) {
             return NGX_OK;
         }
 
@@ -159,6 +183,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
 
@@ -258,10 +283,27 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
         r->upstream->peer.data = rrp;
     }
 
+    rrp->request = r;
+    rrp->upstream = us;
     rrp->peers = us->peer.data;
     rrp->current = NULL;
     rrp->config = 0;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /*
+     * the tried bitmap is sized for the current peers; if servers are
+     * added or removed at runtime, the configuration number changes
+     * and the request stops using the bitmap
+     */
+
+    if (rrp->peers->config) {
+        rrp->config = *rrp->peers->config;
+        ngx_memory_barrier();
+    }
+
+#endif
+
     n = rrp->peers->number;
 
     if (rrp->peers->next && rrp->peers->next->number > n) {
@@ -383,6 +425,8 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
         }
     }
 
+    rrp->request = r;
+    rrp->upstream = NULL;
     rrp->peers = peers;
     rrp->current = NULL;
     rrp->config = 0;
@@ -432,10 +476,16 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     peers = rrp->peers;
     ngx_http_upstream_rr_peers_wlock(peers);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (peers->config && rrp->config != *peers->config) {
+        goto busy;
+    }
+#endif
+
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down || peer->ejected) {
             goto failed;
         }
 
@@ -494,8 +544,18 @@ failed:
         }
 
         ngx_http_upstream_rr_peers_wlock(peers);
+
+        rrp->peers = peers;
     }
 
+    /* a queued request retries with all the primary servers */
+
+    ngx_http_upstream_rr_peers_reset_tried(rrp);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+busy:
+#endif
+
     ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
@@ -504,12 +564,44 @@ failed:
 }
 
 
+void
+ngx_http_upstream_rr_peers_reset_tried(ngx_http_upstream_rr_peer_data_t *rrp)
+{
+    ngx_uint_t                     i, n;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = rrp->peers;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /* the bitmap is sized for the configuration the request started with */
+
+    if (peers->config && rrp->config != *peers->config) {
+        return;
+    }
+
+#endif
+
+    n = peers->number;
+
+    if (peers->next && peers->next->number > n) {
+        n = peers->next->number;
+    }
+
+    n = (n + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+
+    for (i = 0; i < n; i++) {
+        rrp->tried[i] = 0;
+    }
+}
+
+
 static ngx_http_upstream_rr_peer_t *
 ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
 {
     time_t                        now;
     uintptr_t                     m;
-    ngx_int_t                     total;
+    ngx_int_t                     w, total;
     ngx_uint_t                    i, n, p;
     ngx_http_upstream_rr_peer_t  *peer, *best;
 
@@ -533,7 +625,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down || peer->ejected) {
             continue;
         }
 
@@ -548,8 +640,10 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
-        total += peer->effective_weight;
+        w = ngx_http_upstream_rr_peer_weight(peer);
+
+        peer->current_weight += w;
+        total += w;
 
         if (peer->effective_weight < peer->weight) {
             peer->effective_weight++;
@@ -582,6 +676,35 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
 }
 
 
+static ngx_int_t
+ngx_http_upstream_rr_peer_weight(ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t       w;
+    ngx_msec_int_t  elapsed;
+
+    w = peer->effective_weight * NGX_HTTP_UPSTREAM_RR_SCALE;
+
+    if (peer->start_time == 0) {
+        return w;
+    }
+
+    /* the start time may be set by a worker whose clock is a bit ahead */
+
+    elapsed = (ngx_msec_int_t) (ngx_current_msec - peer->start_time);
+
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+
+    if ((ngx_msec_t) elapsed >= peer->slow_start) {
+        peer->start_time = 0;
+        return w;
+    }
+
+    return (ngx_int_t) ((uint64_t) w * elapsed / peer->slow_start);
+}
+
+
 void
 ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
@@ -603,11 +726,13 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     if (rrp->peers->single) {
 
-        peer->conns--;
-
-        ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
+        ngx_http_upstream_rr_peer_release(rrp->peers, peer);
         ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
+        if (rrp->upstream) {
+            ngx_http_upstream_wakeup_queue(rrp->upstream);
+        }
+
         pc->tries = 0;
         return;
     }
@@ -641,21 +766,125 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         /* mark peer live if check passed */
 
         if (peer->accessed < peer->checked) {
+
+            if (peer->max_fails && peer->fails >= peer->max_fails) {
+                ngx_http_upstream_rr_peer_start(peer);
+            }
+
             peer->fails = 0;
         }
     }
 
-    peer->conns--;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    if (rrp->upstream && rrp->upstream->outlier && rrp->peers->shpool) {
+        ngx_http_upstream_rr_peer_sample(rrp, peer, state);
+    }
+
+#endif
 
-    ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
+    ngx_http_upstream_rr_peer_release(rrp->peers, peer);
     ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
+    if (rrp->upstream) {
+        ngx_http_upstream_wakeup_queue(rrp->upstream);
+    }
+
     if (pc->tries) {
         pc->tries--;
     }
 }
 
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+static void
+ngx_http_upstream_rr_peer_sample(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t state)
+{
+    ngx_msec_t                  ms;
+    ngx_http_upstream_state_t  *us;
+
+    us = rrp->request->upstream->state;
+
+    if (us == NULL) {
+        return;
+    }
+
+    /*
+     * the time to the response header is sampled; an attempt failed
+     * before the header is sampled with the time spent, the response
+     * time still holds the start of the attempt at this point
+     */
+
+    if (us->header_time != (ngx_msec_t) -1) {
+        ms = us->header_time;
+
+    } else if (state & NGX_PEER_FAILED) {
+        ms = ngx_current_msec - us->response_time;
+
+    } else {
+        return;
+    }
+
+    ngx_http_upstream_count_time(peer->ol_times, ms);
+    peer->ol_requests++;
+
+    if ((state & NGX_PEER_FAILED)
+        || us->status >= NGX_HTTP_INTERNAL_SERVER_ERROR)
+    {
+        peer->ol_errors++;
+    }
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_rr_peer_release(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    peer->conns--;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /* a server removed at runtime is freed after its last connection */
+
+    if (peer->zombie && peer->conns == 0) {
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+        ngx_http_upstream_rr_peer_free(peers, peer);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+}
+
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+void
+ngx_http_upstream_rr_peer_free(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    /*
+     * the address, name and server strings of a peer in shared memory
+     * are allocated together with it
+     */
+
+#if (NGX_HTTP_SSL)
+    if (peer->ssl_session) {
+        ngx_slab_free(peers->shpool, peer->ssl_session);
+    }
+#endif
+
+    ngx_slab_free(peers->shpool, peer);
+}
+
+#endif
+
+
 #if (NGX_HTTP_SSL)
 
 ngx_int_t
@@ -40,6 +40,19 @@ struct ngx_http_upstream_rr_peer_s {
 
     ngx_uint_t                      down;
 
+    ngx_uint_t                      hc_down;
+    ngx_uint_t                      hc_fails;
+    ngx_uint_t                      hc_passes;
+    ngx_msec_t                      hc_next;
+
+    ngx_uint_t                      ewma;
+    ngx_msec_t                      ewma_stamp;
+
+    ngx_uint_t                      ol_requests;
+    ngx_uint_t                      ol_errors;
+    ngx_uint_t                      ol_times[NGX_HTTP_UPSTREAM_TIME_BUCKETS];
+    ngx_msec_t                      ejected;
+
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
@@ -47,6 +60,9 @@ struct ngx_http_upstream_rr_peer_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_atomic_t                    lock;
+    ngx_uint_t                      id;
+    unsigned                        drain:1;
+    unsigned                        zombie:1;
 #endif
 
     ngx_http_upstream_rr_peer_t    *next;
@@ -64,11 +80,16 @@ struct ngx_http_upstream_rr_peers_s {
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
+    ngx_uint_t                     *config;
     ngx_http_upstream_rr_peers_t   *zone_next;
 #endif
 
     ngx_uint_t                      total_weight;
 
+    ngx_atomic_t                    queued;
+    ngx_atomic_t                    queue_overflows;
+    ngx_atomic_t                    queue_timeouts;
+
     unsigned                        single:1;
     unsigned                        weighted:1;
 
@@ -124,8 +145,16 @@ struct ngx_http_upstream_rr_peers_s {
 #endif
 
 
+/* a peer put into service ramps its weight up during slow_start */
+
+#define ngx_http_upstream_rr_peer_start(peer)                                 \
+    (peer)->start_time = (peer)->slow_start ? ngx_current_msec : 0
+
+
 typedef struct {
     ngx_uint_t                      config;
+    ngx_http_request_t             *request;
+    ngx_http_upstream_srv_conf_t   *upstream;
     ngx_http_upstream_rr_peers_t   *peers;
     ngx_http_upstream_rr_peer_t    *current;
     uintptr_t                      *tried;
@@ -143,6 +172,13 @@ ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
     void *data);
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
+void ngx_http_upstream_rr_peers_reset_tried(
+    ngx_http_upstream_rr_peer_data_t *rrp);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+void ngx_http_upstream_rr_peer_free(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+#endif
 
 #if (NGX_HTTP_SSL)
 ngx_int_t
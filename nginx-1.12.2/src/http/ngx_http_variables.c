@@ -44,6 +44,11 @@ static ngx_int_t ngx_http_variable_cookie(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_variable_argument(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+#if (NGX_HAVE_SIOCOUTQNSD)
+static ngx_int_t ngx_http_variable_send_queue(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+#endif
+
 #if (NGX_HAVE_TCP_INFO)
 static ngx_int_t ngx_http_variable_tcpinfo(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -359,6 +364,14 @@ static ngx_http_variable_t  ngx_http_core_variables[] = {
       3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 #endif
 
+#if (NGX_HAVE_SIOCOUTQNSD)
+    { ngx_string("tcp_send_queue"), NULL, ngx_http_variable_send_queue,
+      SIOCOUTQ, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("tcp_notsent"), NULL, ngx_http_variable_send_queue,
+      SIOCOUTQNSD, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+#endif
+
     { ngx_string("http_"), NULL, ngx_http_variable_unknown_header_in,
       0, NGX_HTTP_VAR_PREFIX, 0 },
 
@@ -1279,6 +1292,46 @@ ngx_http_variable_tcpinfo(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 #endif
 
 
+#if (NGX_HAVE_SIOCOUTQNSD)
+
+static ngx_int_t
+ngx_http_variable_send_queue(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    int                n;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        c = r->stream->connection->connection;
+    }
+#endif
+
+    /* the bytes not acknowledged or, with SIOCOUTQNSD, not sent yet */
+
+    if (ioctl(c->fd, (int) data, &n) == -1) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->data = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (v->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(v->data, "%d", n) - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_variable_content_length(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
@@ -10,6 +10,16 @@
 #include <ngx_http.h>
 
 
+static ngx_int_t ngx_http_write_filter_notsent_lowat(ngx_http_request_t *r,
+    size_t lowat);
+#if (NGX_HAVE_SO_MAX_PACING_RATE)
+static ngx_int_t ngx_http_write_filter_pacing(ngx_http_request_t *r);
+#endif
+static ngx_int_t ngx_http_write_filter_batch(ngx_http_request_t *r,
+    off_t size, size_t max);
+static ngx_uint_t ngx_http_write_filter_pipelined(ngx_http_request_t *r);
+static void ngx_http_write_filter_batch_handler(ngx_event_t *ev);
+static void ngx_http_write_filter_batch_cleanup(void *data);
 static ngx_int_t ngx_http_write_filter_init(ngx_conf_t *cf);
 
 
@@ -48,10 +58,12 @@ ngx_int_t
 ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     off_t                      size, sent, nsent, limit;
-    ngx_uint_t                 last, flush, sync;
+    ngx_int_t                  rc;
+    ngx_uint_t                 last, flush, sync, paced;
     ngx_msec_t                 delay;
     ngx_chain_t               *cl, *ln, **ll, *chain;
     ngx_connection_t          *c;
+    ngx_http_output_batch_t   *batch;
     ngx_http_core_loc_conf_t  *clcf;
 
     c = r->connection;
@@ -193,6 +205,52 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_AGAIN;
     }
 
+    if (last && clcf->postpone_pipelined) {
+        rc = ngx_http_write_filter_batch(r, size, clcf->postpone_pipelined);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    batch = r->http_connection->batch;
+
+    if (batch
+        && !batch->queued
+        && batch->buf->pos != batch->buf->last)
+    {
+        /* send the postponed pipelined responses ahead of this one */
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        cl->buf = batch->buf;
+        cl->next = r->out;
+        r->out = cl;
+
+        batch->queued = 1;
+
+        if (batch->blocked) {
+            batch->blocked = 0;
+
+            if (c->write->timer_set) {
+                ngx_del_timer(c->write);
+            }
+        }
+
+        size += ngx_buf_size(batch->buf);
+
+        /* the bytes were already counted to the requests they belong to */
+
+        c->sent -= ngx_buf_size(batch->buf);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http write filter batch: %O",
+                       ngx_buf_size(batch->buf));
+    }
+
     if (size == 0
         && !(c->buffered & NGX_LOWLEVEL_BUFFERED)
         && !(last && c->need_last_buf))
@@ -218,32 +276,70 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
+    paced = 0;
+
     if (r->limit_rate) {
         if (r->limit_rate_after == 0) {
             r->limit_rate_after = clcf->limit_rate_after;
         }
 
-        limit = (off_t) r->limit_rate * (ngx_time() - r->start_sec + 1)
-                - (c->sent - r->limit_rate_after);
-
-        if (limit <= 0) {
-            c->write->delayed = 1;
-            delay = (ngx_msec_t) (- limit * 1000 / r->limit_rate + 1);
-            ngx_add_timer(c->write, delay);
+#if (NGX_HAVE_SO_MAX_PACING_RATE)
+        if (clcf->limit_rate_pacing
+            && ngx_http_write_filter_pacing(r) == NGX_OK)
+        {
+            paced = 1;
+        }
+#endif
 
-            c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+        if (paced) {
 
-            return NGX_AGAIN;
-        }
+            /*
+             * the kernel paces the socket at the rate, the only thing left
+             * to us is to stop at limit_rate_after to switch the pacing on
+             */
 
-        if (clcf->sendfile_max_chunk
-            && (off_t) clcf->sendfile_max_chunk < limit)
-        {
             limit = clcf->sendfile_max_chunk;
+
+            if (c->sent < (off_t) r->limit_rate_after
+                && (limit == 0
+                    || (off_t) r->limit_rate_after - c->sent < limit))
+            {
+                limit = r->limit_rate_after - c->sent;
+            }
+
+        } else {
+            limit = (off_t) r->limit_rate * (ngx_time() - r->start_sec + 1)
+                    - (c->sent - r->limit_rate_after);
+
+            if (limit <= 0) {
+                c->write->delayed = 1;
+                delay = (ngx_msec_t) (- limit * 1000 / r->limit_rate + 1);
+                ngx_add_timer(c->write, delay);
+
+                c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+
+                return NGX_AGAIN;
+            }
+
+            if (clcf->sendfile_max_chunk
+                && (off_t) clcf->sendfile_max_chunk < limit)
+            {
+                limit = clcf->sendfile_max_chunk;
+            }
         }
 
     } else {
         limit = clcf->sendfile_max_chunk;
+
+#if (NGX_HAVE_SO_MAX_PACING_RATE)
+        if (r->http_connection->pacing_rate) {
+            (void) ngx_http_write_filter_pacing(r);
+        }
+#endif
+    }
+
+    if (clcf->tcp_notsent_lowat) {
+        (void) ngx_http_write_filter_notsent_lowat(r, clcf->tcp_notsent_lowat);
     }
 
     sent = c->sent;
@@ -261,7 +357,7 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return NGX_ERROR;
     }
 
-    if (r->limit_rate) {
+    if (r->limit_rate && !paced) {
 
         nsent = c->sent;
 
@@ -318,6 +414,334 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
 }
 
 
+static ngx_int_t
+ngx_http_write_filter_notsent_lowat(ngx_http_request_t *r, size_t lowat)
+{
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        c = r->stream->connection->connection;
+    }
+#endif
+
+    if (c->notsent_lowat) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http write filter notsent lowat: %uz", lowat);
+
+    return ngx_notsent_lowat(c, lowat);
+}
+
+
+#if (NGX_HAVE_SO_MAX_PACING_RATE)
+
+static ngx_int_t
+ngx_http_write_filter_pacing(ngx_http_request_t *r)
+{
+    size_t                  rate;
+    unsigned int            value;
+    ngx_connection_t       *c;
+    ngx_http_connection_t  *hc;
+
+    c = r->connection;
+    hc = r->http_connection;
+
+#if (NGX_HTTP_V2)
+    if (r->stream) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if (hc->pacing_error) {
+        return NGX_DECLINED;
+    }
+
+    /* the rate of 0 means that the socket is not paced */
+
+    if (r->limit_rate && c->sent >= (off_t) r->limit_rate_after) {
+        rate = r->limit_rate;
+
+    } else {
+        rate = 0;
+    }
+
+    if (rate == hc->pacing_rate) {
+        return NGX_OK;
+    }
+
+    if (rate == 0 || rate >= NGX_MAX_UINT32_VALUE) {
+        value = NGX_MAX_UINT32_VALUE;
+
+    } else {
+        value = (unsigned int) rate;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http write filter pacing rate: %uz", rate);
+
+    if (setsockopt(c->fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                   (const void *) &value, sizeof(unsigned int))
+        == -1)
+    {
+        ngx_connection_error(c, ngx_socket_errno,
+                             "setsockopt(SO_MAX_PACING_RATE) failed");
+
+        hc->pacing_error = 1;
+
+        return NGX_DECLINED;
+    }
+
+    hc->pacing_rate = rate;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_write_filter_batch(ngx_http_request_t *r, off_t size, size_t max)
+{
+    ngx_buf_t                 *b;
+    ngx_chain_t               *cl, *ln;
+    ngx_connection_t          *c;
+    ngx_pool_cleanup_t        *cln;
+    ngx_http_connection_t     *hc;
+    ngx_http_output_batch_t   *batch;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    hc = r->http_connection;
+
+    if (r != r->main
+        || !r->keepalive
+        || ngx_terminate
+        || ngx_exiting
+        || r->limit_rate
+        || r->discard_body
+        || r->postponed
+        || (c->buffered & NGX_LOWLEVEL_BUFFERED)
+#if (NGX_HTTP_V2)
+        || r->stream
+#endif
+       )
+    {
+        return NGX_DECLINED;
+    }
+
+    for (cl = r->out; cl; cl = cl->next) {
+        if (cl->buf->in_file) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (!ngx_http_write_filter_pipelined(r)) {
+        return NGX_DECLINED;
+    }
+
+    batch = hc->batch;
+
+    if (batch == NULL) {
+        batch = ngx_pcalloc(c->pool, sizeof(ngx_http_output_batch_t));
+        if (batch == NULL) {
+            return NGX_ERROR;
+        }
+
+        batch->event = ngx_pcalloc(c->pool, sizeof(ngx_event_t));
+        if (batch->event == NULL) {
+            return NGX_ERROR;
+        }
+
+        batch->buf = ngx_create_temp_buf(c->pool, max);
+        if (batch->buf == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(c->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_write_filter_batch_cleanup;
+        cln->data = batch;
+
+        batch->connection = c;
+        batch->event->handler = ngx_http_write_filter_batch_handler;
+        batch->event->data = batch;
+        batch->event->log = c->log;
+
+        hc->batch = batch;
+    }
+
+    if (batch->blocked) {
+        /* the client does not keep up, send the response as is */
+        return NGX_DECLINED;
+    }
+
+    b = batch->buf;
+
+    if (batch->queued) {
+        if (b->pos != b->last) {
+            return NGX_DECLINED;
+        }
+
+        batch->queued = 0;
+    }
+
+    if (b->pos == b->last) {
+        b->pos = b->start;
+        b->last = b->start;
+    }
+
+    if (size > b->end - b->last) {
+        return NGX_DECLINED;
+    }
+
+    for (cl = r->out; cl; /* void */) {
+        if (ngx_buf_in_memory(cl->buf)) {
+            b->last = ngx_cpymem(b->last, cl->buf->pos,
+                                 cl->buf->last - cl->buf->pos);
+            cl->buf->pos = cl->buf->last;
+        }
+
+        ln = cl;
+        cl = cl->next;
+        ngx_free_chain(r->pool, ln);
+    }
+
+    r->out = NULL;
+    c->buffered &= ~NGX_HTTP_WRITE_BUFFERED;
+
+    /* the response is counted as sent to the request which produced it */
+
+    c->sent += size;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    batch->send_timeout = clcf->send_timeout;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http write filter postponed pipelined: %O, batch: %z",
+                   size, b->last - b->pos);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_write_filter_pipelined(ngx_http_request_t *r)
+{
+    u_char     *p;
+    ngx_buf_t  *b;
+
+    /*
+     * the response is postponed only if the header of the next pipelined
+     * request is already read completely, so the following response does
+     * not depend on the client sending more data
+     */
+
+    b = r->header_in;
+
+    for (p = b->pos; p + 1 < b->last; p++) {
+
+        if (*p != LF) {
+            continue;
+        }
+
+        if (p[1] == LF) {
+            return 1;
+        }
+
+        if (p[1] == CR && p + 2 < b->last && p[2] == LF) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_write_filter_batch_handler(ngx_event_t *ev)
+{
+    off_t                     sent;
+    ngx_chain_t               out, *chain;
+    ngx_connection_t         *c;
+    ngx_http_output_batch_t  *batch;
+
+    batch = ev->data;
+    c = batch->connection;
+
+    if (batch->queued || batch->buf->pos == batch->buf->last || c->error) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http write filter batch flush: %z",
+                   batch->buf->last - batch->buf->pos);
+
+    out.buf = batch->buf;
+    out.next = NULL;
+
+    /* the bytes were already counted to the requests they belong to */
+
+    sent = c->sent;
+
+    chain = c->send_chain(c, &out, 0);
+
+    c->sent = sent;
+
+    if (chain == NGX_CHAIN_ERROR) {
+        c->error = 1;
+        return;
+    }
+
+    if (batch->buf->pos != batch->buf->last) {
+
+        /*
+         * the rest is sent on the write event by ngx_http_request_handler(),
+         * or ahead of the next response by ngx_http_write_filter()
+         */
+
+        batch->blocked = 1;
+        c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+
+        ngx_add_timer(c->write, batch->send_timeout);
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            c->error = 1;
+        }
+
+        return;
+    }
+
+    if (batch->blocked) {
+        batch->blocked = 0;
+        c->buffered &= ~NGX_HTTP_WRITE_BUFFERED;
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+    }
+}
+
+
+static void
+ngx_http_write_filter_batch_cleanup(void *data)
+{
+    ngx_http_output_batch_t  *batch = data;
+
+    if (batch->event->posted) {
+        ngx_delete_posted_event(batch->event);
+    }
+}
+
+
 static ngx_int_t
 ngx_http_write_filter_init(ngx_conf_t *cf)
 {
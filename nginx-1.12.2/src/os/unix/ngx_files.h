@@ -16,6 +16,7 @@
 typedef int                      ngx_fd_t;
 typedef struct stat              ngx_file_info_t;
 typedef ino_t                    ngx_file_uniq_t;
+typedef dev_t                    ngx_file_dev_t;
 
 
 typedef struct {
@@ -153,6 +154,10 @@ ngx_write_fd(ngx_fd_t fd, void *buf, size_t n)
 #define ngx_write_console        ngx_write_fd
 
 
+#define ngx_truncate_file(fd, size)  ftruncate(fd, size)
+#define ngx_truncate_file_n      "ftruncate()"
+
+
 #define ngx_linefeed(p)          *p++ = LF;
 #define NGX_LINEFEED_SIZE        1
 #define NGX_LINEFEED             "\x0a"
@@ -186,8 +191,10 @@ ngx_int_t ngx_set_file_time(u_char *name, ngx_fd_t fd, time_t s);
 #define ngx_file_access(sb)      ((sb)->st_mode & 0777)
 #define ngx_file_size(sb)        (sb)->st_size
 #define ngx_file_fs_size(sb)     ngx_max((sb)->st_size, (sb)->st_blocks * 512)
+#define ngx_file_fs_used(sb)     ((off_t) (sb)->st_blocks * 512)
 #define ngx_file_mtime(sb)       (sb)->st_mtime
 #define ngx_file_uniq(sb)        (sb)->st_ino
+#define ngx_file_dev(sb)         (sb)->st_dev
 
 
 ngx_int_t ngx_create_file_mapping(ngx_file_mapping_t *fm);
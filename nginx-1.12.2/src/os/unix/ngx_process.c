@@ -175,9 +175,46 @@ ngx_spawn_process(ngx_cycle_t *cycle, ngx_spawn_proc_pt proc, void *data,
 
         ngx_channel = ngx_processes[s].channel[1];
 
+        /*
+         * the datagram socket pair siblings use to wake the process up,
+         * unlike the channel it may have several writers at once
+         */
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ngx_processes[s].wakeup) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "socketpair() failed while spawning \"%s\"", name);
+            ngx_close_channel(ngx_processes[s].channel, cycle->log);
+            return NGX_INVALID_PID;
+        }
+
+        if (ngx_nonblocking(ngx_processes[s].wakeup[0]) == -1
+            || ngx_nonblocking(ngx_processes[s].wakeup[1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          ngx_nonblocking_n " failed while spawning \"%s\"",
+                          name);
+            ngx_close_channel(ngx_processes[s].channel, cycle->log);
+            ngx_close_channel(ngx_processes[s].wakeup, cycle->log);
+            return NGX_INVALID_PID;
+        }
+
+        if (fcntl(ngx_processes[s].wakeup[0], F_SETFD, FD_CLOEXEC) == -1
+            || fcntl(ngx_processes[s].wakeup[1], F_SETFD, FD_CLOEXEC) == -1)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "fcntl(FD_CLOEXEC) failed while spawning \"%s\"",
+                           name);
+            ngx_close_channel(ngx_processes[s].channel, cycle->log);
+            ngx_close_channel(ngx_processes[s].wakeup, cycle->log);
+            return NGX_INVALID_PID;
+        }
+
     } else {
         ngx_processes[s].channel[0] = -1;
         ngx_processes[s].channel[1] = -1;
+        ngx_processes[s].wakeup[0] = -1;
+        ngx_processes[s].wakeup[1] = -1;
     }
 
     ngx_process_slot = s;
@@ -191,6 +228,11 @@ ngx_spawn_process(ngx_cycle_t *cycle, ngx_spawn_proc_pt proc, void *data,
         ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
                       "fork() failed while spawning \"%s\"", name);
         ngx_close_channel(ngx_processes[s].channel, cycle->log);
+
+        if (ngx_processes[s].wakeup[0] != -1) {
+            ngx_close_channel(ngx_processes[s].wakeup, cycle->log);
+        }
+
         return NGX_INVALID_PID;
 
     case 0:
@@ -23,6 +23,7 @@ typedef struct {
     ngx_pid_t           pid;
     int                 status;
     ngx_socket_t        channel[2];
+    ngx_socket_t        wakeup[2];
 
     ngx_spawn_proc_pt   proc;
     void               *data;
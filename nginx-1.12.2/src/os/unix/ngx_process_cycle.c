@@ -23,6 +23,7 @@ static void ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker);
 static void ngx_worker_process_exit(ngx_cycle_t *cycle);
 static void ngx_channel_handler(ngx_event_t *ev);
+static void ngx_wakeup_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
@@ -51,18 +52,27 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_wakeup_handler_pt  ngx_wakeup_handler;
+
 
 static u_char  master_process[] = "master process";
 
 
 static ngx_cache_manager_ctx_t  ngx_cache_manager_ctx = {
-    ngx_cache_manager_process_handler, "cache manager process", 0
+    ngx_cache_manager_process_handler, "cache manager process", 0, 0, 1
 };
 
 static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
-    ngx_cache_loader_process_handler, "cache loader process", 60000
+    ngx_cache_loader_process_handler, "cache loader process", 60000, 0, 1
 };
 
+/*
+ * the contexts of several cache managers live as long as the master,
+ * the processes may be respawned with them after the cycle is gone
+ */
+
+static ngx_cache_manager_ctx_t  ngx_cache_managers_ctx[NGX_MAX_PROCESSES];
+
 
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
@@ -370,9 +380,11 @@ ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n, ngx_int_t type)
 static void
 ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 {
-    ngx_uint_t       i, manager, loader;
-    ngx_path_t     **path;
-    ngx_channel_t    ch;
+    ngx_uint_t                i, n, manager, loader;
+    ngx_path_t              **path;
+    ngx_channel_t             ch;
+    ngx_core_conf_t          *ccf;
+    ngx_cache_manager_ctx_t  *ctx;
 
     manager = 0;
     loader = 0;
@@ -381,7 +393,7 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
     for (i = 0; i < ngx_cycle->paths.nelts; i++) {
 
         if (path[i]->manager) {
-            manager = 1;
+            manager++;
         }
 
         if (path[i]->loader) {
@@ -393,18 +405,47 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
         return;
     }
 
-    ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
-                      &ngx_cache_manager_ctx, "cache manager process",
-                      respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    /* each cache manager process owns every n-th cache path */
+
+    n = ccf->cache_manager_processes;
+
+    if (n == 0 || n > manager) {
+        n = manager;
+    }
+
+    if (n > NGX_MAX_PROCESSES) {
+        n = NGX_MAX_PROCESSES;
+    }
 
     ngx_memzero(&ch, sizeof(ngx_channel_t));
 
-    ch.command = NGX_CMD_OPEN_CHANNEL;
-    ch.pid = ngx_processes[ngx_process_slot].pid;
-    ch.slot = ngx_process_slot;
-    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+    for (i = 0; i < n; i++) {
 
-    ngx_pass_open_channel(cycle, &ch);
+        if (n == 1) {
+            ctx = &ngx_cache_manager_ctx;
+
+        } else {
+            ctx = &ngx_cache_managers_ctx[i];
+
+            *ctx = ngx_cache_manager_ctx;
+            ctx->manager = i;
+            ctx->managers = n;
+        }
+
+        ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+                          ctx, "cache manager process",
+                          respawn ? NGX_PROCESS_JUST_RESPAWN
+                                  : NGX_PROCESS_RESPAWN);
+
+        ch.command = NGX_CMD_OPEN_CHANNEL;
+        ch.pid = ngx_processes[ngx_process_slot].pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+        ngx_pass_open_channel(cycle, &ch);
+    }
 
     if (loader == 0) {
         return;
@@ -426,7 +467,12 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 static void
 ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
 {
-    ngx_int_t  i;
+    ngx_int_t      i;
+    ngx_channel_t  wakeup;
+
+    wakeup = *ch;
+    wakeup.command = NGX_CMD_OPEN_WAKEUP;
+    wakeup.fd = ngx_processes[ch->slot].wakeup[0];
 
     for (i = 0; i < ngx_last_process; i++) {
 
@@ -447,6 +493,42 @@ ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
 
         ngx_write_channel(ngx_processes[i].channel[0],
                           ch, sizeof(ngx_channel_t), cycle->log);
+
+        if (wakeup.fd != -1) {
+            ngx_write_channel(ngx_processes[i].channel[0],
+                              &wakeup, sizeof(ngx_channel_t), cycle->log);
+        }
+    }
+}
+
+
+/*
+ * Every process has a datagram socket its siblings may write to,
+ * to make it run ngx_wakeup_handler, e.g. when a resource some of its
+ * requests are waiting for became available.  The data word lets the
+ * handlers tell which resource it is.  The wakeup is only a hint:
+ * if the socket buffer is full, it is silently dropped.
+ */
+
+void
+ngx_wakeup_worker_processes(ngx_cycle_t *cycle, ngx_uint_t data)
+{
+    ngx_int_t  i;
+
+    for (i = 0; i < ngx_last_process; i++) {
+
+        if (i == ngx_process_slot
+            || ngx_processes[i].pid == -1
+            || ngx_processes[i].wakeup[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_log_debug3(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                       "wakeup s:%i pid:%P data:%ui",
+                       i, ngx_processes[i].pid, data);
+
+        (void) send(ngx_processes[i].wakeup[0], &data, sizeof(ngx_uint_t), 0);
     }
 }
 
@@ -587,9 +669,12 @@ ngx_reap_children(ngx_cycle_t *cycle)
 
             if (!ngx_processes[i].detached) {
                 ngx_close_channel(ngx_processes[i].channel, cycle->log);
+                ngx_close_channel(ngx_processes[i].wakeup, cycle->log);
 
                 ngx_processes[i].channel[0] = -1;
                 ngx_processes[i].channel[1] = -1;
+                ngx_processes[i].wakeup[0] = -1;
+                ngx_processes[i].wakeup[1] = -1;
 
                 ch.pid = ngx_processes[i].pid;
                 ch.slot = i;
@@ -920,6 +1005,13 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
             ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
                           "close() channel failed");
         }
+
+        if (close(ngx_processes[n].wakeup[1]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "close() wakeup socket failed");
+        }
+
+        ngx_processes[n].wakeup[1] = -1;
     }
 
     if (close(ngx_processes[ngx_process_slot].channel[0]) == -1) {
@@ -927,6 +1019,13 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
                       "close() channel failed");
     }
 
+    if (close(ngx_processes[ngx_process_slot].wakeup[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "close() wakeup socket failed");
+    }
+
+    ngx_processes[ngx_process_slot].wakeup[0] = -1;
+
 #if 0
     ngx_last_process = 0;
 #endif
@@ -938,6 +1037,14 @@ ngx_worker_process_init(ngx_cycle_t *cycle, ngx_int_t worker)
         /* fatal */
         exit(2);
     }
+
+    if (ngx_add_channel_event(cycle, ngx_processes[ngx_process_slot].wakeup[1],
+                              NGX_READ_EVENT, ngx_wakeup_channel_handler)
+        == NGX_ERROR)
+    {
+        /* fatal */
+        exit(2);
+    }
 }
 
 
@@ -1069,6 +1176,20 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
+            break;
+
+        case NGX_CMD_OPEN_WAKEUP:
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get wakeup socket s:%i pid:%P fd:%d",
+                           ch.slot, ch.pid, ch.fd);
+
+            ngx_processes[ch.slot].wakeup[0] = ch.fd;
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1084,8 +1205,63 @@ ngx_channel_handler(ngx_event_t *ev)
             }
 
             ngx_processes[ch.slot].channel[0] = -1;
+
+            if (ngx_processes[ch.slot].wakeup[0] != -1) {
+                if (close(ngx_processes[ch.slot].wakeup[0]) == -1) {
+                    ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                                  "close() wakeup socket failed");
+                }
+
+                ngx_processes[ch.slot].wakeup[0] = -1;
+            }
+
+            break;
+        }
+    }
+}
+
+
+static void
+ngx_wakeup_channel_handler(ngx_event_t *ev)
+{
+    ssize_t            n;
+    ngx_uint_t         data;
+    ngx_connection_t  *c;
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+        return;
+    }
+
+    c = ev->data;
+
+    for ( ;; ) {
+
+        n = recv(c->fd, &data, sizeof(ngx_uint_t), 0);
+
+        if (n == -1) {
+            if (ngx_socket_errno != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                              "recv() wakeup socket failed");
+            }
+
             break;
         }
+
+        if (n != sizeof(ngx_uint_t)) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "wakeup data: %ui", data);
+
+        if (ngx_wakeup_handler) {
+            ngx_wakeup_handler((ngx_cycle_t *) ngx_cycle, data);
+        }
+    }
+
+    if (ngx_event_flags & NGX_USE_EVENTPORT_EVENT) {
+        (void) ngx_add_event(ev, NGX_READ_EVENT, 0);
     }
 }
 
@@ -1115,6 +1291,7 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
     ev.handler = ctx->handler;
     ev.data = ident;
     ev.log = cycle->log;
+    ident[0] = ctx;
     ident[3] = (void *) -1;
 
     ngx_use_accept_mutex = 0;
@@ -1144,22 +1321,32 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 static void
 ngx_cache_manager_process_handler(ngx_event_t *ev)
 {
-    ngx_uint_t    i;
-    ngx_msec_t    next, n;
-    ngx_path_t  **path;
+    ngx_uint_t                i, m;
+    ngx_msec_t                next, n;
+    ngx_path_t              **path;
+    ngx_cache_manager_ctx_t  *ctx;
+
+    ctx = ((void **) ev->data)[0];
 
     next = 60 * 60 * 1000;
+    m = 0;
 
     path = ngx_cycle->paths.elts;
     for (i = 0; i < ngx_cycle->paths.nelts; i++) {
 
-        if (path[i]->manager) {
-            n = path[i]->manager(path[i]->data);
-
-            next = (n <= next) ? n : next;
+        if (path[i]->manager == NULL) {
+            continue;
+        }
 
-            ngx_time_update();
+        if (m++ % ctx->managers != ctx->manager) {
+            continue;
         }
+
+        n = path[i]->manager(path[i]->data);
+
+        next = (n <= next) ? n : next;
+
+        ngx_time_update();
     }
 
     if (next == 0) {
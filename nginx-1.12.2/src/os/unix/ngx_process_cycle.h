@@ -18,6 +18,7 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_OPEN_WAKEUP    6
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -31,11 +32,17 @@ typedef struct {
     ngx_event_handler_pt       handler;
     char                      *name;
     ngx_msec_t                 delay;
+    ngx_uint_t                 manager;
+    ngx_uint_t                 managers;
 } ngx_cache_manager_ctx_t;
 
 
+typedef void (*ngx_wakeup_handler_pt)(ngx_cycle_t *cycle, ngx_uint_t data);
+
+
 void ngx_master_process_cycle(ngx_cycle_t *cycle);
 void ngx_single_process_cycle(ngx_cycle_t *cycle);
+void ngx_wakeup_worker_processes(ngx_cycle_t *cycle, ngx_uint_t data);
 
 
 extern ngx_uint_t      ngx_process;
@@ -57,5 +64,7 @@ extern sig_atomic_t    ngx_reconfigure;
 extern sig_atomic_t    ngx_reopen;
 extern sig_atomic_t    ngx_change_binary;
 
+extern ngx_wakeup_handler_pt  ngx_wakeup_handler;
+
 
 #endif /* _NGX_PROCESS_CYCLE_H_INCLUDED_ */
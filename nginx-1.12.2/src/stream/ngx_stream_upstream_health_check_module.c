@@ -0,0 +1,618 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+
+    ngx_stream_upstream_srv_conf_t     *upstream;
+    ngx_event_t                         event;
+} ngx_stream_upstream_hc_srv_conf_t;
+
+
+typedef struct ngx_stream_upstream_hc_peer_s  ngx_stream_upstream_hc_peer_t;
+
+struct ngx_stream_upstream_hc_peer_s {
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_rr_peer_t      *peer;
+
+    ngx_pool_t                         *pool;
+    ngx_log_t                           log;
+    ngx_peer_connection_t               pc;
+    ngx_str_t                           name;
+
+    ngx_stream_upstream_hc_peer_t      *next;
+};
+
+
+static void ngx_stream_upstream_hc_handler(ngx_event_t *ev);
+static ngx_stream_upstream_hc_peer_t *ngx_stream_upstream_hc_create_peer(
+    ngx_stream_upstream_hc_srv_conf_t *hccf,
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer);
+static void ngx_stream_upstream_hc_connect(ngx_stream_upstream_hc_peer_t *hp);
+static void ngx_stream_upstream_hc_connect_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_hc_finalize(ngx_stream_upstream_hc_peer_t *hp,
+    ngx_uint_t ok);
+static ngx_int_t ngx_stream_upstream_hc_test_connect(ngx_connection_t *c);
+static u_char *ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+
+static void *ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_stream_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_health_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_upstream_hc_postconfiguration, /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_stream_upstream_hc_create_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_hc_module_ctx,    /* module context */
+    ngx_stream_upstream_hc_commands,       /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_hc_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_stream_upstream_hc_handler(ngx_event_t *ev)
+{
+    ngx_msec_t                          now;
+    ngx_uint_t                          i;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_peer_t      *hp, *list;
+    ngx_stream_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = ev->data;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "stream upstream health check \"%V\"",
+                   &hccf->upstream->host);
+
+    /* peers are claimed as in ngx_http_upstream_health_check_module */
+
+    now = ngx_current_msec;
+    list = NULL;
+
+    peers = hccf->upstream->peer.data;
+
+    for (i = 0; peers && i < 2; i++, peers = peers->next) {
+
+        ngx_stream_upstream_rr_peers_wlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down) {
+                continue;
+            }
+
+            if ((ngx_msec_int_t) (now - peer->hc_next) < 0) {
+                continue;
+            }
+
+            peer->hc_next = now + hccf->interval;
+
+            hp = ngx_stream_upstream_hc_create_peer(hccf, peers, peer);
+            if (hp == NULL) {
+                continue;
+            }
+
+            hp->next = list;
+            list = hp;
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+    }
+
+    while (list) {
+        hp = list;
+        list = hp->next;
+
+        ngx_stream_upstream_hc_connect(hp);
+    }
+
+    ngx_add_timer(ev, hccf->interval);
+}
+
+
+static ngx_stream_upstream_hc_peer_t *
+ngx_stream_upstream_hc_create_peer(ngx_stream_upstream_hc_srv_conf_t *hccf,
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_pool_t                     *pool;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    pool = ngx_create_pool(512, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    hp = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_hc_peer_t));
+    if (hp == NULL) {
+        goto failed;
+    }
+
+    hp->conf = hccf;
+    hp->peers = peers;
+    hp->peer = peer;
+    hp->pool = pool;
+
+    hp->pc.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (hp->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(hp->pc.sockaddr, peer->sockaddr, peer->socklen);
+    hp->pc.socklen = peer->socklen;
+
+    hp->name.data = ngx_pstrdup(pool, &peer->name);
+    if (hp->name.data == NULL) {
+        goto failed;
+    }
+
+    hp->name.len = peer->name.len;
+
+    hp->log = *ngx_cycle->log;
+    hp->log.handler = ngx_stream_upstream_hc_log_error;
+    hp->log.data = hp;
+    hp->log.action = "health checking";
+
+    pool->log = &hp->log;
+
+    hp->pc.name = &hp->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = &hp->log;
+    hp->pc.log_error = NGX_ERROR_ERR;
+
+    return hp;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_stream_upstream_hc_connect(ngx_stream_upstream_hc_peer_t *hp)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, &hp->log, 0,
+                   "stream upstream health check connect: %V", &hp->name);
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_stream_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_hc_finalize(hp, 1);
+        return;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+
+    c->write->handler = ngx_stream_upstream_hc_connect_handler;
+    c->read->handler = ngx_stream_upstream_hc_connect_handler;
+
+    ngx_add_timer(c->write, hp->conf->timeout);
+}
+
+
+static void
+ngx_stream_upstream_hc_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t               *c;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    c = ev->data;
+    hp = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "stream upstream health check connect handler");
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, NGX_ETIMEDOUT,
+                      "health check timed out");
+        ngx_stream_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    ngx_stream_upstream_hc_finalize(hp,
+                           ngx_stream_upstream_hc_test_connect(c) == NGX_OK);
+}
+
+
+static void
+ngx_stream_upstream_hc_finalize(ngx_stream_upstream_hc_peer_t *hp,
+    ngx_uint_t ok)
+{
+    ngx_uint_t                          changed;
+    ngx_stream_upstream_rr_peer_t      *peer;
+    ngx_stream_upstream_rr_peers_t     *peers;
+    ngx_stream_upstream_hc_srv_conf_t  *hccf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, &hp->log, 0,
+                   "stream upstream health check %V: %ui", &hp->name, ok);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    hccf = hp->conf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    changed = 0;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    if (ok) {
+        peer->hc_fails = 0;
+
+        if (peer->hc_down && ++peer->hc_passes >= hccf->passes) {
+            peer->hc_down = 0;
+            peer->hc_passes = 0;
+            peer->fails = 0;
+
+            ngx_stream_upstream_rr_peer_start(peer);
+
+            changed = 1;
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!peer->hc_down && ++peer->hc_fails >= hccf->fails) {
+            peer->hc_down = 1;
+            peer->hc_fails = 0;
+
+            changed = 1;
+        }
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    if (changed && ok) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is healthy",
+                      &hp->name, &hccf->upstream->host);
+
+    } else if (changed) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "upstream server %V in upstream \"%V\" is unhealthy",
+                      &hp->name, &hccf->upstream->host);
+    }
+
+    ngx_destroy_pool(hp->pool);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            err = c->write->pending_eof ? c->write->kq_errno
+                                        : c->read->kq_errno;
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+#endif
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_stream_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                         *p;
+    ngx_stream_upstream_hc_peer_t  *hp;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    hp = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", server: %V",
+                     &hp->conf->upstream->host, &hp->name);
+
+    return p;
+}
+
+
+static void *
+ngx_stream_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream = NULL;
+     *     conf->event = { 0 };
+     */
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_hc_srv_conf_t *hccf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (hccf->interval != NGX_CONF_UNSET_MSEC) {
+        return "is duplicate";
+    }
+
+    hccf->upstream = ngx_stream_conf_get_module_srv_conf(cf,
+                                                   ngx_stream_upstream_module);
+    hccf->interval = 5000;
+    hccf->timeout = 1000;
+    hccf->fails = 1;
+    hccf->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hccf->interval = ngx_parse_time(&s, 0);
+
+            if (hccf->interval == (ngx_msec_t) NGX_ERROR
+                || hccf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hccf->timeout = ngx_parse_time(&s, 0);
+
+            if (hccf->timeout == (ngx_msec_t) NGX_ERROR
+                || hccf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->passes = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                           i;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_hc_srv_conf_t   *hccf;
+    ngx_stream_upstream_main_conf_t     *umcf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                      ngx_stream_upstream_health_check_module);
+
+        if (hccf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                           i;
+    ngx_event_t                         *ev;
+    ngx_stream_upstream_srv_conf_t     **uscfp;
+    ngx_stream_upstream_hc_srv_conf_t   *hccf;
+    ngx_stream_upstream_main_conf_t     *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_stream_conf_upstream_srv_conf(uscfp[i],
+                                      ngx_stream_upstream_health_check_module);
+
+        if (hccf->interval == NGX_CONF_UNSET_MSEC) {
+            continue;
+        }
+
+        ev = &hccf->event;
+
+        ev->handler = ngx_stream_upstream_hc_handler;
+        ev->data = hccf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, ngx_random() % hccf->interval + 1);
+    }
+
+    return NGX_OK;
+}
@@ -13,9 +13,19 @@
 #define ngx_stream_upstream_tries(p) ((p)->number                             \
                                       + ((p)->next ? (p)->next->number : 0))
 
+/*
+ * weights are scaled in the smooth weighted round-robin balancing,
+ * so that the weight of a peer in slow start grows gradually even if
+ * the configured weight is 1
+ */
+
+#define NGX_STREAM_UPSTREAM_RR_SCALE  100
+
 
 static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_get_peer(
     ngx_stream_upstream_rr_peer_data_t *rrp);
+static ngx_int_t ngx_stream_upstream_rr_peer_weight(
+    ngx_stream_upstream_rr_peer_t *peer);
 static void ngx_stream_upstream_notify_round_robin_peer(
     ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
 
@@ -101,6 +111,7 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
 
@@ -165,6 +176,7 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].max_conns = server[i].max_conns;
                 peer[n].max_fails = server[i].max_fails;
                 peer[n].fail_timeout = server[i].fail_timeout;
+                peer[n].slow_start = server[i].slow_start;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
 
@@ -444,7 +456,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down) {
             goto failed;
         }
 
@@ -518,7 +530,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 {
     time_t                          now;
     uintptr_t                       m;
-    ngx_int_t                       total;
+    ngx_int_t                       w, total;
     ngx_uint_t                      i, n, p;
     ngx_stream_upstream_rr_peer_t  *peer, *best;
 
@@ -542,7 +554,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->hc_down) {
             continue;
         }
 
@@ -557,8 +569,10 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
-        total += peer->effective_weight;
+        w = ngx_stream_upstream_rr_peer_weight(peer);
+
+        peer->current_weight += w;
+        total += w;
 
         if (peer->effective_weight < peer->weight) {
             peer->effective_weight++;
@@ -591,6 +605,35 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_rr_peer_weight(ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_int_t       w;
+    ngx_msec_int_t  elapsed;
+
+    w = peer->effective_weight * NGX_STREAM_UPSTREAM_RR_SCALE;
+
+    if (peer->start_time == 0) {
+        return w;
+    }
+
+    /* the start time may be set by a worker whose clock is a bit ahead */
+
+    elapsed = (ngx_msec_int_t) (ngx_current_msec - peer->start_time);
+
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+
+    if ((ngx_msec_t) elapsed >= peer->slow_start) {
+        peer->start_time = 0;
+        return w;
+    }
+
+    return (ngx_int_t) ((uint64_t) w * elapsed / peer->slow_start);
+}
+
+
 void
 ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
@@ -647,6 +690,11 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         /* mark peer live if check passed */
 
         if (peer->accessed < peer->checked) {
+
+            if (peer->max_fails && peer->fails >= peer->max_fails) {
+                ngx_stream_upstream_rr_peer_start(peer);
+            }
+
             peer->fails = 0;
         }
     }
@@ -40,6 +40,11 @@ struct ngx_stream_upstream_rr_peer_s {
 
     ngx_uint_t                       down;
 
+    ngx_uint_t                       hc_down;
+    ngx_uint_t                       hc_fails;
+    ngx_uint_t                       hc_passes;
+    ngx_msec_t                       hc_next;
+
     void                            *ssl_session;
     int                              ssl_session_len;
 
@@ -122,6 +127,12 @@ struct ngx_stream_upstream_rr_peers_s {
 #endif
 
 
+/* a peer put into service ramps its weight up during slow_start */
+
+#define ngx_stream_upstream_rr_peer_start(peer)                               \
+    (peer)->start_time = (peer)->slow_start ? ngx_current_msec : 0
+
+
 typedef struct {
     ngx_uint_t                       config;
     ngx_stream_upstream_rr_peers_t  *peers;